@@ -12,6 +12,11 @@
 
 typedef struct
 {
+    /* Same for a touch from the frame it began in to the last one it is
+     * part of, 0 when the input does not tell.
+     */
+    uint32_t id;
+
     double timestamp;
     uint32_t tap_count;
     enum
@@ -77,14 +82,145 @@ extern mt_event_t *
 mt_event_copy
             (const mt_event_t * event);
 
+/**
+ * Merge two successive frames of a sender into a copy of 'newer' keeping
+ * the INPUT_TOUCH_BEGAN phases of 'older', return 0 if a beginning touch
+ * would be lost (i.e. 'newer' does not have it anymore). Touches are 
+ * matched by id when both frames have them, by index otherwise.
+ */
+extern mt_event_t *
+mt_event_coalesce
+            (const mt_event_t * older,
+            const mt_event_t * newer);
+
+/* Compact encoding of events, portable & about 5 times smaller than 
+ * the serialized in memory structure: coordinates & sizes are 
+ * normalized values quantized on 16 bits, touches' timestamps are 
+ * stored relatively to the event's one.
+ */
+extern size_t
+mt_event_get_encoded_length
+            (const mt_event_t * event);
+
+/**
+ * Encode 'event' into 'buffer', return the encoded length or 0 if 
+ * 'buffer' is too small.
+ */
+extern size_t
+mt_event_encode
+            (const mt_event_t * event,
+            void * buffer,
+            size_t size);
+
+/* Read-only view on an encoded event, which reads touches directly out
+ * of the encoded buffer.
+ */
+typedef struct
+{
+    const uint8_t * data;
+    size_t length;
+
+    uint8_t version;
+    uint8_t record_length;
+
+    uint32_t flags;
+    double timestamp;
+    uint16_t touch_count;
+}
+mt_event_view_t;
+
+/**
+ * Return -1 if 'data' is not a valid encoded event, 'data' must
+ * outlive the view.
+ */
+extern int
+mt_event_view_init
+            (mt_event_view_t * view,
+            const void * data,
+            size_t length);
+
+extern void
+mt_event_view_get_touch
+            (const mt_event_view_t * view,
+            uint16_t index,
+            mt_event_touch_t * touch);
+
+extern void
+mt_event_view_get_origin
+            (const mt_event_view_t * view,
+            uint16_t index,
+            double * x,
+            double * y);
+
+extern mt_event_t *
+mt_event_view_decode
+            (const mt_event_view_t * view);
+
+/* Structure of arrays layout of events, for engines working on all the 
+ * touches at once. Each array holds 'touch_count' values, starts on a 
+ * MT_EVENT_SOA_ALIGNMENT bytes boundary & is zero padded to a multiple of
+ * it, so kernels can load whole vectors.
+ */
+#define MT_EVENT_SOA_ALIGNMENT 32
+
+typedef struct
+{
+    struct
+    {
+        uint32_t flags;
+        double timestamp;
+
+        uint16_t touch_count;
+    }
+    info;
+
+    uint32_t * ids;
+    uint32_t * tap_counts;
+    uint32_t * phases;
+
+    double * timestamps;
+    double * x;
+    double * y;
+    double * width;
+    double * height;
+}
+mt_event_soa_t;
+
+extern mt_event_soa_t *
+mt_event_soa_init
+            (uint16_t touch_count);
+
+extern void
+mt_event_soa_destroy
+            (mt_event_soa_t * event);
+
+extern mt_event_soa_t *
+mt_event_soa_copy
+            (const mt_event_soa_t * event);
+
+extern mt_event_soa_t *
+mt_event_to_soa
+            (const mt_event_t * event);
+
+extern mt_event_t *
+mt_event_from_soa
+            (const mt_event_soa_t * event);
+
             
 typedef struct
 {
+    /* Number of owners sharing this packet, 0 for packets which were not
+     * built by a mt_packet_ constructor: such packets (e.g. on the stack)
+     * must be zero-initialized, so that they are copied when acquired.
+     */
+    volatile uint32_t reference_count;
+
     enum
     {
         PACKET_EMPTY,
         PACKET_EVENT,
-        PACKET_RAW
+        PACKET_RAW,
+        PACKET_EVENT_SOA
     }
     type;
 
@@ -103,6 +239,12 @@ typedef struct
             void (*destructor)(mt_event_t * event);
         }
         event;
+        struct
+        {
+            mt_event_soa_t * event;
+            void (*destructor)(mt_event_soa_t * event);
+        }
+        event_soa;
     }
     content;
 }
@@ -113,6 +255,11 @@ mt_packet_init_event
             (mt_event_t * event,
             void (*destructor)(mt_event_t * event));
 
+extern mt_packet_t *
+mt_packet_init_event_soa
+            (mt_event_soa_t * event,
+            void (*destructor)(mt_event_soa_t * event));
+
 extern mt_packet_t *
 mt_packet_init_raw
             (void * data,
@@ -124,6 +271,11 @@ extern void
 mt_packet_destroy
             (mt_packet_t * packet);
 
+/**
+ * Structure of arrays event packets only live within chains, which give
+ * event packets to their listener, & are not serializable: 0 is returned
+ * for them.
+ */
 extern const void *
 mt_packet_serialize
             (const mt_packet_t * packet);
@@ -136,11 +288,182 @@ extern mt_packet_t *
 mt_packet_copy
             (const mt_packet_t * packet);
 
+/**
+ * Length & encoding of event packets, of both layouts, use the compact 
+ * event encoding, raw packets are copied as is.
+ */
+extern size_t
+mt_packet_get_encoded_length
+            (const mt_packet_t * packet);
+
+extern size_t
+mt_packet_encode
+            (const mt_packet_t * packet,
+            void * buffer,
+            size_t size);
+
+/**
+ * Take a shared reference on an immutable packet.
+ * The returned packet may be the same as 'packet', or a private copy if 
+ * 'packet' is not reference counted. Packets committed by inputs or sent
+ * to the next layer are acquired by outputs, and must not be modified
+ * afterwards.
+ */
+extern const mt_packet_t *
+mt_packet_acquire
+            (const mt_packet_t * packet);
+
+/**
+ * Drop a reference, the packet's destructors are called on the last one.
+ */
+extern void
+mt_packet_release
+            (const mt_packet_t * packet);
+
+
+/* Size classes of the pool: packet envelope, then events of 
+ * 1, 2, 5, 10, 20 & 32 touches.
+ */
+#define MT_POOL_CLASSES_COUNT 7
+
+typedef struct
+{
+    struct
+    {
+        size_t block_size;
+
+        /* Allocations served by the pool & by the heap */
+        uint64_t hits;
+        uint64_t misses;
+
+        /* Blocks freed by a thread which did not allocate them */
+        uint64_t remote_frees;
+    }
+    classes [MT_POOL_CLASSES_COUNT];
+
+    /* Allocations bigger than the biggest class, always served by the heap */
+    uint64_t oversized_allocations;
+}
+mt_pool_stats_t;
+
+/**
+ * Allocate from the calling thread's pool, blocks can be freed 
+ * from any thread.
+ */
+extern void *
+mt_pool_alloc
+            (size_t size);
+
+extern void
+mt_pool_free
+            (void * data);
+
+extern void
+mt_pool_get_stats
+            (mt_pool_stats_t * stats);
+
+/* Latencies in nanoseconds, counted into 2^MT_HISTOGRAM_SUB_BUCKETS_BITS 
+ * linear buckets per power of two, i.e. with about 6% of precision.
+ * Histograms can be updated by several threads at once.
+ */
+#define MT_HISTOGRAM_SUB_BUCKETS_BITS 4
+#define MT_HISTOGRAM_BUCKETS (64 << MT_HISTOGRAM_SUB_BUCKETS_BITS)
+
+typedef struct
+{
+    volatile uint64_t counts [MT_HISTOGRAM_BUCKETS];
+    volatile uint64_t max;
+}
+mt_histogram_t;
+
+extern void
+mt_histogram_add
+            (mt_histogram_t * histogram,
+            uint64_t value);
+
+extern void
+mt_histogram_merge
+            (mt_histogram_t * histogram,
+            const mt_histogram_t * other);
+
+extern uint64_t
+mt_histogram_get_count
+            (const mt_histogram_t * histogram);
+
+/**
+ * Return the lower bound of the bucket holding 'percentile' 
+ * (between 0 & 100) of the values.
+ */
+extern uint64_t
+mt_histogram_get_percentile
+            (const mt_histogram_t * histogram,
+            double percentile);
+
+/**
+ * Start or stop recording the latencies of inputs, chains' layers & 
+ * outputs, return -1 when the library was built without MT_WITH_STATS.
+ */
+extern int
+mt_stats_enable
+            (int enable);
+
+
+/**
+ * Start the pool of 'workers_count' threads running outputs initialized 
+ * with the "shared" execution option, one per processor if 0. Outputs 
+ * start it when needed, return -1 if it is already started.
+ */
+extern int
+mt_workers_start
+            (uint16_t workers_count);
+
+/**
+ * Stop the pool, once every shared output is destroyed.
+ */
+extern void
+mt_workers_stop(void);
+
+extern uint16_t
+mt_workers_get_count(void);
+
+
+/* Packets' emitters are identified by a small integer, interned once from
+ * their name (e.g. when an input is initialized).
+ */
+typedef uint16_t mt_sender_t;
+
+#define MT_SENDER_MAX 1024
+#define MT_SENDER_INVALID ((mt_sender_t)0xffff)
+
+/**
+ * Return the sender identifying 'name', creating it if needed.
+ * Return MT_SENDER_INVALID if the table is full.
+ */
+extern mt_sender_t
+mt_sender_intern
+            (const char * name);
+
+/**
+ * Return the sender identifying 'name' or MT_SENDER_INVALID if it
+ * was never interned.
+ */
+extern mt_sender_t
+mt_sender_lookup
+            (const char * name);
+
+/**
+ * Return "?" for senders which were never interned, e.g. 
+ * MT_SENDER_INVALID.
+ */
+extern const char *
+mt_sender_get_name
+            (mt_sender_t sender);
+
 
 typedef int
 (*mt_device_packet_process_t)
             (void * data,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
 
 
@@ -154,9 +477,16 @@ typedef struct _chain_layer_driver_data_t mt_chain_layer_driver_data_t;
 typedef int
 (*mt_chain_driver_accept_t)
             (mt_chain_layer_t * layer,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
 
+typedef enum
+{
+    MT_CHAIN_LAYOUT_EVENT,
+    MT_CHAIN_LAYOUT_EVENT_SOA
+}
+mt_chain_layout_t;
+
 typedef struct 
 {
     int 
@@ -172,9 +502,14 @@ typedef struct
     (*process)
                 (mt_chain_layer_t * layer,
                 mt_chain_layer_driver_data_t * driver_data,
-                const char * from,
+                mt_sender_t from,
                 const mt_packet_t * packet,
                 mt_chain_driver_accept_t accept);
+
+    /* Layout of the events the layer is given & gives, compiled chains
+     * convert them only between layers of different layouts.
+     */
+    mt_chain_layout_t layout;
 }
 mt_chain_layer_driver_t;
 
@@ -195,10 +530,30 @@ mt_chain_push_layer
 extern int
 mt_chain_pop_layer(mt_chain_t * chain);
 
+/**
+ * Build the flat representation of the chain packets go through.
+ * It is otherwise built by the first transmit following a change 
+ * of the layers.
+ */
+extern void
+mt_chain_compile
+            (mt_chain_t * chain);
+
+/**
+ * Copy the time spent into the layer 'index' (0 being the top of the 
+ * stack) excluding the layers it accepted packets to, return -1 when 
+ * there is no such layer or stats are not built.
+ */
+extern int
+mt_chain_get_layer_latencies
+            (const mt_chain_t * chain,
+            uint16_t index,
+            mt_histogram_t * histogram);
+
 extern int 
 mt_chain_transmit
             (mt_chain_t * chain,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
 
 extern void
@@ -221,6 +576,109 @@ extern const mt_chain_layer_driver_t *
 mt_chain_layer_driver_get
             (const char * name);
 
+/* Built-in processing engines, registered by 
+ * mt_chain_layer_driver_loader_init.
+ */
+
+/* 'delta_encoder' turns event packets into raw packets holding either a
+ * keyframe or only the touches which changed since the previous frame of
+ * the same sender. A keyframe is sent every 'keyframe_interval' frames
+ * (30 by default). 'delta_decoder' rebuilds the event packets, dropping 
+ * deltas until the next keyframe when a frame was lost.
+ */
+extern const mt_chain_layer_driver_t mt_chain_delta_encoder_driver;
+extern const mt_chain_layer_driver_t mt_chain_delta_decoder_driver;
+
+/* 'tracking' gives each touch the id of the touch of the previous frame
+ * of the same sender it continues, or a new one & the INPUT_TOUCH_BEGAN
+ * phase. Touches continue the ones which were at most 'max_distance' 
+ * (0.05 by default) from them, or from where they were heading unless 
+ * 'prediction' is 0. Candidates are looked up into a uniform grid, & 
+ * touches with several candidates are matched minimizing the distances.
+ * Ids given by the input are replaced.
+ */
+extern const mt_chain_layer_driver_t mt_chain_tracking_driver;
+
+/* 'smoothing' filters the position of each touch with a 1€ filter, 
+ * matching touches from frame to frame by id, or by index when they have 
+ * none. 'min_cutoff' (1 Hz by default) sets the smoothing of still touches,
+ * 'beta' (10) how much less moving touches are smoothed & 
+ * 'derivate_cutoff' (1 Hz) the smoothing of their velocity. Touches are 
+ * then moved where they should be 'horizon' seconds (0 by default) later,
+ * so they can lead the raw signal.
+ */
+extern const mt_chain_layer_driver_t mt_chain_smoothing_driver;
+
+/* 'calibration' maps the touches, origins & sizes, from the panel to the
+ * screen. A distortion map is applied first when 'grid' lists, row by row,
+ * where each node of a 'grid_columns' × 'grid_rows' uniform grid over the
+ * panel should be. The row-major 3×3 'matrix' (identity by default), an 
+ * affine transform or a homography, comes next, & the result is scaled 
+ * by 'screen_width' & 'screen_height' (1 by default). Touches are 
+ * transformed with the widest kernel the CPU supports, or the one 'kernel'
+ * asks for: 'avx', 'sse2' or 'scalar'.
+ */
+extern const mt_chain_layer_driver_t mt_chain_calibration_driver;
+
+/* 'gesture' follows the touches of each sender from frame to frame & 
+ * gives, after the event packets, a raw gesture packet once a pan 
+ * ('pan_threshold' of translation, 0.02 by default), a pinch 
+ * ('pinch_threshold' of scale change, 0.1) or a rotation 
+ * ('rotate_threshold' radians, 0.1) is recognized, then on each frame 
+ * until the touches go up. The last packet tells a swipe when the touches
+ * went up moving faster than 'swipe_velocity' (1 per second). With the 
+ * 'mode' option set to "replace", the event packets are not given.
+ */
+extern const mt_chain_layer_driver_t mt_chain_gesture_driver;
+
+enum
+{
+    MT_GESTURE_PAN = 1 << 0,
+    MT_GESTURE_PINCH = 1 << 1,
+    MT_GESTURE_ROTATE = 1 << 2,
+    MT_GESTURE_SWIPE = 1 << 3
+};
+
+typedef struct
+{
+    enum
+    {
+        GESTURE_BEGAN,
+        GESTURE_CHANGED,
+        GESTURE_ENDED
+    }
+    phase;
+
+    /* MT_GESTURE_ values recognized since the gesture began */
+    uint16_t kinds;
+    uint16_t touch_count;
+    double timestamp;
+
+    /* Centroid of the touches */
+    double x;
+    double y;
+
+    /* Since the gesture began, the rotation being in radians */
+    double translation_x;
+    double translation_y;
+    double scale;
+    double rotation;
+
+    /* Of the centroid, per second */
+    double velocity_x;
+    double velocity_y;
+}
+mt_gesture_t;
+
+/**
+ * Read a packet given by the 'gesture' engine, return -1 if 'packet' is 
+ * not one.
+ */
+extern int
+mt_gesture_decode
+            (const mt_packet_t * packet,
+            mt_gesture_t * gesture);
+
 typedef struct _input_t mt_input_t;
 
 typedef struct _input_driver_data_t mt_input_driver_data_t;
@@ -247,15 +705,50 @@ typedef struct
                 (const mt_input_t * input,
                 mt_input_driver_data_t * driver_data);
 
+    /* May return before the input is stopped, once there is nothing left
+     * to read: the input waits for its stop.
+     */
     int
     (*run)
                 (const mt_input_t * input,
                 mt_input_driver_data_t * driver_data,
                 mt_input_driver_commit_t driver_commit,
                 mt_input_driver_must_stop_polling_t must_stop_polling_on);
+
+    /* Optional, used instead of 'run': the input has no polling thread, 
+     * the reactor calls 'on_readable' whenever the non-blocking 
+     * descriptor returned by 'get_fd' is readable. Returning -1 stops 
+     * watching the descriptor. When 'get_fd' returns -1, e.g. for a 
+     * regular file, 'run' is used.
+     */
+    int
+    (*get_fd)
+                (const mt_input_t * input,
+                mt_input_driver_data_t * driver_data);
+
+    int
+    (*on_readable)
+                (const mt_input_t * input,
+                mt_input_driver_data_t * driver_data,
+                mt_input_driver_commit_t driver_commit);
 }
 mt_input_driver_t;
 
+/**
+ * Start the reactor serving inputs whose driver has an 'on_readable' 
+ * function, with 'threads_count' threads each waiting with epoll (1 if
+ * 0). Inputs start it when needed, return -1 if it is already started.
+ */
+extern int
+mt_reactor_start
+            (uint16_t threads_count);
+
+/**
+ * Stop the reactor, once every input it serves is destroyed.
+ */
+extern void
+mt_reactor_stop(void);
+
 
 extern mt_input_t *
 mt_input_init
@@ -271,6 +764,25 @@ extern const char *
 mt_input_get_id
             (const mt_input_t * input);
 
+extern mt_sender_t
+mt_input_get_sender
+            (const mt_input_t * input);
+
+/**
+ * Copy the time spent committing packets, i.e. into the post processing
+ * chain & listeners, return -1 when stats are not built.
+ */
+extern int
+mt_input_get_commit_latencies
+            (const mt_input_t * input,
+            mt_histogram_t * histogram);
+
+extern int
+mt_input_get_layer_latencies
+            (const mt_input_t * input,
+            uint16_t index,
+            mt_histogram_t * histogram);
+
 extern int
 mt_input_polling_start(mt_input_t * input);
 
@@ -289,6 +801,15 @@ mt_input_bind
             mt_device_packet_process_t process,
             void * data);
 
+/**
+ * Remove a listener added by mt_input_bind, return -1 if it was not bound.
+ */
+extern int
+mt_input_unbind
+            (mt_input_t * input,
+            mt_device_packet_process_t process,
+            void * data);
+
 extern void
 mt_input_driver_loader_init(void);
 
@@ -309,6 +830,29 @@ extern const mt_input_driver_t *
 mt_input_driver_get
             (const char * name);
 
+/**
+ * Linux multitouch (protocol B) evdev devices, to register under the name
+ * of your choice. One event holding every contact is committed per 
+ * SYN_REPORT. Options:
+ *  - "path": the device, or a recording of its events.
+ *  - "fd": an already opened descriptor, e.g. a pipe, used instead of 
+ *    "path" & not closed.
+ *  - "read_batch": events read at once, 64 by default.
+ *  - "slots", "x_min", "x_max", "y_min" & "y_max": when not reading a
+ *    device, the slots count (16 by default) & the axes' ranges 
+ *    (0 to 65535 by default).
+ */
+extern const mt_input_driver_t mt_input_evdev_driver;
+
+/**
+ * Commit the packets of the capture of the "path" option, which is mapped
+ * & not copied. Options:
+ *  - "speed": 1 (default) keeps the original timing, 2 replays twice
+ *    faster & 0 as fast as possible.
+ *  - "sender": only replay the packets of this sender.
+ */
+extern const mt_input_driver_t mt_input_replay_driver;
+
 typedef struct _output_t mt_output_t;
 
 typedef struct _output_driver_data_t mt_output_driver_data_t;
@@ -330,11 +874,27 @@ typedef struct
     (*transmit)
                 (const mt_output_t * output,
                 mt_output_driver_data_t * driver_data,
-                const char * from,
+                mt_sender_t from,
                 const mt_packet_t * packet);
+
+    /* Optional, called instead of 'transmit' with all the packets 
+     * dequeued at once (up to the 'batch_size' output option).
+     */
+    int
+    (*transmit_batch)
+                (const mt_output_t * output,
+                mt_output_driver_data_t * driver_data,
+                const mt_sender_t * from,
+                const mt_packet_t * const * packets,
+                uint16_t packets_count);
 }
 mt_output_driver_t;
 
+/**
+ * Packets are transmitted by a dedicated thread, or with the 'execution'
+ * option set to "shared", by the workers pool. Either way, the packets of
+ * an output are transmitted in order, one at a time.
+ */
 extern mt_output_t *
 mt_output_init
             (const char * output_id,
@@ -349,6 +909,18 @@ extern const char *
 mt_output_get_id
             (const mt_output_t * output);
 
+extern const mt_output_driver_t *
+mt_output_get_driver
+            (const mt_output_t * output);
+
+/**
+ * Return the data of the output's driver, for drivers exposing functions
+ * of their own.
+ */
+extern mt_output_driver_data_t *
+mt_output_get_driver_data
+            (const mt_output_t * output);
+
 extern int 
 mt_output_push_pre_processing_engine
             (mt_output_t * output,
@@ -356,11 +928,148 @@ mt_output_push_pre_processing_engine
             const peach_hash_t * options);
 
 
+/**
+ * Queue 'packet' for transmission. When the queue ('queue_capacity' 
+ * option, 256 packets by default) is full, the 'overload_policy' option 
+ * chooses between:
+ *  - "drop_newest" (default): 'packet' is dropped & -1 returned.
+ *  - "drop_oldest": the oldest queued packets are dropped.
+ *  - "block": wait up to 'block_timeout' milliseconds (10 by default) 
+ *    for room, then drop 'packet'.
+ *  - "coalesce": like "drop_oldest", but the oldest packet is merged into
+ *    'packet' when both are frames of the same sender.
+ * With the 'coalescing' option set to 1, an event is merged into the 
+ * one of the same sender still waiting into the queue, if any.
+ */
 extern int
 mt_output_transmit
             (mt_output_t * output,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
+
+typedef struct
+{
+    uint64_t enqueued;
+
+    /* Packets dropped because the queue was full */
+    uint64_t dropped_newest;
+    uint64_t dropped_oldest;
+
+    /* Producers which waited for room, & gave up after 'block_timeout' */
+    uint64_t blocked;
+    uint64_t block_timeouts;
+
+    /* Queued frames merged into a newer one of the same sender */
+    uint64_t coalesced;
+}
+mt_output_stats_t;
+
+extern void
+mt_output_get_stats
+            (const mt_output_t * output,
+            mt_output_stats_t * stats);
+
+/**
+ * Copy the time packets waited into the queue, return -1 when stats are
+ * not built.
+ */
+extern int
+mt_output_get_queue_latencies
+            (const mt_output_t * output,
+            mt_histogram_t * histogram);
+
+/**
+ * Copy the time spent into the driver's transmit (or transmit_batch) 
+ * function, return -1 when stats are not built.
+ */
+extern int
+mt_output_get_transmit_latencies
+            (const mt_output_t * output,
+            mt_histogram_t * histogram);
+
+extern int
+mt_output_get_layer_latencies
+            (const mt_output_t * output,
+            uint16_t index,
+            mt_histogram_t * histogram);
+
+/* Devices route packets from inputs (or any sender) to outputs. Routes
+ * can be changed while packets are flowing.
+ */
+typedef struct _device_t mt_device_t;
+
+extern mt_device_t *
+mt_device_init(void);
+
+/**
+ * Unbind the device from the inputs it is connected to, which must
+ * still exist: destroy devices before their inputs, or disconnect them
+ * first.
+ */
+extern void
+mt_device_destroy
+            (mt_device_t * device);
+
+/**
+ * Route packets of 'input' to 'output', binding the device to 'input'
+ * on its first route. Return -1 if the route already exists or 'input'
+ * has no valid sender.
+ */
+extern int
+mt_device_connect
+            (mt_device_t * device,
+            mt_input_t * input,
+            mt_output_t * output);
+
+/**
+ * Remove a route added by mt_device_connect, unbinding the device from
+ * 'input' on its last route. Return -1 if there was no such route.
+ */
+extern int
+mt_device_disconnect
+            (mt_device_t * device,
+            mt_input_t * input,
+            mt_output_t * output);
+
+/**
+ * Route packets given to mt_device_transmit by 'sender' to 'output', 
+ * return -1 if the route already exists. Functions taking a sender return
+ * -1 when it is not below MT_SENDER_MAX.
+ */
+extern int
+mt_device_add_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output);
+
+extern int
+mt_device_remove_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output);
+
+/**
+ * Replace at once all the routes of 'sender', packets are never given to
+ * both the old & the new routes.
+ */
+extern int
+mt_device_set_routes
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * const * outputs,
+            uint16_t outputs_count);
+
+/**
+ * Give 'packet' to every output 'from' is routed to, return -1 if one of
+ * them dropped it. It can be bound to inputs as a 
+ * mt_device_packet_process_t.
+ */
+extern int
+mt_device_transmit
+            (mt_device_t * device,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
 /**
  *
  *
@@ -404,5 +1113,77 @@ extern const mt_output_driver_t *
 mt_output_driver_get
             (const char * name);
 
+/**
+ * Append the packets, their sender & timestamp to the file of the "path" 
+ * option, truncated unless the "append" option is 1. Records are written
+ * once "buffer_size" bytes (1MB by default) are buffered.
+ */
+extern const mt_output_driver_t mt_output_capture_driver;
+
+/**
+ * Publish the packets into a ring of POSIX shared memory, named after the
+ * "name" option, read by other processes with multitouch_shm.h. Readers 
+ * which do not keep up lose the oldest messages. Options:
+ *  - "slots": 1024 by default, rounded up to a power of 2.
+ *  - "slot_size": largest message in bytes, 2048 by default.
+ *  - "encoding": events are written as mt_event_t ("native", default) or
+ *    encoded by mt_event_encode ("compact").
+ *  - "mode": permissions of the shared memory, 0600 by default.
+ *  - "replace": a ring of the same name, left by another output or a 
+ *    crashed process, fails the output unless this option is 1.
+ */
+extern const mt_output_driver_t mt_output_shm_driver;
+
+/**
+ * Send the packets over a socket, every packet queued being sent at once
+ * by one sendmmsg (datagrams) or sendmsg (streams) call. Each packet is 
+ * preceded by a header of 8 bytes: its length (u32, little endian), its 
+ * sender (u16, little endian), its type (u8, as MT_SHM_MESSAGE_*) & a 
+ * reserved byte. Options:
+ *  - "path": the socket of mt_output_unix_dgram_driver & 
+ *    mt_output_unix_stream_driver.
+ *  - "host" (127.0.0.1 by default) & "port": the receiver of 
+ *    mt_output_udp_driver.
+ *  - "encoding": events are sent as mt_event_t ("native", default) or 
+ *    encoded by mt_event_encode ("compact").
+ *  - "send_buffer": SO_SNDBUF in bytes, the system's default if 0.
+ *  - "busy_poll": SO_BUSY_POLL in microseconds, disabled if 0.
+ *  - "blocking": datagrams are dropped when the socket buffer is full, 
+ *    unless 1. Streams always wait for room.
+ * Sockets are connected again on the next packets once the receiver went
+ * away, packets meanwhile are dropped.
+ */
+extern const mt_output_driver_t mt_output_unix_dgram_driver;
+extern const mt_output_driver_t mt_output_unix_stream_driver;
+extern const mt_output_driver_t mt_output_udp_driver;
+
+typedef struct
+{
+    uint64_t sent;
+
+    /* Calls to sendmmsg or sendmsg */
+    uint64_t calls;
+
+    /* Calls which sent only a part of the packets or bytes given */
+    uint64_t partial_writes;
+
+    /* Packets too large, not sent while the socket buffer was full, or 
+     * while disconnected.
+     */
+    uint64_t dropped;
+
+    uint64_t connections;
+}
+mt_output_socket_stats_t;
+
+/**
+ * Copy the counters of an output of a socket driver, return -1 if 
+ * 'output' uses another driver.
+ */
+extern int
+mt_output_socket_get_stats
+            (const mt_output_t * output,
+            mt_output_socket_stats_t * stats);
+
 
 #endif
@@ -0,0 +1,305 @@
+/**
+ * Created by David Keller on 09/11/08.
+ * Copyright 2008 EFREI. All rights reserved.
+ */
+
+#ifndef _MULTITOUCH_SHM_H_
+#define _MULTITOUCH_SHM_H_
+
+/* Reader of the rings published by mt_output_shm_driver, for processes
+ * which do not link against the library: the ring is only read from
+ * the shared memory, without any system call but to wait for messages.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define MT_SHM_MAGIC 0x48534d54
+
+/* Bumped with the layout of mt_event_t */
+#define MT_SHM_VERSION 2
+
+#define MT_SHM_SENDER_NAME_LENGTH 32
+#define MT_SHM_SENDERS_COUNT 1024
+
+enum
+{
+    /* A mt_event_t */
+    MT_SHM_MESSAGE_EVENT,
+
+    /* An event encoded by mt_event_encode */
+    MT_SHM_MESSAGE_ENCODED_EVENT,
+
+    MT_SHM_MESSAGE_RAW
+};
+
+typedef struct
+{
+    /* Written last, once the ring is ready */
+    volatile uint32_t magic;
+    uint16_t version;
+
+    /* The output is destroyed, nothing will be published anymore */
+    volatile uint16_t closed;
+
+    uint32_t slots_count;
+    uint32_t slot_size;
+    uint64_t slots_offset;
+    uint64_t sender_names_offset;
+
+    /* Messages published so far, the last ones are still into the ring */
+    volatile uint64_t head __attribute__((aligned(64)));
+
+    /* Readers waiting for messages sleep on the low bits of 'head' */
+    volatile uint32_t head_futex;
+    volatile uint32_t waiters;
+
+    /* Messages not fitting into a slot */
+    volatile uint64_t dropped;
+}
+mt_shm_header_t;
+
+typedef struct
+{
+    /* 2 * position + 1 while the message is written, 2 * position + 2
+     * once published.
+     */
+    volatile uint64_t sequence;
+
+    uint32_t length;
+    uint16_t sender;
+    uint8_t type;
+    uint8_t padding;
+
+    uint8_t data [] __attribute__((aligned(8)));
+}
+mt_shm_slot_t;
+
+typedef struct
+{
+    mt_shm_header_t * header;
+    size_t length;
+
+    /* Position of the next message to read */
+    uint64_t cursor;
+
+    /* Messages overwritten before they were read */
+    uint64_t lost;
+}
+mt_shm_reader_t;
+
+typedef struct
+{
+    uint64_t position;
+
+    uint16_t sender;
+    uint8_t type;
+    uint32_t length;
+
+    /* Into the ring, valid until the message is released */
+    const void * data;
+}
+mt_shm_message_t;
+
+static inline mt_shm_slot_t *
+mt_shm_get_slot
+            (const mt_shm_header_t * header,
+            uint64_t position)
+{
+    return (mt_shm_slot_t *)((uint8_t *)header + header->slots_offset
+                + (size_t)header->slot_size
+                * (position & (header->slots_count - 1)));
+}
+
+/**
+ * Attach to the ring published under 'name', from its newest message.
+ * Return -1 if it does not exist or is not ready yet.
+ */
+static inline int
+mt_shm_reader_attach
+            (mt_shm_reader_t * reader,
+            const char * name)
+{
+    struct stat shm_stat;
+    int fd;
+
+    if ((fd = shm_open(name, O_RDWR, 0)) < 0)
+        goto exit_with_failure;
+
+    if (fstat(fd, &shm_stat) != 0
+                || (size_t)shm_stat.st_size < sizeof(*reader->header))
+        goto clean_fd;
+
+    reader->length = shm_stat.st_size;
+    if ((reader->header = mmap(0, reader->length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED)
+        goto clean_fd;
+
+    close(fd);
+
+    if (reader->header->magic != MT_SHM_MAGIC)
+        goto clean_mapping;
+
+    __sync_synchronize();
+
+    if (reader->header->version != MT_SHM_VERSION
+                || reader->header->slots_offset
+                    + (uint64_t)reader->header->slots_count
+                    * reader->header->slot_size > reader->length)
+        goto clean_mapping;
+
+    reader->cursor = reader->header->head;
+    reader->lost = 0;
+
+    return 0;
+
+clean_mapping:
+    munmap(reader->header, reader->length);
+
+    return -1;
+
+clean_fd:
+    close(fd);
+
+exit_with_failure:
+    return -1;
+}
+
+static inline void
+mt_shm_reader_detach
+            (mt_shm_reader_t * reader)
+{
+    munmap(reader->header, reader->length);
+}
+
+/**
+ * Return 1 & fill 'message' with the next message, or 0 if there is none.
+ * Messages overwritten before being read are skipped & counted as lost.
+ */
+static inline int
+mt_shm_reader_peek
+            (mt_shm_reader_t * reader,
+            mt_shm_message_t * message)
+{
+    const mt_shm_slot_t * slot;
+    uint64_t head;
+
+    for (;;) {
+        head = reader->header->head;
+        __sync_synchronize();
+
+        if (reader->cursor == head)
+            return 0;
+
+        /* The producer went around the ring */
+        if (head - reader->cursor > reader->header->slots_count) {
+            reader->lost += head - reader->header->slots_count
+                        - reader->cursor;
+            reader->cursor = head - reader->header->slots_count;
+        }
+
+        slot = mt_shm_get_slot(reader->header, reader->cursor);
+
+        if (slot->sequence == 2 * reader->cursor + 2)
+            break;
+
+        reader->lost ++;
+        reader->cursor ++;
+    }
+
+    __sync_synchronize();
+
+    message->position = reader->cursor;
+    message->sender = slot->sender;
+    message->type = slot->type;
+    message->data = slot->data;
+
+    /* May be overwritten meanwhile, which release tells */
+    message->length = slot->length;
+    if (message->length > reader->header->slot_size - sizeof(*slot))
+        message->length = reader->header->slot_size - sizeof(*slot);
+
+    return 1;
+}
+
+/**
+ * Move past 'message' once copied or parsed. Return -1 if it was
+ * overwritten meanwhile: what was read must then be discarded.
+ */
+static inline int
+mt_shm_reader_release
+            (mt_shm_reader_t * reader,
+            const mt_shm_message_t * message)
+{
+    const mt_shm_slot_t * slot;
+
+    __sync_synchronize();
+
+    slot = mt_shm_get_slot(reader->header, message->position);
+    reader->cursor = message->position + 1;
+
+    if (slot->sequence != 2 * message->position + 2) {
+        reader->lost ++;
+
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Sleep until a message is published, the output is destroyed or
+ * 'timeout' expires if not null. The producer only makes a system call
+ * to wake readers which are sleeping.
+ */
+static inline void
+mt_shm_reader_wait
+            (mt_shm_reader_t * reader,
+            const struct timespec * timeout)
+{
+    uint32_t head_futex;
+
+    __sync_fetch_and_add(&reader->header->waiters, 1);
+
+    head_futex = reader->header->head_futex;
+
+    if (reader->cursor == reader->header->head
+                && reader->header->closed == 0)
+        syscall(SYS_futex, &reader->header->head_futex, FUTEX_WAIT,
+                    head_futex, timeout, 0, 0);
+
+    __sync_fetch_and_sub(&reader->header->waiters, 1);
+}
+
+static inline int
+mt_shm_reader_is_closed
+            (const mt_shm_reader_t * reader)
+{
+    return reader->header->closed;
+}
+
+/**
+ * Return the name of the sender of a message, at most
+ * MT_SHM_SENDER_NAME_LENGTH - 1 characters long.
+ */
+static inline const char *
+mt_shm_reader_get_sender_name
+            (const mt_shm_reader_t * reader,
+            uint16_t sender)
+{
+    if (sender >= MT_SHM_SENDERS_COUNT)
+        return "";
+
+    return (const char *)reader->header + reader->header->sender_names_offset
+                + (size_t)sender * MT_SHM_SENDER_NAME_LENGTH;
+}
+
+#endif
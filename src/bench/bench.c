@@ -0,0 +1,755 @@
+/*
+ *  bench.c
+ *  irtouchd benchmark function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <assert.h>
+#include <time.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#define _MAX_DEVICES 64
+
+struct _output_driver_data_t
+{
+    mt_histogram_t latencies;
+    volatile uint64_t received;
+};
+
+typedef struct
+{
+    const char * name;
+    uint16_t inputs_count;
+    uint16_t outputs_count;
+    uint16_t depth;
+}
+_scenario_t;
+
+static struct
+{
+    /* Configuration */
+    const _scenario_t * scenario;
+    uint16_t inputs_count;
+    uint16_t outputs_count;
+    uint16_t depth;
+    uint16_t touch_count;
+    uint32_t rate;
+    uint32_t frames;
+    uint32_t warmup_frames;
+    int stats;
+    int shared;
+    uint16_t workers_count;
+    peach_hash_t * output_options;
+
+    mt_input_t * inputs [_MAX_DEVICES];
+    mt_output_t * outputs [_MAX_DEVICES];
+    mt_output_driver_data_t * sinks [_MAX_DEVICES];
+    mt_device_t * device;
+    uint16_t sinks_count;
+
+    /* Synthetic inputs wait for the main thread between phases */
+    volatile enum
+    {
+        BENCH_IDLE,
+        BENCH_WARMUP,
+        BENCH_MEASURE
+    }
+    phase;
+    volatile uint32_t inputs_done;
+
+    volatile uint64_t committed;
+}
+_bench;
+
+static const _scenario_t _scenarios [] =
+{
+    { .name = "fan-out", .inputs_count = 1, .outputs_count = 8, .depth = 2 },
+    { .name = "fan-in", .inputs_count = 8, .outputs_count = 1, .depth = 2 },
+    { .name = "deep-chain", .inputs_count = 1, .outputs_count = 1,
+                .depth = 16 },
+};
+
+/* Every allocation going through the heap is counted, including the ones
+ * of libmultitouch & libpeach.
+ */
+static volatile uint64_t _allocations = 0;
+
+extern void * __libc_malloc(size_t size);
+extern void * __libc_calloc(size_t count, size_t size);
+extern void * __libc_realloc(void * data, size_t size);
+
+void *
+malloc(size_t size)
+{
+    __sync_fetch_and_add(&_allocations, 1);
+
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t count, size_t size)
+{
+    __sync_fetch_and_add(&_allocations, 1);
+
+    return __libc_calloc(count, size);
+}
+
+void *
+realloc(void * data, size_t size)
+{
+    __sync_fetch_and_add(&_allocations, 1);
+
+    return __libc_realloc(data, size);
+}
+
+static uint64_t
+_now(void);
+
+static void
+_sleep(uint64_t duration);
+
+static int
+_synthetic_driver_init
+            (const mt_input_t * input,
+            mt_input_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_synthetic_driver_destroy
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data);
+
+static int
+_synthetic_driver_run
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on);
+
+static int
+_null_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_null_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data);
+
+static int
+_null_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
+static int
+_pass_driver_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_pass_driver_destroy
+            (mt_chain_layer_driver_data_t * driver_data);
+
+static int
+_pass_driver_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static void
+_print_stages(void);
+
+static void
+_print_latencies
+            (const char * stage,
+            const mt_histogram_t * latencies);
+
+static uint64_t
+_get_received(void);
+
+static uint64_t
+_get_dropped(void);
+
+static void
+_wait_for_phase_end(void);
+
+static void
+_usage(const char * program);
+
+static void
+_signal_handler(int signal_number);
+
+
+static const mt_input_driver_t _synthetic_driver =
+{
+    .init = _synthetic_driver_init,
+    .destroy = _synthetic_driver_destroy,
+    .run = _synthetic_driver_run
+};
+
+static const mt_output_driver_t _null_driver =
+{
+    .init = _null_driver_init,
+    .destroy = _null_driver_destroy,
+    .transmit = _null_driver_transmit
+};
+
+/* Does nothing, but unlike the default layer is not elided by the chain */
+static const mt_chain_layer_driver_t _pass_driver =
+{
+    .init = _pass_driver_init,
+    .destroy = _pass_driver_destroy,
+    .process = _pass_driver_process
+};
+
+
+int
+main(int argc, char * argv [])
+{
+    mt_histogram_t latencies;
+    mt_pool_stats_t pool_stats_before;
+    mt_pool_stats_t pool_stats_after;
+    uint64_t allocations;
+    uint64_t pool_misses;
+    uint64_t received;
+    uint64_t committed;
+    uint64_t dropped;
+    uint64_t start;
+    uint64_t duration;
+    char id [32];
+    uint16_t i;
+    uint16_t j;
+    int option;
+
+    if (argc < 2)
+        goto usage;
+
+    for (i = 0; i < sizeof(_scenarios) / sizeof(*_scenarios); i ++)
+        if (strcmp(argv[1], _scenarios[i].name) == 0)
+            _bench.scenario = &_scenarios[i];
+
+    if (_bench.scenario == 0)
+        goto usage;
+
+    _bench.inputs_count = _bench.scenario->inputs_count;
+    _bench.outputs_count = _bench.scenario->outputs_count;
+    _bench.depth = _bench.scenario->depth;
+    _bench.touch_count = 10;
+    _bench.rate = 2000;
+    _bench.frames = 5000;
+    _bench.warmup_frames = 500;
+
+    _bench.output_options = peach_hash_init(4);
+
+    optind = 2;
+    while ((option = getopt(argc, argv, "i:o:d:t:r:n:w:sq:p:cx:")) != -1)
+        switch (option) {
+            case 'i': _bench.inputs_count = atoi(optarg); break;
+            case 'o': _bench.outputs_count = atoi(optarg); break;
+            case 'd': _bench.depth = atoi(optarg); break;
+            case 't': _bench.touch_count = atoi(optarg); break;
+            case 'r': _bench.rate = atoi(optarg); break;
+            case 'n': _bench.frames = atoi(optarg); break;
+            case 'w': _bench.warmup_frames = atoi(optarg); break;
+            case 's': _bench.stats = 1; break;
+            case 'q': 
+                peach_hash_add(_bench.output_options, "queue_capacity",
+                            strlen("queue_capacity"), optarg); 
+                break;
+            case 'p':
+                peach_hash_add(_bench.output_options, "overload_policy",
+                            strlen("overload_policy"), optarg);
+                break;
+            case 'c':
+                peach_hash_add(_bench.output_options, "coalescing",
+                            strlen("coalescing"), "1");
+                break;
+            case 'x':
+                _bench.shared = 1;
+                _bench.workers_count = atoi(optarg);
+                peach_hash_add(_bench.output_options, "execution",
+                            strlen("execution"), "shared");
+                break;
+            default: goto usage;
+        }
+
+    if (_bench.inputs_count == 0 || _bench.inputs_count > _MAX_DEVICES
+                || _bench.outputs_count == 0
+                || _bench.outputs_count > _MAX_DEVICES
+                || _bench.frames == 0)
+        goto usage;
+
+    /* Polling threads are stopped by SIGUSR1 */
+    signal(SIGUSR1, _signal_handler);
+
+    if (_bench.shared)
+        mt_workers_start(_bench.workers_count);
+
+    for (i = 0; i < _bench.outputs_count; i ++) {
+        snprintf(id, sizeof(id), "bench-output-%u", i);
+
+        _bench.outputs[i] = mt_output_init(id, &_null_driver, 
+                    _bench.output_options);
+        assert(_bench.outputs[i] != 0);
+
+        for (j = 0; j < _bench.depth; j ++)
+            if (mt_output_push_pre_processing_engine(_bench.outputs[i],
+                        &_pass_driver, 0) != 0)
+                goto exit_with_engine_failure;
+    }
+
+    _bench.device = mt_device_init();
+
+    for (i = 0; i < _bench.inputs_count; i ++) {
+        snprintf(id, sizeof(id), "bench-input-%u", i);
+
+        _bench.inputs[i] = mt_input_init(id, &_synthetic_driver, 0);
+        assert(_bench.inputs[i] != 0);
+
+        /* Engines can only be pushed while the input is not polling */
+        mt_input_polling_stop(_bench.inputs[i]);
+
+        for (j = 0; j < _bench.depth; j ++)
+            if (mt_input_push_post_processing_engine(_bench.inputs[i],
+                        &_pass_driver, 0) != 0)
+                goto exit_with_engine_failure;
+
+        mt_input_polling_start(_bench.inputs[i]);
+
+        /* Every input is routed to every output */
+        for (j = 0; j < _bench.outputs_count; j ++)
+            mt_device_connect(_bench.device, _bench.inputs[i], 
+                        _bench.outputs[j]);
+    }
+
+    /* Warm up pools & caches, then measure once everything is drained */
+    _bench.phase = BENCH_WARMUP;
+    _wait_for_phase_end();
+
+    mt_pool_get_stats(&pool_stats_before);
+    allocations = _allocations;
+    committed = _bench.committed;
+    dropped = _get_dropped();
+    received = _get_received();
+
+    if (_bench.stats && mt_stats_enable(1) != 0) {
+        fprintf(stderr, "libmultitouch was built without MT_WITH_STATS.\n");
+        _bench.stats = 0;
+    }
+
+    start = _now();
+    _bench.inputs_done = 0;
+    _bench.phase = BENCH_MEASURE;
+    _wait_for_phase_end();
+    duration = _now() - start;
+
+    allocations = _allocations - allocations;
+    mt_pool_get_stats(&pool_stats_after);
+    committed = _bench.committed - committed;
+    dropped = _get_dropped() - dropped;
+    received = _get_received() - received;
+
+    pool_misses = pool_stats_after.oversized_allocations
+                - pool_stats_before.oversized_allocations;
+    for (i = 0; i < MT_POOL_CLASSES_COUNT; i ++)
+        pool_misses += pool_stats_after.classes[i].misses
+                    - pool_stats_before.classes[i].misses;
+
+    memset(&latencies, 0, sizeof(latencies));
+    for (i = 0; i < _bench.sinks_count; i ++)
+        mt_histogram_merge(&latencies, &_bench.sinks[i]->latencies);
+
+    printf("%s: %u inputs, %u outputs, %u layers per chain, %u touches, ",
+                _bench.scenario->name, _bench.inputs_count,
+                _bench.outputs_count, _bench.depth, _bench.touch_count);
+    if (_bench.rate == 0)
+        printf("unpaced\n");
+    else
+        printf("%u frames/s per input\n", _bench.rate);
+
+    printf("  frames committed     %llu\n", (unsigned long long)committed);
+    printf("  packets transmitted  %llu (%llu dropped)\n",
+                (unsigned long long)received, (unsigned long long)dropped);
+    printf("  throughput           %.0f packets/s\n",
+                received * 1e9 / duration);
+    printf("  latency p50          %.2f us\n",
+                mt_histogram_get_percentile(&latencies, 50.) / 1e3);
+    printf("  latency p99          %.2f us\n",
+                mt_histogram_get_percentile(&latencies, 99.) / 1e3);
+    printf("  latency p99.9        %.2f us\n",
+                mt_histogram_get_percentile(&latencies, 99.9) / 1e3);
+    printf("  latency max          %.2f us\n", latencies.max / 1e3);
+    printf("  allocations/frame    %.3f\n", (double)allocations / committed);
+    printf("  pool misses/frame    %.3f\n", (double)pool_misses / committed);
+
+    if (_bench.stats)
+        _print_stages();
+
+    mt_device_destroy(_bench.device);
+
+    for (i = 0; i < _bench.inputs_count; i ++)
+        mt_input_destroy(_bench.inputs[i]);
+
+    for (i = 0; i < _bench.outputs_count; i ++)
+        mt_output_destroy(_bench.outputs[i]);
+
+    if (_bench.shared)
+        mt_workers_stop();
+
+    peach_hash_destroy(_bench.output_options, 0);
+
+    return EXIT_SUCCESS;
+
+exit_with_engine_failure:
+    fprintf(stderr, "Could not push the pass-through engines.\n");
+
+    return EXIT_FAILURE;
+
+usage:
+    _usage(argv[0]);
+
+    return EXIT_FAILURE;
+}
+
+static uint64_t
+_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void
+_sleep(uint64_t duration)
+{
+    struct timespec timeout;
+
+    timeout.tv_sec = duration / 1000000000ULL;
+    timeout.tv_nsec = duration % 1000000000ULL;
+
+    nanosleep(&timeout, 0);
+}
+
+static int
+_synthetic_driver_init
+            (const mt_input_t * input,
+            mt_input_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    *driver_data = 0;
+
+    return 0;
+}
+
+static int
+_synthetic_driver_destroy
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data)
+{
+    return 0;
+}
+
+/* Commit the warmup frames, then the measured ones, paced at 'rate' */
+static int
+_synthetic_driver_run
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on)
+{
+    mt_packet_t * packet;
+    mt_event_t * event;
+    uint64_t deadline;
+    uint64_t period;
+    uint64_t now;
+    uint32_t frames;
+    uint32_t frame;
+    uint16_t i;
+    int phase;
+
+    period = _bench.rate ? 1000000000ULL / _bench.rate : 0;
+
+    for (phase = BENCH_WARMUP; phase <= BENCH_MEASURE; phase ++) {
+        while (_bench.phase != phase)
+            if ((*must_stop_polling_on)(input))
+                goto exit;
+            else
+                _sleep(100000);
+
+        frames = phase == BENCH_WARMUP ? _bench.warmup_frames : _bench.frames;
+        deadline = _now();
+
+        for (frame = 0; frame < frames; frame ++) {
+            if ((*must_stop_polling_on)(input))
+                goto exit;
+
+            event = mt_event_init(_bench.touch_count);
+
+            for (i = 0; i < _bench.touch_count; i ++) {
+                event->touchset[i].phase = frame == 0 ? INPUT_TOUCH_BEGAN
+                            : INPUT_TOUCH_MOVED;
+                event->touchset[i].where.origin.x = (frame % 1000) / 1000.;
+                event->touchset[i].where.origin.y = (double)i
+                            / _bench.touch_count;
+                event->touchset[i].where.size.width = 0.01;
+                event->touchset[i].where.size.height = 0.01;
+            }
+
+            event->info.timestamp = _now() / 1e9;
+            for (i = 0; i < _bench.touch_count; i ++)
+                event->touchset[i].timestamp = event->info.timestamp;
+
+            packet = mt_packet_init_event(event, mt_event_destroy);
+            (*driver_commit)(input, packet);
+            mt_packet_destroy(packet);
+
+            __sync_fetch_and_add(&_bench.committed, 1);
+
+            if (period != 0) {
+                deadline += period;
+                now = _now();
+
+                if (deadline > now)
+                    _sleep(deadline - now);
+            }
+        }
+
+        __sync_fetch_and_add(&_bench.inputs_done, 1);
+    }
+
+    while (! (*must_stop_polling_on)(input))
+        _sleep(1000000);
+
+exit:
+    return 0;
+}
+
+static int
+_null_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    mt_output_driver_data_t * sink;
+
+    sink = calloc(1, sizeof(*sink));
+    assert(sink != 0);
+
+    _bench.sinks[_bench.sinks_count ++] = sink;
+    *driver_data = sink;
+
+    return 0;
+}
+
+static int
+_null_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data)
+{
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_null_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    uint64_t committed_at;
+    uint64_t now;
+
+    if (packet->type == PACKET_EVENT && _bench.phase == BENCH_MEASURE) {
+        now = _now();
+        committed_at = packet->content.event.event->info.timestamp * 1e9;
+
+        mt_histogram_add(&driver_data->latencies,
+                    now > committed_at ? now - committed_at : 0);
+    }
+
+    /* Read by the main thread to know when everything was transmitted */
+    __sync_fetch_and_add(&driver_data->received, 1);
+
+    return 0;
+}
+
+static int
+_pass_driver_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    *driver_data = 0;
+
+    return 0;
+}
+
+static int
+_pass_driver_destroy
+            (mt_chain_layer_driver_data_t * driver_data)
+{
+    return 0;
+}
+
+static int
+_pass_driver_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    return (*accept)(layer, from, packet);
+}
+
+/* Stages' latencies of every device & layer are merged */
+static void
+_print_stages(void)
+{
+    mt_histogram_t latencies;
+    mt_histogram_t merged;
+    uint16_t i;
+    uint16_t j;
+
+    printf("  stages (p50 / p99 / p99.9 in us)\n");
+
+    memset(&merged, 0, sizeof(merged));
+    for (i = 0; i < _bench.inputs_count; i ++)
+        if (mt_input_get_commit_latencies(_bench.inputs[i], &latencies) == 0)
+            mt_histogram_merge(&merged, &latencies);
+    _print_latencies("input commit", &merged);
+
+    memset(&merged, 0, sizeof(merged));
+    for (i = 0; i < _bench.inputs_count; i ++)
+        for (j = 0; j < _bench.depth; j ++)
+            if (mt_input_get_layer_latencies(_bench.inputs[i], j, 
+                        &latencies) == 0)
+                mt_histogram_merge(&merged, &latencies);
+    _print_latencies("input layer", &merged);
+
+    memset(&merged, 0, sizeof(merged));
+    for (i = 0; i < _bench.outputs_count; i ++)
+        if (mt_output_get_queue_latencies(_bench.outputs[i], &latencies) == 0)
+            mt_histogram_merge(&merged, &latencies);
+    _print_latencies("output queue", &merged);
+
+    memset(&merged, 0, sizeof(merged));
+    for (i = 0; i < _bench.outputs_count; i ++)
+        for (j = 0; j < _bench.depth; j ++)
+            if (mt_output_get_layer_latencies(_bench.outputs[i], j, 
+                        &latencies) == 0)
+                mt_histogram_merge(&merged, &latencies);
+    _print_latencies("output layer", &merged);
+
+    memset(&merged, 0, sizeof(merged));
+    for (i = 0; i < _bench.outputs_count; i ++)
+        if (mt_output_get_transmit_latencies(_bench.outputs[i], 
+                    &latencies) == 0)
+            mt_histogram_merge(&merged, &latencies);
+    _print_latencies("output transmit", &merged);
+}
+
+static void
+_print_latencies
+            (const char * stage,
+            const mt_histogram_t * latencies)
+{
+    printf("    %-18s %.2f / %.2f / %.2f\n", stage,
+                mt_histogram_get_percentile(latencies, 50.) / 1e3,
+                mt_histogram_get_percentile(latencies, 99.) / 1e3,
+                mt_histogram_get_percentile(latencies, 99.9) / 1e3);
+}
+
+static uint64_t
+_get_received(void)
+{
+    uint64_t received;
+    uint16_t i;
+
+    received = 0;
+    for (i = 0; i < _bench.sinks_count; i ++)
+        received += _bench.sinks[i]->received;
+
+    return received;
+}
+
+/* Packets which will never reach the null driver */
+static uint64_t
+_get_dropped(void)
+{
+    mt_output_stats_t stats;
+    uint64_t dropped;
+    uint16_t i;
+
+    dropped = 0;
+    for (i = 0; i < _bench.outputs_count; i ++) {
+        mt_output_get_stats(_bench.outputs[i], &stats);
+
+        dropped += stats.dropped_newest + stats.dropped_oldest 
+                    + stats.coalesced;
+    }
+
+    return dropped;
+}
+
+/* Wait for every input to commit its frames & every packet to be either
+ * transmitted or dropped.
+ */
+static void
+_wait_for_phase_end(void)
+{
+    while (_bench.inputs_done != _bench.inputs_count)
+        _sleep(1000000);
+
+    while (_get_received() + _get_dropped() 
+                != _bench.committed * _bench.outputs_count)
+        _sleep(100000);
+}
+
+static void
+_usage(const char * program)
+{
+    fprintf(stderr, "usage: %s fan-out|fan-in|deep-chain [-i inputs] "
+                "[-o outputs] [-d depth] [-t touches] [-r rate] [-n frames] "
+                "[-w warmup frames] [-s] [-q queue capacity] "
+                "[-p overload policy] [-c] [-x workers]\n"
+                "\n"
+                "  -i  number of synthetic inputs\n"
+                "  -o  number of null outputs, each input feeds every output\n"
+                "  -d  pass-through layers pushed on every chain\n"
+                "  -t  touches per event\n"
+                "  -r  frames per second per input, 0 commits as fast as "
+                "possible\n"
+                "  -n  measured frames per input\n"
+                "  -w  warmup frames per input, not measured\n"
+                "  -s  record & print the latencies of every stage\n"
+                "  -q  'queue_capacity' option of the outputs\n"
+                "  -p  'overload_policy' option of the outputs\n"
+                "  -c  coalesce the frames waiting into the outputs' queue\n"
+                "  -x  transmit with a pool of workers shared by the outputs,"
+                " 0 for one per processor\n",
+                program);
+}
+
+static void
+_signal_handler(int signal_number)
+{
+}
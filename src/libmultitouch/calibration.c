@@ -0,0 +1,522 @@
+/*
+ *  calibration.c
+ *  irtouchd calibration processing engine
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+
+#if defined(MT_WITH_SIMD) && (defined(__x86_64__) || defined(__i386__))
+# define _WITH_X86_KERNELS
+# include <immintrin.h>
+#endif
+
+#define _MAX_GRID_SIDE 256
+
+/* Transform 'count' touches, given as arrays of coordinates, by the
+ * row-major 3×3 'matrix'.
+ */
+typedef void (*_kernel_t)
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height);
+
+struct _chain_layer_driver_data_t
+{
+    double matrix [9];
+
+    /* Where each node of a uniform grid over the panel should be, 0 when
+     * there is no distortion map.
+     */
+    double * grid;
+    uint16_t grid_columns;
+    uint16_t grid_rows;
+
+    _kernel_t kernel;
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data);
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static int
+_init_grid
+            (mt_chain_layer_driver_data_t * driver_data,
+            const peach_hash_t * options);
+
+static _kernel_t
+_select_kernel
+            (const char * name);
+
+static void
+_distort
+            (const mt_chain_layer_driver_data_t * driver_data,
+            mt_event_soa_t * event);
+
+static void
+_transform_scalar
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height);
+
+#ifdef _WITH_X86_KERNELS
+static void
+_transform_sse2
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height);
+
+static void
+_transform_avx
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height);
+#endif
+
+
+const mt_chain_layer_driver_t mt_chain_calibration_driver =
+{
+    .init = _init,
+    .destroy = _destroy,
+    .process = _process,
+    .layout = MT_CHAIN_LAYOUT_EVENT_SOA
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    static const double identity [9] = { 1, 0, 0, 0, 1, 0, 0, 0, 1 };
+    double screen_width;
+    double screen_height;
+    uint32_t column;
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    memcpy((*driver_data)->matrix, identity, sizeof(identity));
+    if (mt_options_get_string(options, "matrix", 0) != 0
+                && mt_options_get_doubles(options, "matrix",
+                    (*driver_data)->matrix, 9) != 0)
+        goto exit_with_failure;
+
+    /* The screen mapping scales what the matrix gives */
+    screen_width = mt_options_get_double(options, "screen_width", 1);
+    screen_height = mt_options_get_double(options, "screen_height", 1);
+    for (column = 0; column < 3; column ++) {
+        (*driver_data)->matrix[column] *= screen_width;
+        (*driver_data)->matrix[3 + column] *= screen_height;
+    }
+
+    if (_init_grid(*driver_data, options) != 0)
+        goto exit_with_failure;
+
+    (*driver_data)->kernel = _select_kernel(mt_options_get_string(options,
+                "kernel", "auto"));
+
+    return 0;
+
+exit_with_failure:
+    _destroy(*driver_data);
+
+    return -1;
+}
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data)
+{
+    free(driver_data->grid);
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    mt_packet_t * calibrated_packet;
+    mt_event_soa_t * event;
+    int result;
+
+    if (packet->type != PACKET_EVENT_SOA)
+        return (*accept)(layer, from, packet);
+
+    event = mt_event_soa_copy(packet->content.event_soa.event);
+
+    if (driver_data->grid != 0)
+        _distort(driver_data, event);
+
+    (*driver_data->kernel)(driver_data->matrix, event->info.touch_count,
+                event->x, event->y, event->width, event->height);
+
+    calibrated_packet = mt_packet_init_event_soa(event,
+                mt_event_soa_destroy);
+
+    result = (*accept)(layer, from, calibrated_packet);
+
+    mt_packet_destroy(calibrated_packet);
+
+    return result;
+}
+
+static int
+_init_grid
+            (mt_chain_layer_driver_data_t * driver_data,
+            const peach_hash_t * options)
+{
+    long columns;
+    long rows;
+
+    if (mt_options_get_string(options, "grid", 0) == 0)
+        return 0;
+
+    columns = mt_options_get_integer(options, "grid_columns", 0);
+    rows = mt_options_get_integer(options, "grid_rows", 0);
+    if (columns < 2 || columns > _MAX_GRID_SIDE
+                || rows < 2 || rows > _MAX_GRID_SIDE) {
+        peach_log_debug(1, "Calibration: 'grid_columns' & 'grid_rows' "
+                    "must be between 2 & %d.\n", _MAX_GRID_SIDE);
+
+        goto exit_with_failure;
+    }
+
+    driver_data->grid = malloc(sizeof(*driver_data->grid)
+                * columns * rows * 2);
+    assert(driver_data->grid != 0);
+
+    if (mt_options_get_doubles(options, "grid", driver_data->grid,
+                columns * rows * 2) != 0)
+        goto exit_with_failure;
+
+    driver_data->grid_columns = columns;
+    driver_data->grid_rows = rows;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+static _kernel_t
+_select_kernel
+            (const char * name)
+{
+    if (strcmp(name, "scalar") == 0)
+        return _transform_scalar;
+
+#ifdef _WITH_X86_KERNELS
+    __builtin_cpu_init();
+
+    if ((strcmp(name, "auto") == 0 || strcmp(name, "avx") == 0)
+                && __builtin_cpu_supports("avx")) {
+        peach_log_debug(2, "Calibration: using the AVX kernel.\n");
+
+        return _transform_avx;
+    }
+
+    if ((strcmp(name, "auto") == 0 || strcmp(name, "avx") == 0
+                || strcmp(name, "sse2") == 0)
+                && __builtin_cpu_supports("sse2")) {
+        peach_log_debug(2, "Calibration: using the SSE2 kernel.\n");
+
+        return _transform_sse2;
+    }
+#endif
+
+    if (strcmp(name, "auto") != 0)
+        peach_log_debug(1, "Calibration: kernel '%s' is not available.\n",
+                    name);
+
+    peach_log_debug(2, "Calibration: using the scalar kernel.\n");
+
+    return _transform_scalar;
+}
+
+/* Bilinear interpolation of the grid, extrapolated out of the panel. Sizes
+ * are scaled by the derivatives of the interpolation.
+ */
+static void
+_distort
+            (const mt_chain_layer_driver_data_t * driver_data,
+            mt_event_soa_t * event)
+{
+    const double * top_left;
+    const double * top_right;
+    const double * bottom_left;
+    const double * bottom_right;
+    double dx_dx, dx_dy, dy_dx, dy_dy;
+    double column_position;
+    double row_position;
+    double width;
+    double height;
+    uint32_t index;
+    long column;
+    long row;
+    double u;
+    double v;
+
+    for (index = 0; index < event->info.touch_count; index ++) {
+        column_position = event->x[index]
+                    * (driver_data->grid_columns - 1);
+        row_position = event->y[index] * (driver_data->grid_rows - 1);
+
+        column = floor(column_position);
+        if (column < 0)
+            column = 0;
+        else if (column > driver_data->grid_columns - 2)
+            column = driver_data->grid_columns - 2;
+
+        row = floor(row_position);
+        if (row < 0)
+            row = 0;
+        else if (row > driver_data->grid_rows - 2)
+            row = driver_data->grid_rows - 2;
+
+        u = column_position - column;
+        v = row_position - row;
+
+        top_left = &driver_data->grid[(row * driver_data->grid_columns
+                    + column) * 2];
+        top_right = top_left + 2;
+        bottom_left = top_left + driver_data->grid_columns * 2;
+        bottom_right = bottom_left + 2;
+
+        event->x[index] = (1 - v) * ((1 - u) * top_left[0]
+                    + u * top_right[0]) + v * ((1 - u) * bottom_left[0]
+                    + u * bottom_right[0]);
+        event->y[index] = (1 - v) * ((1 - u) * top_left[1]
+                    + u * top_right[1]) + v * ((1 - u) * bottom_left[1]
+                    + u * bottom_right[1]);
+
+        dx_dx = ((1 - v) * (top_right[0] - top_left[0])
+                    + v * (bottom_right[0] - bottom_left[0]))
+                    * (driver_data->grid_columns - 1);
+        dy_dx = ((1 - v) * (top_right[1] - top_left[1])
+                    + v * (bottom_right[1] - bottom_left[1]))
+                    * (driver_data->grid_columns - 1);
+        dx_dy = ((1 - u) * (bottom_left[0] - top_left[0])
+                    + u * (bottom_right[0] - top_right[0]))
+                    * (driver_data->grid_rows - 1);
+        dy_dy = ((1 - u) * (bottom_left[1] - top_left[1])
+                    + u * (bottom_right[1] - top_right[1]))
+                    * (driver_data->grid_rows - 1);
+
+        width = event->width[index];
+        height = event->height[index];
+
+        event->width[index] = fabs(dx_dx) * width
+                    + fabs(dx_dy) * height;
+        event->height[index] = fabs(dy_dx) * width
+                    + fabs(dy_dy) * height;
+    }
+}
+
+/* Points are divided by their projective coordinate, & sizes become the
+ * bounding box of the touch rectangle transformed by the jacobian of the
+ * matrix at the point.
+ */
+static void
+_transform_scalar
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height)
+{
+    double inverse;
+    double new_x;
+    double new_y;
+    uint32_t index;
+    double w;
+    double h;
+
+    for (index = 0; index < count; index ++) {
+        inverse = 1 / (matrix[6] * x[index] + matrix[7] * y[index]
+                    + matrix[8]);
+
+        new_x = (matrix[0] * x[index] + matrix[1] * y[index] + matrix[2])
+                    * inverse;
+        new_y = (matrix[3] * x[index] + matrix[4] * y[index] + matrix[5])
+                    * inverse;
+
+        w = width[index];
+        h = height[index];
+
+        width[index] = fabs((matrix[0] - new_x * matrix[6]) * inverse) * w
+                    + fabs((matrix[1] - new_x * matrix[7]) * inverse) * h;
+        height[index] = fabs((matrix[3] - new_y * matrix[6]) * inverse) * w
+                    + fabs((matrix[4] - new_y * matrix[7]) * inverse) * h;
+
+        x[index] = new_x;
+        y[index] = new_y;
+    }
+}
+
+#ifdef _WITH_X86_KERNELS
+/* Same as _transform_scalar(), 2 touches at a time */
+__attribute__((target("sse2")))
+static void
+_transform_sse2
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height)
+{
+    const __m128d sign = _mm_set1_pd(-0.0);
+    __m128d m [9];
+    __m128d inverse;
+    __m128d new_x;
+    __m128d new_y;
+    uint32_t index;
+    __m128d vx;
+    __m128d vy;
+    __m128d w;
+    __m128d h;
+
+    for (index = 0; index < 9; index ++)
+        m[index] = _mm_set1_pd(matrix[index]);
+
+    for (index = 0; index + 2 <= count; index += 2) {
+        vx = _mm_loadu_pd(&x[index]);
+        vy = _mm_loadu_pd(&y[index]);
+        w = _mm_loadu_pd(&width[index]);
+        h = _mm_loadu_pd(&height[index]);
+
+        inverse = _mm_div_pd(_mm_set1_pd(1), _mm_add_pd(_mm_add_pd(
+                    _mm_mul_pd(m[6], vx), _mm_mul_pd(m[7], vy)), m[8]));
+
+        new_x = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m[0], vx),
+                    _mm_mul_pd(m[1], vy)), m[2]), inverse);
+        new_y = _mm_mul_pd(_mm_add_pd(_mm_add_pd(_mm_mul_pd(m[3], vx),
+                    _mm_mul_pd(m[4], vy)), m[5]), inverse);
+
+        _mm_storeu_pd(&width[index], _mm_add_pd(
+                    _mm_mul_pd(_mm_andnot_pd(sign, _mm_mul_pd(_mm_sub_pd(m[0],
+                        _mm_mul_pd(new_x, m[6])), inverse)), w),
+                    _mm_mul_pd(_mm_andnot_pd(sign, _mm_mul_pd(_mm_sub_pd(m[1],
+                        _mm_mul_pd(new_x, m[7])), inverse)), h)));
+        _mm_storeu_pd(&height[index], _mm_add_pd(
+                    _mm_mul_pd(_mm_andnot_pd(sign, _mm_mul_pd(_mm_sub_pd(m[3],
+                        _mm_mul_pd(new_y, m[6])), inverse)), w),
+                    _mm_mul_pd(_mm_andnot_pd(sign, _mm_mul_pd(_mm_sub_pd(m[4],
+                        _mm_mul_pd(new_y, m[7])), inverse)), h)));
+
+        _mm_storeu_pd(&x[index], new_x);
+        _mm_storeu_pd(&y[index], new_y);
+    }
+
+    _transform_scalar(matrix, count - index, &x[index], &y[index],
+                &width[index], &height[index]);
+}
+
+/* Same as _transform_scalar(), 4 touches at a time */
+__attribute__((target("avx")))
+static void
+_transform_avx
+            (const double * matrix,
+            uint32_t count,
+            double * x,
+            double * y,
+            double * width,
+            double * height)
+{
+    const __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d m [9];
+    __m256d inverse;
+    __m256d new_x;
+    __m256d new_y;
+    uint32_t index;
+    __m256d vx;
+    __m256d vy;
+    __m256d w;
+    __m256d h;
+
+    for (index = 0; index < 9; index ++)
+        m[index] = _mm256_set1_pd(matrix[index]);
+
+    for (index = 0; index + 4 <= count; index += 4) {
+        vx = _mm256_loadu_pd(&x[index]);
+        vy = _mm256_loadu_pd(&y[index]);
+        w = _mm256_loadu_pd(&width[index]);
+        h = _mm256_loadu_pd(&height[index]);
+
+        inverse = _mm256_div_pd(_mm256_set1_pd(1), _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(m[6], vx),
+                        _mm256_mul_pd(m[7], vy)), m[8]));
+
+        new_x = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(
+                    _mm256_mul_pd(m[0], vx), _mm256_mul_pd(m[1], vy)), m[2]),
+                    inverse);
+        new_y = _mm256_mul_pd(_mm256_add_pd(_mm256_add_pd(
+                    _mm256_mul_pd(m[3], vx), _mm256_mul_pd(m[4], vy)), m[5]),
+                    inverse);
+
+        _mm256_storeu_pd(&width[index], _mm256_add_pd(
+                    _mm256_mul_pd(_mm256_andnot_pd(sign, _mm256_mul_pd(
+                        _mm256_sub_pd(m[0], _mm256_mul_pd(new_x, m[6])),
+                        inverse)), w),
+                    _mm256_mul_pd(_mm256_andnot_pd(sign, _mm256_mul_pd(
+                        _mm256_sub_pd(m[1], _mm256_mul_pd(new_x, m[7])),
+                        inverse)), h)));
+        _mm256_storeu_pd(&height[index], _mm256_add_pd(
+                    _mm256_mul_pd(_mm256_andnot_pd(sign, _mm256_mul_pd(
+                        _mm256_sub_pd(m[3], _mm256_mul_pd(new_y, m[6])),
+                        inverse)), w),
+                    _mm256_mul_pd(_mm256_andnot_pd(sign, _mm256_mul_pd(
+                        _mm256_sub_pd(m[4], _mm256_mul_pd(new_y, m[7])),
+                        inverse)), h)));
+
+        _mm256_storeu_pd(&x[index], new_x);
+        _mm256_storeu_pd(&y[index], new_y);
+    }
+
+    _transform_scalar(matrix, count - index, &x[index], &y[index],
+                &width[index], &height[index]);
+}
+#endif
@@ -0,0 +1,64 @@
+/*
+ *  capture.h
+ *  irtouchd capture file format private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#include <multitouch.h>
+
+#define MT_CAPTURE_MAGIC "MTCP"
+
+/* Bumped with the layout of mt_event_t */
+#define MT_CAPTURE_VERSION 2
+
+/* Records & payloads start on this boundary, so events can be used
+ * right out of a mapping of the file.
+ */
+#define MT_CAPTURE_ALIGNMENT 8
+
+#define MT_CAPTURE_ALIGN(length) \
+            (((size_t)(length) + MT_CAPTURE_ALIGNMENT - 1) \
+            & ~(size_t)(MT_CAPTURE_ALIGNMENT - 1))
+
+/* Files are written in the machine's byte order & layout of mt_event_t */
+typedef struct
+{
+    char magic [4];
+    uint16_t version;
+    uint16_t header_length;
+}
+mt_capture_header_t;
+
+enum
+{
+    /* The payload is the name of the record's sender, given before its 
+     * first packet.
+     */
+    MT_CAPTURE_RECORD_SENDER,
+    MT_CAPTURE_RECORD_EVENT,
+    MT_CAPTURE_RECORD_RAW
+};
+
+typedef struct
+{
+    /* Of the event if it has one, of the capture otherwise */
+    uint64_t timestamp;
+
+    /* Of the payload, padding excluded */
+    uint32_t length;
+
+    mt_sender_t sender;
+    uint8_t type;
+    uint8_t padding;
+}
+mt_capture_record_t;
+
+#endif
@@ -14,67 +14,102 @@
 
 #include <multitouch.h>
 
-struct _chain_t
-{
-    peach_stack_t * layers_stack;
+#include "stats.h"
 
-    struct
-    {
-        void * data;
-        mt_device_packet_process_t process;
-    }
-    listener;
+/* The listener is called as the last layer of compiled chains */
+struct _chain_layer_driver_data_t
+{
+    void * data;
+    mt_device_packet_process_t process;
 };
 
-typedef union 
+struct _chain_t
 {
-    struct
-    {
-        mt_chain_t * chain;
-        int (*process)(mt_chain_t * chain, const char * from, 
-                const mt_packet_t * packet);
-    }
-    chain;
+    peach_stack_t * layers_stack;
+    mt_chain_layer_t * volatile top_layer;
 
-    struct
-    {
-        mt_chain_layer_t * layer;
-        int (*process)(mt_chain_layer_t * layer, 
-                const char * from, const mt_packet_t * packet);
-    }
-    layer;
-}
-_upper_layer_t;
+    /* Layers to go through, from the top of the stack to the listener, 
+     * pass-through layers excluded & layout converters included.
+     */
+    mt_chain_layer_t * compiled_layers;
+    volatile int must_compile;
+
+    mt_chain_layer_driver_data_t listener;
+};
 
 struct _chain_layer_t
 {
+    int
+    (*process)
+                (mt_chain_layer_t * layer,
+                mt_chain_layer_driver_data_t * driver_data,
+                mt_sender_t from,
+                const mt_packet_t * packet,
+                mt_chain_driver_accept_t accept);
+
     mt_chain_layer_driver_data_t * driver_data;
     const mt_chain_layer_driver_t * driver;
 
-    _upper_layer_t upper_layer;
+    /* Layer which was at the top of the stack when this one was pushed */
+    mt_chain_layer_t * lower_layer;
+
+    mt_histogram_t * latencies;
 };
 
+/* Time spent by the layers called from the one being timed, which is
+ * deduced from its own.
+ */
+static __thread uint64_t _downstream_time = 0;
+
 static int
 _give_packet_to_listener
-            (mt_chain_t * chain,
-            const char * from,
-            const mt_packet_t * packet);
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * listener,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
 
 static void
 _layer_destroy
             (mt_chain_layer_t * chain_layer);
 
 static int
-_to_upper_layer
+_accept
             (mt_chain_layer_t * layer,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
+
 static int
-_process_packet
+_process_timed
             (mt_chain_layer_t * layer,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
 
+static void
+_compile
+            (mt_chain_t * chain);
+
+static void
+_init_converter
+            (mt_chain_layer_t * converter,
+            mt_chain_layout_t layout);
+
+static int
+_convert_to_event
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static int
+_convert_to_event_soa
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
 static int 
 _default_driver_init
             (mt_chain_layer_driver_data_t ** driver_data, 
@@ -88,7 +123,7 @@ static int
 _default_driver_process
             (mt_chain_layer_t * layer,
             mt_chain_layer_driver_data_t * driver_data,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet,
             mt_chain_driver_accept_t process);
 
@@ -108,19 +143,20 @@ mt_chain_init(void * listener, mt_device_packet_process_t listener_process)
     mt_chain_t * chain;
     mt_chain_layer_t * default_layer;
 
-    chain = malloc(sizeof(*chain));
+    chain = calloc(1, sizeof(*chain));
     assert(chain != 0);
 
     chain->layers_stack = peach_stack_init(1, 4);
 
-    default_layer = malloc(sizeof(*default_layer));
+    default_layer = calloc(1, sizeof(*default_layer));
     assert(default_layer != 0);
 
     default_layer->driver = &_default_driver;
-    default_layer->upper_layer.chain.chain = chain;
-    default_layer->upper_layer.chain.process = _give_packet_to_listener;
+    default_layer->process = _default_driver.process;
 
     peach_stack_push(chain->layers_stack, default_layer);
+    chain->top_layer = default_layer;
+    chain->must_compile = 1;
 
     chain->listener.data = listener;
     chain->listener.process = listener_process;
@@ -134,20 +170,38 @@ mt_chain_destroy
 {
     peach_stack_destroy(chain->layers_stack, (peach_stack_clean_t)_layer_destroy);
 
+    free(chain->compiled_layers);
     free(chain);
 }
 
 int
 mt_chain_transmit
             (mt_chain_t * chain,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet)
 {
-    mt_chain_layer_t * heighest_layer;
+    mt_chain_layer_t * layer;
+
+    if (chain->must_compile)
+        _compile(chain);
+
+    layer = chain->compiled_layers;
+
+    if (MT_STATS_ENABLED())
+        return _process_timed(layer, from, packet);
 
-    heighest_layer = peach_stack_top(chain->layers_stack);
+    return (*layer->process)(layer, layer->driver_data, from, packet, 
+                _accept);
+}
+
+void
+mt_chain_compile
+            (mt_chain_t * chain)
+{
+    assert(chain != 0);
 
-    return _process_packet(heighest_layer, from, packet);
+    if (chain->must_compile)
+        _compile(chain);
 }
 
 int
@@ -161,22 +215,30 @@ mt_chain_push_layer
     assert(chain != 0);
     assert(layer_driver != 0);
 
-    layer = malloc(sizeof(*layer));
+    layer = calloc(1, sizeof(*layer));
     assert(layer != 0);
 
     layer->driver = layer_driver;
-    layer->upper_layer.layer.layer 
-                = (mt_chain_layer_t *)peach_stack_top(chain->layers_stack);
-    layer->upper_layer.layer.process = _process_packet;
+    layer->process = layer_driver->process;
+    layer->lower_layer = chain->top_layer;
+    layer->latencies = mt_histogram_init();
 
     if ((*layer_driver->init)(&layer->driver_data, options) != 0)
         goto clean;
 
     peach_stack_push(chain->layers_stack, layer);
 
+    /* The compiled layers are rebuilt by the next transmit, so the thread
+     * walking them is the one which frees them.
+     */
+    __sync_synchronize();
+    chain->top_layer = layer;
+    chain->must_compile = 1;
+
     return 0;
 
 clean:
+    mt_histogram_destroy(layer->latencies);
     free(layer);
 
     return -1;
@@ -190,6 +252,34 @@ mt_chain_pop_layer(mt_chain_t * chain)
 
     _layer_destroy(peach_stack_pop(chain->layers_stack));
 
+    chain->top_layer = peach_stack_top(chain->layers_stack);
+    chain->must_compile = 1;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+int
+mt_chain_get_layer_latencies
+            (const mt_chain_t * chain,
+            uint16_t index,
+            mt_histogram_t * histogram)
+{
+    const mt_chain_layer_t * layer;
+
+    assert(chain != 0);
+
+    for (layer = chain->top_layer; layer != 0 && index > 0; 
+                layer = layer->lower_layer)
+        index --;
+
+    if (layer == 0)
+        goto exit_with_failure;
+
+    return mt_histogram_copy(histogram, layer->latencies);
+
 exit_with_failure:
     return -1;
 }
@@ -200,6 +290,17 @@ mt_chain_layer_driver_loader_init(void)
     assert(_layer_drivers == 0);
 
     _layer_drivers = peach_hash_init(20);
+
+    mt_chain_layer_driver_register("delta_encoder", 
+                &mt_chain_delta_encoder_driver);
+    mt_chain_layer_driver_register("delta_decoder", 
+                &mt_chain_delta_decoder_driver);
+    mt_chain_layer_driver_register("gesture", &mt_chain_gesture_driver);
+    mt_chain_layer_driver_register("tracking", &mt_chain_tracking_driver);
+    mt_chain_layer_driver_register("smoothing", 
+                &mt_chain_smoothing_driver);
+    mt_chain_layer_driver_register("calibration", 
+                &mt_chain_calibration_driver);
 }
 
 void
@@ -255,33 +356,179 @@ mt_chain_layer_driver_get
 }
 
 static int
-_to_upper_layer
+_accept
             (mt_chain_layer_t * layer,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet)
 {
-    return (*layer->upper_layer.layer.process)(layer->upper_layer.layer.layer,
-                from, packet);
+    layer ++;
+
+    if (MT_STATS_ENABLED())
+        return _process_timed(layer, from, packet);
+
+    return (*layer->process)(layer, layer->driver_data, from, packet, 
+                _accept);
 }
 
 static int
-_process_packet
+_process_timed
             (mt_chain_layer_t * layer,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet)
 {
-    return (*layer->driver->process)(layer, layer->driver_data, from, packet,
-                _to_upper_layer);
+    uint64_t upstream_time;
+    uint64_t elapsed_time;
+    uint64_t entered_at;
+    int result;
+
+    upstream_time = _downstream_time;
+    _downstream_time = 0;
+
+    entered_at = mt_stats_now();
+    result = (*layer->process)(layer, layer->driver_data, from, packet, 
+                _accept);
+    elapsed_time = mt_stats_now() - entered_at;
+
+    if (layer->latencies != 0 && elapsed_time >= _downstream_time)
+        mt_histogram_add(layer->latencies, elapsed_time - _downstream_time);
+
+    _downstream_time = upstream_time + elapsed_time;
+
+    return result;
+}
+
+static void
+_compile
+            (mt_chain_t * chain)
+{
+    mt_chain_layer_t * compiled_layers;
+    uint16_t converters_count;
+    mt_chain_layer_t * layer;
+    mt_chain_layout_t layout;
+    uint16_t layers_count;
+
+    chain->must_compile = 0;
+    __sync_synchronize();
+
+    layers_count = 0;
+    for (layer = chain->top_layer; layer != 0; layer = layer->lower_layer)
+        layers_count ++;
+
+    /* A converter may precede each layer & the listener */
+    compiled_layers = malloc(sizeof(*compiled_layers) 
+                * (layers_count * 2 + 2));
+    assert(compiled_layers != 0);
+
+    /* Chains are given events by inputs & give them to their listener */
+    layout = MT_CHAIN_LAYOUT_EVENT;
+    converters_count = 0;
+
+    layers_count = 0;
+    for (layer = chain->top_layer; layer != 0; layer = layer->lower_layer) {
+        if (layer->process == _default_driver_process)
+            continue;
+
+        if (layer->driver->layout != layout) {
+            layout = layer->driver->layout;
+            _init_converter(&compiled_layers[layers_count ++], layout);
+            converters_count ++;
+        }
+
+        compiled_layers[layers_count ++] = *layer;
+    }
+
+    if (layout != MT_CHAIN_LAYOUT_EVENT) {
+        _init_converter(&compiled_layers[layers_count ++],
+                    MT_CHAIN_LAYOUT_EVENT);
+        converters_count ++;
+    }
+
+    compiled_layers[layers_count].process = _give_packet_to_listener;
+    compiled_layers[layers_count].driver_data = &chain->listener;
+    compiled_layers[layers_count].driver = 0;
+    compiled_layers[layers_count].lower_layer = 0;
+    compiled_layers[layers_count].latencies = 0;
+
+    free(chain->compiled_layers);
+    chain->compiled_layers = compiled_layers;
+
+    peach_log_debug(2, "Chain: compiled %u layers, %u converters.\n", 
+                layers_count - converters_count, converters_count);
+}
+
+static void
+_init_converter
+            (mt_chain_layer_t * converter,
+            mt_chain_layout_t layout)
+{
+    memset(converter, 0, sizeof(*converter));
+
+    if (layout == MT_CHAIN_LAYOUT_EVENT_SOA)
+        converter->process = _convert_to_event_soa;
+    else
+        converter->process = _convert_to_event;
 }
 
+/* Converters pass the packets which are not events of the other layout */
+static int
+_convert_to_event
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    mt_packet_t * converted_packet;
+    int result;
+
+    if (packet->type != PACKET_EVENT_SOA)
+        return (*accept)(layer, from, packet);
+
+    converted_packet = mt_packet_init_event(
+                mt_event_from_soa(packet->content.event_soa.event),
+                mt_event_destroy);
+
+    result = (*accept)(layer, from, converted_packet);
+
+    mt_packet_destroy(converted_packet);
+
+    return result;
+}
+
+static int
+_convert_to_event_soa
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    mt_packet_t * converted_packet;
+    int result;
+
+    if (packet->type != PACKET_EVENT)
+        return (*accept)(layer, from, packet);
+
+    converted_packet = mt_packet_init_event_soa(
+                mt_event_to_soa(packet->content.event.event),
+                mt_event_soa_destroy);
+
+    result = (*accept)(layer, from, converted_packet);
+
+    mt_packet_destroy(converted_packet);
+
+    return result;
+}
 
 static int
 _give_packet_to_listener
-            (mt_chain_t * chain,
-            const char * from,
-            const mt_packet_t * packet)
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * listener,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
 {
-    return (*chain->listener.process)(chain->listener.data, from, packet);
+    return (*listener->process)(listener->data, from, packet);
 }
 
 
@@ -290,6 +537,7 @@ _layer_destroy
             (mt_chain_layer_t * layer)
 {
    (*layer->driver->destroy)(layer->driver_data);
+   mt_histogram_destroy(layer->latencies);
    free(layer);
 }
 
@@ -312,7 +560,7 @@ static int
 _default_driver_process
             (mt_chain_layer_t * layer,
             mt_chain_layer_driver_data_t * driver_data,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet,
             mt_chain_driver_accept_t accept)
 {
@@ -0,0 +1,670 @@
+/*
+ *  delta.c
+ *  irtouchd delta encoding processing engines
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "wire.h"
+#include "options.h"
+
+/* Delta stream layout, all integers are little endian:
+ *
+ *  header
+ *      0   magic 'M' 'D'
+ *      2   version
+ *      3   type, keyframe or delta
+ *      4   sequence, u32
+ *      8   sequence of the frame the delta applies to, u32
+ *
+ *  keyframe payload: a compact encoded event (see wire.h)
+ *
+ *  delta payload
+ *      0   flags, u32
+ *      4   frame timestamp in microseconds, u64
+ *      12  touch count, u16
+ *      14  changed touches count, u16
+ *      16  changes
+ *
+ *  change
+ *      0   touch index, u16
+ *      2   kind, small (s8 deltas) or absolute (u16 values)
+ *      3   phase & tap count, as in compact records
+ *      4   touch timestamp delta, as in compact records
+ *      6   x, y, width & height deltas or values
+ *
+ * Touches missing from a delta keep their values & their absolute 
+ * timestamp. Ids are only sent by keyframes, which follow any change.
+ */
+#define _VERSION 2
+
+#define _HEADER_LENGTH 12
+#define _HEADER_TYPE 3
+#define _HEADER_SEQUENCE 4
+#define _HEADER_REFERENCE_SEQUENCE 8
+
+#define _DELTA_FLAGS 0
+#define _DELTA_TIMESTAMP 4
+#define _DELTA_TOUCH_COUNT 12
+#define _DELTA_CHANGES_COUNT 14
+#define _DELTA_HEADER_LENGTH 16
+
+#define _CHANGE_INDEX 0
+#define _CHANGE_KIND 2
+#define _CHANGE_STATE 3
+#define _CHANGE_TIMESTAMP 4
+#define _CHANGE_VALUES 6
+
+#define _TYPE_KEYFRAME 0
+#define _TYPE_DELTA 1
+
+#define _CHANGE_ABSOLUTE 0
+#define _CHANGE_SMALL 1
+
+#define _VALUES_COUNT 4
+
+#define _DEFAULT_KEYFRAME_INTERVAL 30
+
+typedef struct
+{
+    int synchronized;
+    uint32_t sequence;
+    uint32_t frames_since_keyframe;
+
+    /* Last frame as known by the decoder, compact encoded */
+    uint8_t * frame;
+    size_t frame_length;
+    size_t frame_size;
+
+    uint8_t * scratch;
+    size_t scratch_size;
+}
+_stream_t;
+
+struct _chain_layer_driver_data_t
+{
+    uint32_t keyframe_interval;
+    uint64_t lost_frames;
+
+    _stream_t * streams [MT_SENDER_MAX];
+};
+
+static const size_t _values_offsets [_VALUES_COUNT] =
+{
+    MT_WIRE_RECORD_X,
+    MT_WIRE_RECORD_Y,
+    MT_WIRE_RECORD_WIDTH,
+    MT_WIRE_RECORD_HEIGHT
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data);
+
+static int
+_encoder_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static int
+_decoder_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static _stream_t *
+_get_stream
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from);
+
+static void
+_reserve
+            (uint8_t ** buffer,
+            size_t * size,
+            size_t length);
+
+static int16_t
+_get_timestamp_shift
+            (const uint8_t * previous_frame,
+            uint64_t timestamp);
+
+static int16_t
+_shift_timestamp_delta
+            (const uint8_t * record,
+            int16_t shift);
+
+static size_t
+_encode_delta
+            (const uint8_t * previous_frame,
+            const uint8_t * frame,
+            uint8_t * data,
+            size_t size);
+
+static int
+_apply_delta
+            (uint8_t * frame,
+            size_t frame_length,
+            const uint8_t * data,
+            size_t length);
+
+static void
+_write_header
+            (uint8_t * data,
+            uint8_t type,
+            uint32_t sequence,
+            uint32_t reference_sequence);
+
+static int
+_accept_frame
+            (mt_chain_layer_t * layer,
+            mt_sender_t from,
+            const _stream_t * stream,
+            mt_chain_driver_accept_t accept);
+
+
+const mt_chain_layer_driver_t mt_chain_delta_encoder_driver =
+{
+    .init = _init,
+    .destroy = _destroy,
+    .process = _encoder_process
+};
+
+const mt_chain_layer_driver_t mt_chain_delta_decoder_driver =
+{
+    .init = _init,
+    .destroy = _destroy,
+    .process = _decoder_process
+};
+
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    long keyframe_interval;
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    keyframe_interval = mt_options_get_integer(options, "keyframe_interval",
+                _DEFAULT_KEYFRAME_INTERVAL);
+    if (keyframe_interval < 1)
+        keyframe_interval = 1;
+
+    (*driver_data)->keyframe_interval = keyframe_interval;
+
+    return 0;
+}
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data)
+{
+    uint32_t sender;
+
+    for (sender = 0; sender < MT_SENDER_MAX; sender ++) 
+        if (driver_data->streams[sender] != 0) {
+            free(driver_data->streams[sender]->frame);
+            free(driver_data->streams[sender]->scratch);
+            free(driver_data->streams[sender]);
+        }
+
+    if (driver_data->lost_frames > 0)
+        peach_log_debug(1, "Delta: %llu frames lost waiting for keyframes.\n",
+                    (unsigned long long)driver_data->lost_frames);
+
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_encoder_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    _stream_t * stream;
+    mt_packet_t * encoded_packet;
+    uint8_t * data;
+    size_t frame_length;
+    size_t payload_length;
+    int result;
+
+    if (packet->type != PACKET_EVENT 
+                || (stream = _get_stream(driver_data, from)) == 0)
+        return (*accept)(layer, from, packet);
+
+    frame_length = mt_event_get_encoded_length(packet->content.event.event);
+
+    _reserve(&stream->scratch, &stream->scratch_size, frame_length);
+    mt_event_encode(packet->content.event.event, stream->scratch, 
+                frame_length);
+
+    /* Deltas longer than a keyframe are never sent */
+    data = mt_pool_alloc(_HEADER_LENGTH + frame_length);
+
+    payload_length = frame_length;
+    if (stream->synchronized 
+                && stream->frames_since_keyframe 
+                    < driver_data->keyframe_interval
+                && stream->frame_length == frame_length)
+        payload_length = _encode_delta(stream->frame, stream->scratch, 
+                    data + _HEADER_LENGTH, frame_length);
+
+    if (payload_length < frame_length) {
+        _write_header(data, _TYPE_DELTA, stream->sequence + 1, 
+                    stream->sequence);
+
+        /* Keep the frame exactly as the decoder will rebuild it */
+        _apply_delta(stream->frame, stream->frame_length, 
+                    data + _HEADER_LENGTH, payload_length);
+    } else {
+        uint8_t * frame;
+        size_t frame_size;
+
+        _write_header(data, _TYPE_KEYFRAME, stream->sequence + 1, 
+                    stream->sequence + 1);
+        memcpy(data + _HEADER_LENGTH, stream->scratch, frame_length);
+
+        frame = stream->frame;
+        stream->frame = stream->scratch;
+        stream->scratch = frame;
+
+        frame_size = stream->frame_size;
+        stream->frame_size = stream->scratch_size;
+        stream->scratch_size = frame_size;
+
+        stream->frame_length = frame_length;
+        stream->frames_since_keyframe = 0;
+        stream->synchronized = 1;
+    }
+
+    stream->sequence ++;
+    stream->frames_since_keyframe ++;
+
+    encoded_packet = mt_packet_init_raw(data, _HEADER_LENGTH + payload_length,
+                mt_pool_free);
+
+    result = (*accept)(layer, from, encoded_packet);
+
+    mt_packet_destroy(encoded_packet);
+
+    return result;
+}
+
+static int
+_decoder_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    const uint8_t * header;
+    const uint8_t * data;
+    _stream_t * stream;
+    mt_event_view_t view;
+    size_t length;
+
+    if (packet->type != PACKET_RAW)
+        return (*accept)(layer, from, packet);
+
+    header = packet->content.raw.data;
+    if (packet->content.raw.length < _HEADER_LENGTH 
+                || header[0] != 'M' || header[1] != 'D' 
+                || header[2] != _VERSION
+                || (stream = _get_stream(driver_data, from)) == 0)
+        return (*accept)(layer, from, packet);
+
+    data = header + _HEADER_LENGTH;
+    length = packet->content.raw.length - _HEADER_LENGTH;
+
+    if (header[_HEADER_TYPE] == _TYPE_KEYFRAME) {
+
+        if (mt_event_view_init(&view, data, length) != 0 
+                    || view.record_length != MT_WIRE_RECORD_LENGTH)
+            goto exit_with_failure;
+
+        _reserve(&stream->frame, &stream->frame_size, view.length);
+        memcpy(stream->frame, data, view.length);
+        stream->frame_length = view.length;
+        stream->synchronized = 1;
+    } else {
+        /* A delta only applies to the frame it was computed from */
+        if (stream->synchronized == 0 || mt_wire_read_u32(header 
+                    + _HEADER_REFERENCE_SEQUENCE) != stream->sequence) {
+            stream->synchronized = 0;
+            driver_data->lost_frames ++;
+
+            goto exit_with_failure;
+        }
+
+        if (_apply_delta(stream->frame, stream->frame_length, data, 
+                    length) != 0) {
+            stream->synchronized = 0;
+
+            goto exit_with_failure;
+        }
+    }
+
+    stream->sequence = mt_wire_read_u32(header + _HEADER_SEQUENCE);
+
+    return _accept_frame(layer, from, stream, accept);
+
+exit_with_failure:
+    peach_log_debug(3, "Delta: dropping frame from '%s', waiting for a "
+                "keyframe.\n", mt_sender_get_name(from));
+
+    return -1;
+}
+
+static _stream_t *
+_get_stream
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from)
+{
+    if (from >= MT_SENDER_MAX)
+        return 0;
+
+    if (driver_data->streams[from] == 0) {
+        driver_data->streams[from] = calloc(1, 
+                    sizeof(*driver_data->streams[from]));
+        assert(driver_data->streams[from] != 0);
+    }
+
+    return driver_data->streams[from];
+}
+
+static void
+_reserve
+            (uint8_t ** buffer,
+            size_t * size,
+            size_t length)
+{
+    if (*size >= length)
+        return;
+
+    *buffer = realloc(*buffer, length);
+    assert(*buffer != 0);
+
+    *size = length;
+}
+
+static int16_t
+_get_timestamp_shift
+            (const uint8_t * previous_frame,
+            uint64_t timestamp)
+{
+    int64_t shift;
+
+    shift = (int64_t)(mt_wire_read_u64(previous_frame 
+                + MT_WIRE_HEADER_TIMESTAMP) - timestamp) / 100;
+
+    if (shift < INT16_MIN)
+        return INT16_MIN;
+
+    if (shift > INT16_MAX)
+        return INT16_MAX;
+
+    return shift;
+}
+
+static int16_t
+_shift_timestamp_delta
+            (const uint8_t * record,
+            int16_t shift)
+{
+    int32_t timestamp_delta;
+
+    timestamp_delta = (int16_t)mt_wire_read_u16(record 
+                + MT_WIRE_RECORD_TIMESTAMP) + shift;
+
+    if (timestamp_delta < INT16_MIN)
+        return INT16_MIN;
+
+    if (timestamp_delta > INT16_MAX)
+        return INT16_MAX;
+
+    return timestamp_delta;
+}
+
+static size_t
+_encode_delta
+            (const uint8_t * previous_frame,
+            const uint8_t * frame,
+            uint8_t * data,
+            size_t size)
+{
+    const uint8_t * previous_record;
+    const uint8_t * record;
+    uint16_t touch_count;
+    uint16_t touch_index;
+    uint16_t changes_count;
+    uint64_t timestamp;
+    int16_t shift;
+    size_t length;
+
+    touch_count = mt_wire_read_u16(frame + MT_WIRE_HEADER_TOUCH_COUNT);
+    timestamp = mt_wire_read_u64(frame + MT_WIRE_HEADER_TIMESTAMP);
+    shift = _get_timestamp_shift(previous_frame, timestamp);
+
+    memcpy(data + _DELTA_FLAGS, frame + MT_WIRE_HEADER_FLAGS, 4);
+    mt_wire_write_u64(data + _DELTA_TIMESTAMP, timestamp);
+    mt_wire_write_u16(data + _DELTA_TOUCH_COUNT, touch_count);
+
+    length = _DELTA_HEADER_LENGTH;
+    changes_count = 0;
+
+    previous_record = previous_frame + MT_WIRE_HEADER_LENGTH;
+    record = frame + MT_WIRE_HEADER_LENGTH;
+
+    for (touch_index = 0; touch_index < touch_count; touch_index ++,
+                previous_record += MT_WIRE_RECORD_LENGTH,
+                record += MT_WIRE_RECORD_LENGTH) {
+        int32_t differences [_VALUES_COUNT];
+        uint8_t kind;
+        int value_index;
+        size_t change_length;
+
+        kind = _CHANGE_SMALL;
+        for (value_index = 0; value_index < _VALUES_COUNT; value_index ++) {
+            differences[value_index] = (int32_t)mt_wire_read_u16(record 
+                        + _values_offsets[value_index])
+                        - mt_wire_read_u16(previous_record
+                        + _values_offsets[value_index]);
+
+            if (differences[value_index] < INT8_MIN 
+                        || differences[value_index] > INT8_MAX)
+                kind = _CHANGE_ABSOLUTE;
+        }
+
+        /* Another touch took this index, a keyframe tells its id */
+        if (memcmp(record + MT_WIRE_RECORD_ID, 
+                    previous_record + MT_WIRE_RECORD_ID, 4) != 0)
+            return size;
+
+        if (kind == _CHANGE_SMALL && differences[0] == 0 
+                    && differences[1] == 0 && differences[2] == 0 
+                    && differences[3] == 0
+                    && record[MT_WIRE_RECORD_STATE] 
+                        == previous_record[MT_WIRE_RECORD_STATE]
+                    && (int16_t)mt_wire_read_u16(record 
+                        + MT_WIRE_RECORD_TIMESTAMP) 
+                        == _shift_timestamp_delta(previous_record, shift))
+            continue;
+
+        change_length = _CHANGE_VALUES + _VALUES_COUNT 
+                    * (kind == _CHANGE_SMALL ? 1 : 2);
+
+        if (length + change_length >= size)
+            return size;
+
+        mt_wire_write_u16(data + length + _CHANGE_INDEX, touch_index);
+        data[length + _CHANGE_KIND] = kind;
+        data[length + _CHANGE_STATE] = record[MT_WIRE_RECORD_STATE];
+        memcpy(data + length + _CHANGE_TIMESTAMP, 
+                    record + MT_WIRE_RECORD_TIMESTAMP, 2);
+
+        for (value_index = 0; value_index < _VALUES_COUNT; value_index ++)
+            if (kind == _CHANGE_SMALL)
+                data[length + _CHANGE_VALUES + value_index] 
+                            = (int8_t)differences[value_index];
+            else
+                memcpy(data + length + _CHANGE_VALUES + 2 * value_index,
+                            record + _values_offsets[value_index], 2);
+
+        length += change_length;
+        changes_count ++;
+    }
+
+    mt_wire_write_u16(data + _DELTA_CHANGES_COUNT, changes_count);
+
+    return length;
+}
+
+static int
+_apply_delta
+            (uint8_t * frame,
+            size_t frame_length,
+            const uint8_t * data,
+            size_t length)
+{
+    uint16_t touch_count;
+    uint16_t touch_index;
+    uint16_t changes_count;
+    uint64_t timestamp;
+    int16_t shift;
+    size_t offset;
+
+    if (length < _DELTA_HEADER_LENGTH)
+        goto exit_with_failure;
+
+    touch_count = mt_wire_read_u16(data + _DELTA_TOUCH_COUNT);
+    if (touch_count != mt_wire_read_u16(frame + MT_WIRE_HEADER_TOUCH_COUNT)
+                || frame_length != MT_WIRE_HEADER_LENGTH 
+                    + (size_t)MT_WIRE_RECORD_LENGTH * touch_count)
+        goto exit_with_failure;
+
+    /* Touches which did not change keep their absolute timestamp */
+    timestamp = mt_wire_read_u64(data + _DELTA_TIMESTAMP);
+    shift = _get_timestamp_shift(frame, timestamp);
+
+    for (touch_index = 0; touch_index < touch_count; touch_index ++) {
+        uint8_t * record;
+
+        record = frame + MT_WIRE_HEADER_LENGTH 
+                    + MT_WIRE_RECORD_LENGTH * touch_index;
+
+        mt_wire_write_u16(record + MT_WIRE_RECORD_TIMESTAMP, 
+                    _shift_timestamp_delta(record, shift));
+    }
+
+    memcpy(frame + MT_WIRE_HEADER_FLAGS, data + _DELTA_FLAGS, 4);
+    mt_wire_write_u64(frame + MT_WIRE_HEADER_TIMESTAMP, timestamp);
+
+    changes_count = mt_wire_read_u16(data + _DELTA_CHANGES_COUNT);
+
+    for (offset = _DELTA_HEADER_LENGTH; changes_count > 0; changes_count --) {
+        uint8_t * record;
+        size_t change_length;
+        int value_index;
+
+        if (offset + _CHANGE_VALUES > length)
+            goto exit_with_failure;
+
+        change_length = _CHANGE_VALUES + _VALUES_COUNT 
+                    * (data[offset + _CHANGE_KIND] == _CHANGE_SMALL ? 1 : 2);
+
+        touch_index = mt_wire_read_u16(data + offset + _CHANGE_INDEX);
+        if (offset + change_length > length || touch_index >= touch_count)
+            goto exit_with_failure;
+
+        record = frame + MT_WIRE_HEADER_LENGTH 
+                    + MT_WIRE_RECORD_LENGTH * touch_index;
+
+        record[MT_WIRE_RECORD_STATE] = data[offset + _CHANGE_STATE];
+        memcpy(record + MT_WIRE_RECORD_TIMESTAMP, 
+                    data + offset + _CHANGE_TIMESTAMP, 2);
+
+        for (value_index = 0; value_index < _VALUES_COUNT; value_index ++)
+            if (data[offset + _CHANGE_KIND] == _CHANGE_SMALL)
+                mt_wire_write_u16(record + _values_offsets[value_index],
+                            mt_wire_read_u16(record 
+                                + _values_offsets[value_index]) 
+                            + (int8_t)data[offset + _CHANGE_VALUES 
+                                + value_index]);
+            else
+                memcpy(record + _values_offsets[value_index], 
+                            data + offset + _CHANGE_VALUES + 2 * value_index,
+                            2);
+
+        offset += change_length;
+    }
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+static void
+_write_header
+            (uint8_t * data,
+            uint8_t type,
+            uint32_t sequence,
+            uint32_t reference_sequence)
+{
+    data[0] = 'M';
+    data[1] = 'D';
+    data[2] = _VERSION;
+    data[_HEADER_TYPE] = type;
+    mt_wire_write_u32(data + _HEADER_SEQUENCE, sequence);
+    mt_wire_write_u32(data + _HEADER_REFERENCE_SEQUENCE, reference_sequence);
+}
+
+static int
+_accept_frame
+            (mt_chain_layer_t * layer,
+            mt_sender_t from,
+            const _stream_t * stream,
+            mt_chain_driver_accept_t accept)
+{
+    mt_event_view_t view;
+    mt_packet_t * decoded_packet;
+    int result;
+
+    if (mt_event_view_init(&view, stream->frame, stream->frame_length) != 0)
+        return -1;
+
+    decoded_packet = mt_packet_init_event(mt_event_view_decode(&view),
+                mt_event_destroy);
+
+    result = (*accept)(layer, from, decoded_packet);
+
+    mt_packet_destroy(decoded_packet);
+
+    return result;
+}
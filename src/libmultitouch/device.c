@@ -1,11 +1,437 @@
 /*
  *  device.c
- *  irtouchd device function 
+ *  irtouchd device function
  *
  *  Created by David Keller on 09/11/08.
  *  Copyright 2008 EFREI. All rights reserved.
  *
  */
 
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include <sched.h>
+#include <peach.h>
+
 #include <multitouch.h>
 
+#define _CACHE_LINE_SIZE 64
+
+typedef struct
+{
+    uint16_t count;
+    mt_output_t * outputs [];
+}
+_routes_t;
+
+/* Routes are read without locking by the threads transmitting packets:
+ * writers publish a new array, then wait for readers to leave the old one.
+ * Entries are aligned on cache lines, so senders do not share readers
+ * counters.
+ */
+typedef struct
+{
+    _routes_t * volatile routes;
+    volatile uint32_t readers;
+
+    /* Input bound to the device to route packets of this sender */
+    mt_input_t * input;
+}
+__attribute__((aligned(_CACHE_LINE_SIZE)))
+_table_entry_t;
+
+struct _device_t
+{
+    _table_entry_t table [MT_SENDER_MAX];
+
+    /* Serializes writers */
+    pthread_mutex_t lock;
+};
+
+static _routes_t *
+_routes_init
+            (uint16_t count);
+
+static int
+_routes_find
+            (const _routes_t * routes,
+            const mt_output_t * output);
+
+static void
+_publish_routes
+            (_table_entry_t * entry,
+            _routes_t * routes);
+
+static int
+_add_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output);
+
+static int
+_remove_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output);
+
+
+mt_device_t *
+mt_device_init(void)
+{
+    mt_device_t * device;
+
+    if (posix_memalign((void **)&device, _CACHE_LINE_SIZE, 
+                sizeof(*device)) != 0)
+        device = 0;
+    assert(device != 0);
+
+    memset(device, 0, sizeof(*device));
+    pthread_mutex_init(&device->lock, 0);
+
+    return device;
+}
+
+void
+mt_device_destroy
+            (mt_device_t * device)
+{
+    mt_sender_t sender;
+
+    assert(device != 0);
+
+    for (sender = 0; sender < MT_SENDER_MAX; sender ++) {
+        _table_entry_t * entry;
+
+        entry = &device->table[sender];
+
+        if (entry->input != 0)
+            mt_input_unbind(entry->input,
+                        (mt_device_packet_process_t)mt_device_transmit,
+                        device);
+
+        free(entry->routes);
+    }
+
+    pthread_mutex_destroy(&device->lock);
+    free(device);
+}
+
+int
+mt_device_connect
+            (mt_device_t * device,
+            mt_input_t * input,
+            mt_output_t * output)
+{
+    _table_entry_t * entry;
+    mt_sender_t sender;
+
+    assert(device != 0);
+    assert(input != 0);
+    assert(output != 0);
+
+    if ((sender = mt_input_get_sender(input)) >= MT_SENDER_MAX)
+        return -1;
+
+    entry = &device->table[sender];
+
+    pthread_mutex_lock(&device->lock);
+
+    if (entry->input != 0 && entry->input != input) {
+        peach_log_debug(1, "Device: an other input is already routed as "
+                    "'%s'.\n", mt_sender_get_name(sender));
+
+        goto exit_with_failure;
+    }
+
+    if (_add_route(device, sender, output) != 0)
+        goto exit_with_failure;
+
+    if (entry->input == 0) {
+        entry->input = input;
+        mt_input_bind(input, (mt_device_packet_process_t)mt_device_transmit,
+                    device);
+    }
+
+    pthread_mutex_unlock(&device->lock);
+
+    return 0;
+
+exit_with_failure:
+    pthread_mutex_unlock(&device->lock);
+
+    return -1;
+}
+
+int
+mt_device_disconnect
+            (mt_device_t * device,
+            mt_input_t * input,
+            mt_output_t * output)
+{
+    _table_entry_t * entry;
+    mt_sender_t sender;
+
+    assert(device != 0);
+    assert(input != 0);
+    assert(output != 0);
+
+    if ((sender = mt_input_get_sender(input)) >= MT_SENDER_MAX)
+        return -1;
+
+    entry = &device->table[sender];
+
+    pthread_mutex_lock(&device->lock);
+
+    if (entry->input != input || _remove_route(device, sender, output) != 0)
+        goto exit_with_failure;
+
+    /* No need to hear about the input anymore */
+    if (entry->routes == 0) {
+        mt_input_unbind(input, (mt_device_packet_process_t)mt_device_transmit,
+                    device);
+        entry->input = 0;
+    }
+
+    pthread_mutex_unlock(&device->lock);
+
+    return 0;
+
+exit_with_failure:
+    pthread_mutex_unlock(&device->lock);
+
+    return -1;
+}
+
+int
+mt_device_add_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output)
+{
+    int result;
+
+    assert(device != 0);
+    assert(output != 0);
+
+    if (sender >= MT_SENDER_MAX)
+        return -1;
+
+    pthread_mutex_lock(&device->lock);
+    result = _add_route(device, sender, output);
+    pthread_mutex_unlock(&device->lock);
+
+    return result;
+}
+
+int
+mt_device_remove_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output)
+{
+    int result;
+
+    assert(device != 0);
+    assert(output != 0);
+
+    if (sender >= MT_SENDER_MAX)
+        return -1;
+
+    pthread_mutex_lock(&device->lock);
+    result = _remove_route(device, sender, output);
+    pthread_mutex_unlock(&device->lock);
+
+    return result;
+}
+
+int
+mt_device_set_routes
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * const * outputs,
+            uint16_t outputs_count)
+{
+    _routes_t * routes;
+
+    assert(device != 0);
+    assert(outputs_count == 0 || outputs != 0);
+
+    if (sender >= MT_SENDER_MAX)
+        return -1;
+
+    routes = 0;
+    if (outputs_count > 0) {
+        routes = _routes_init(outputs_count);
+        memcpy(routes->outputs, outputs,
+                    sizeof(*routes->outputs) * outputs_count);
+    }
+
+    pthread_mutex_lock(&device->lock);
+    _publish_routes(&device->table[sender], routes);
+    pthread_mutex_unlock(&device->lock);
+
+    return 0;
+}
+
+/* Outputs share a single reference on packets which were not built by a
+ * constructor, instead of each of them copying the packet.
+ */
+int
+mt_device_transmit
+            (mt_device_t * device,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    _table_entry_t * entry;
+    const _routes_t * routes;
+    const mt_packet_t * shared_packet;
+    uint16_t output_index;
+    int result;
+
+    if (from >= MT_SENDER_MAX)
+        return -1;
+
+    entry = &device->table[from];
+
+    __sync_fetch_and_add(&entry->readers, 1);
+
+    routes = entry->routes;
+    result = 0;
+
+    if (routes != 0) {
+        shared_packet = routes->count > 1 ? mt_packet_acquire(packet) : packet;
+
+        for (output_index = 0; output_index < routes->count; output_index ++)
+            if (mt_output_transmit(routes->outputs[output_index], from,
+                        shared_packet) != 0)
+                result = -1;
+
+        if (routes->count > 1)
+            mt_packet_release(shared_packet);
+    }
+
+    __sync_fetch_and_sub(&entry->readers, 1);
+
+    return result;
+}
+
+static _routes_t *
+_routes_init
+            (uint16_t count)
+{
+    _routes_t * routes;
+
+    routes = malloc(sizeof(*routes) + sizeof(*routes->outputs) * count);
+    assert(routes != 0);
+
+    routes->count = count;
+
+    return routes;
+}
+
+static int
+_routes_find
+            (const _routes_t * routes,
+            const mt_output_t * output)
+{
+    uint16_t output_index;
+
+    if (routes == 0)
+        goto exit_with_failure;
+
+    for (output_index = 0; output_index < routes->count; output_index ++)
+        if (routes->outputs[output_index] == output)
+            return output_index;
+
+exit_with_failure:
+    return -1;
+}
+
+static void
+_publish_routes
+            (_table_entry_t * entry,
+            _routes_t * routes)
+{
+    _routes_t * old_routes;
+
+    old_routes = __sync_lock_test_and_set(&entry->routes, routes);
+    __sync_synchronize();
+
+    /* Readers which may still be walking the old array exit quickly */
+    while (entry->readers != 0)
+        sched_yield();
+
+    free(old_routes);
+}
+
+static int
+_add_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output)
+{
+    _table_entry_t * entry;
+    _routes_t * routes;
+    uint16_t count;
+
+    entry = &device->table[sender];
+
+    if (_routes_find(entry->routes, output) >= 0)
+        goto exit_with_failure;
+
+    count = entry->routes ? entry->routes->count : 0;
+
+    routes = _routes_init(count + 1);
+    if (count > 0)
+        memcpy(routes->outputs, entry->routes->outputs,
+                    sizeof(*routes->outputs) * count);
+    routes->outputs[count] = output;
+
+    _publish_routes(entry, routes);
+
+    peach_log_debug(2, "Device: routing '%s' to '%s'.\n",
+                mt_sender_get_name(sender), mt_output_get_id(output));
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_remove_route
+            (mt_device_t * device,
+            mt_sender_t sender,
+            mt_output_t * output)
+{
+    _table_entry_t * entry;
+    _routes_t * routes;
+    int output_index;
+
+    entry = &device->table[sender];
+
+    if ((output_index = _routes_find(entry->routes, output)) < 0)
+        goto exit_with_failure;
+
+    routes = 0;
+    if (entry->routes->count > 1) {
+        routes = _routes_init(entry->routes->count - 1);
+        memcpy(routes->outputs, entry->routes->outputs,
+                    sizeof(*routes->outputs) * output_index);
+        memcpy(routes->outputs + output_index,
+                    entry->routes->outputs + output_index + 1,
+                    sizeof(*routes->outputs)
+                    * (routes->count - output_index));
+    }
+
+    _publish_routes(entry, routes);
+
+    peach_log_debug(2, "Device: not routing '%s' to '%s' anymore.\n",
+                mt_sender_get_name(sender), mt_output_get_id(output));
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
@@ -12,15 +12,29 @@
 
 #include <multitouch.h>
 
+#include "wire.h"
+
+static int
+_has_ids
+            (const mt_event_t * event);
+
+static int32_t
+_find_touch
+            (const mt_event_t * event,
+            uint32_t id,
+            uint16_t hint);
+
 mt_event_t *
 mt_event_init
             (uint16_t touch_count)
 {
     mt_event_t * event;
+    size_t length;
 
-    event = calloc(1, sizeof(event->info) 
-                + sizeof(*event->touchset) * touch_count);
-    assert(event != 0);
+    length = sizeof(event->info) + sizeof(*event->touchset) * touch_count;
+
+    event = mt_pool_alloc(length);
+    memset(event, 0, length);
 
     event->info.touch_count = touch_count;
 
@@ -33,7 +47,7 @@ mt_event_destroy
 {
     assert(event != 0);
 
-    free(event);
+    mt_pool_free(event);
 }
 
 const void *
@@ -64,3 +78,281 @@ mt_event_copy
 
     return event_copy;
 }
+
+mt_event_t *
+mt_event_coalesce
+            (const mt_event_t * older,
+            const mt_event_t * newer)
+{
+    mt_event_t * event;
+    uint16_t touch_index;
+    int32_t newer_index;
+
+    assert(older != 0);
+    assert(newer != 0);
+
+    if (_has_ids(older) == 0 || _has_ids(newer) == 0) {
+        for (touch_index = newer->info.touch_count; 
+                    touch_index < older->info.touch_count; touch_index ++)
+            if (older->touchset[touch_index].phase == INPUT_TOUCH_BEGAN)
+                goto exit_with_failure;
+
+        event = mt_event_copy(newer);
+
+        for (touch_index = 0; touch_index < event->info.touch_count 
+                    && touch_index < older->info.touch_count; touch_index ++)
+            if (older->touchset[touch_index].phase == INPUT_TOUCH_BEGAN)
+                event->touchset[touch_index].phase = INPUT_TOUCH_BEGAN;
+
+        return event;
+    }
+
+    event = 0;
+
+    for (touch_index = 0; touch_index < older->info.touch_count; 
+                touch_index ++) {
+        if (older->touchset[touch_index].phase != INPUT_TOUCH_BEGAN)
+            continue;
+
+        if ((newer_index = _find_touch(newer, 
+                    older->touchset[touch_index].id, touch_index)) < 0) {
+            if (event != 0)
+                mt_event_destroy(event);
+
+            goto exit_with_failure;
+        }
+
+        if (event == 0)
+            event = mt_event_copy(newer);
+
+        event->touchset[newer_index].phase = INPUT_TOUCH_BEGAN;
+    }
+
+    return event != 0 ? event : mt_event_copy(newer);
+
+exit_with_failure:
+    return 0;
+}
+
+size_t
+mt_event_get_encoded_length
+            (const mt_event_t * event)
+{
+    assert(event != 0);
+
+    return MT_WIRE_HEADER_LENGTH 
+                + MT_WIRE_RECORD_LENGTH * event->info.touch_count;
+}
+
+size_t
+mt_event_encode
+            (const mt_event_t * event,
+            void * buffer,
+            size_t size)
+{
+    uint8_t * data;
+    uint16_t touch_index;
+    size_t length;
+
+    assert(event != 0);
+    assert(buffer != 0);
+
+    if ((length = mt_event_get_encoded_length(event)) > size)
+        goto exit_with_failure;
+
+    data = buffer;
+
+    data[MT_WIRE_HEADER_MAGIC] = 'M';
+    data[MT_WIRE_HEADER_MAGIC + 1] = 'T';
+    data[MT_WIRE_HEADER_VERSION] = MT_WIRE_VERSION;
+    data[MT_WIRE_HEADER_VERSION + 1] = 0;
+    mt_wire_write_u32(data + MT_WIRE_HEADER_FLAGS, event->info.flags);
+    mt_wire_write_u64(data + MT_WIRE_HEADER_TIMESTAMP, 
+                mt_wire_encode_timestamp(event->info.timestamp));
+    mt_wire_write_u16(data + MT_WIRE_HEADER_TOUCH_COUNT, 
+                event->info.touch_count);
+    data[MT_WIRE_HEADER_RECORD_LENGTH] = MT_WIRE_RECORD_LENGTH;
+    data[MT_WIRE_HEADER_RECORD_LENGTH + 1] = 0;
+
+    data += MT_WIRE_HEADER_LENGTH;
+
+    for (touch_index = 0; touch_index < event->info.touch_count; 
+                touch_index ++, data += MT_WIRE_RECORD_LENGTH) {
+        const mt_event_touch_t * touch;
+
+        touch = &event->touchset[touch_index];
+
+        mt_wire_write_u16(data + MT_WIRE_RECORD_X, 
+                    mt_wire_quantize(touch->where.origin.x));
+        mt_wire_write_u16(data + MT_WIRE_RECORD_Y, 
+                    mt_wire_quantize(touch->where.origin.y));
+        mt_wire_write_u16(data + MT_WIRE_RECORD_WIDTH, 
+                    mt_wire_quantize(touch->where.size.width));
+        mt_wire_write_u16(data + MT_WIRE_RECORD_HEIGHT, 
+                    mt_wire_quantize(touch->where.size.height));
+        mt_wire_write_u16(data + MT_WIRE_RECORD_TIMESTAMP,
+                    mt_wire_encode_timestamp_delta(touch->timestamp 
+                        - event->info.timestamp));
+        data[MT_WIRE_RECORD_STATE] = mt_wire_encode_state(touch->phase, 
+                    touch->tap_count);
+        data[MT_WIRE_RECORD_STATE + 1] = 0;
+        mt_wire_write_u32(data + MT_WIRE_RECORD_ID, touch->id);
+    }
+
+    return length;
+
+exit_with_failure:
+    return 0;
+}
+
+int
+mt_event_view_init
+            (mt_event_view_t * view,
+            const void * data,
+            size_t length)
+{
+    const uint8_t * header;
+
+    assert(view != 0);
+    assert(data != 0);
+
+    header = data;
+
+    if (length < MT_WIRE_HEADER_LENGTH)
+        goto exit_with_failure;
+
+    if (header[MT_WIRE_HEADER_MAGIC] != 'M' 
+                || header[MT_WIRE_HEADER_MAGIC + 1] != 'T')
+        goto exit_with_failure;
+
+    /* Newer versions may only append fields to the records */
+    view->version = header[MT_WIRE_HEADER_VERSION];
+    view->record_length = header[MT_WIRE_HEADER_RECORD_LENGTH];
+
+    if (view->version < 1 
+                || view->record_length < MT_WIRE_RECORD_MIN_LENGTH)
+        goto exit_with_failure;
+
+    view->data = header + MT_WIRE_HEADER_LENGTH;
+    view->flags = mt_wire_read_u32(header + MT_WIRE_HEADER_FLAGS);
+    view->timestamp = mt_wire_read_u64(header + MT_WIRE_HEADER_TIMESTAMP) 
+                * 1e-6;
+    view->touch_count = mt_wire_read_u16(header + MT_WIRE_HEADER_TOUCH_COUNT);
+
+    view->length = MT_WIRE_HEADER_LENGTH 
+                + (size_t)view->record_length * view->touch_count;
+
+    if (view->length > length)
+        goto exit_with_failure;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+void
+mt_event_view_get_touch
+            (const mt_event_view_t * view,
+            uint16_t index,
+            mt_event_touch_t * touch)
+{
+    const uint8_t * record;
+
+    assert(view != 0);
+    assert(index < view->touch_count);
+    assert(touch != 0);
+
+    record = view->data + (size_t)view->record_length * index;
+
+    touch->where.origin.x = mt_wire_dequantize(
+                mt_wire_read_u16(record + MT_WIRE_RECORD_X));
+    touch->where.origin.y = mt_wire_dequantize(
+                mt_wire_read_u16(record + MT_WIRE_RECORD_Y));
+    touch->where.size.width = mt_wire_dequantize(
+                mt_wire_read_u16(record + MT_WIRE_RECORD_WIDTH));
+    touch->where.size.height = mt_wire_dequantize(
+                mt_wire_read_u16(record + MT_WIRE_RECORD_HEIGHT));
+    touch->timestamp = view->timestamp 
+                + (int16_t)mt_wire_read_u16(record + MT_WIRE_RECORD_TIMESTAMP)
+                * MT_WIRE_TIMESTAMP_DELTA_UNIT;
+    touch->phase = record[MT_WIRE_RECORD_STATE] & 0x3;
+    touch->tap_count = record[MT_WIRE_RECORD_STATE] >> 2;
+    touch->id = view->record_length >= MT_WIRE_RECORD_ID + 4
+                ? mt_wire_read_u32(record + MT_WIRE_RECORD_ID) : 0;
+}
+
+void
+mt_event_view_get_origin
+            (const mt_event_view_t * view,
+            uint16_t index,
+            double * x,
+            double * y)
+{
+    const uint8_t * record;
+
+    assert(view != 0);
+    assert(index < view->touch_count);
+
+    record = view->data + (size_t)view->record_length * index;
+
+    *x = mt_wire_dequantize(mt_wire_read_u16(record + MT_WIRE_RECORD_X));
+    *y = mt_wire_dequantize(mt_wire_read_u16(record + MT_WIRE_RECORD_Y));
+}
+
+mt_event_t *
+mt_event_view_decode
+            (const mt_event_view_t * view)
+{
+    mt_event_t * event;
+    uint16_t touch_index;
+
+    assert(view != 0);
+
+    event = mt_event_init(view->touch_count);
+
+    event->info.flags = view->flags;
+    event->info.timestamp = view->timestamp;
+
+    for (touch_index = 0; touch_index < view->touch_count; touch_index ++)
+        mt_event_view_get_touch(view, touch_index, 
+                    &event->touchset[touch_index]);
+
+    return event;
+}
+
+/* Either every touch has an id, or they are matched by index */
+static int
+_has_ids
+            (const mt_event_t * event)
+{
+    uint16_t touch_index;
+
+    for (touch_index = 0; touch_index < event->info.touch_count; 
+                touch_index ++)
+        if (event->touchset[touch_index].id == 0)
+            return 0;
+
+    return 1;
+}
+
+/* Touches usually keep their index from a frame to the next one */
+static int32_t
+_find_touch
+            (const mt_event_t * event,
+            uint32_t id,
+            uint16_t hint)
+{
+    uint16_t touch_index;
+
+    if (hint < event->info.touch_count 
+                && event->touchset[hint].id == id)
+        return hint;
+
+    for (touch_index = 0; touch_index < event->info.touch_count; 
+                touch_index ++)
+        if (event->touchset[touch_index].id == id)
+            return touch_index;
+
+    return -1;
+}
@@ -0,0 +1,163 @@
+/*
+ *  event_soa.c
+ *  irtouchd structure of arrays event function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <multitouch.h>
+
+#define _ALIGN(value) \
+            (((value) + MT_EVENT_SOA_ALIGNMENT - 1) \
+            & ~(uintptr_t)(MT_EVENT_SOA_ALIGNMENT - 1))
+
+/* Arrays follow the event in the same block */
+mt_event_soa_t *
+mt_event_soa_init
+            (uint16_t touch_count)
+{
+    mt_event_soa_t * event;
+    uintptr_t array;
+    size_t length;
+
+    length = sizeof(*event) + MT_EVENT_SOA_ALIGNMENT - 1
+                + 3 * _ALIGN(sizeof(uint32_t) * touch_count)
+                + 5 * _ALIGN(sizeof(double) * touch_count);
+
+    event = mt_pool_alloc(length);
+    memset(event, 0, length);
+
+    event->info.touch_count = touch_count;
+
+    array = _ALIGN((uintptr_t)(event + 1));
+
+#define _PLACE(member) \
+    do { \
+        event->member = (void *)array; \
+        array += _ALIGN(sizeof(*event->member) * touch_count); \
+    } while (0)
+
+    _PLACE(ids);
+    _PLACE(tap_counts);
+    _PLACE(phases);
+    _PLACE(timestamps);
+    _PLACE(x);
+    _PLACE(y);
+    _PLACE(width);
+    _PLACE(height);
+
+#undef _PLACE
+
+    return event;
+}
+
+void
+mt_event_soa_destroy
+            (mt_event_soa_t * event)
+{
+    assert(event != 0);
+
+    mt_pool_free(event);
+}
+
+mt_event_soa_t *
+mt_event_soa_copy
+            (const mt_event_soa_t * event)
+{
+    mt_event_soa_t * event_copy;
+    uint16_t touch_count;
+
+    assert(event != 0);
+
+    touch_count = event->info.touch_count;
+
+    event_copy = mt_event_soa_init(touch_count);
+    event_copy->info.flags = event->info.flags;
+    event_copy->info.timestamp = event->info.timestamp;
+
+#define _COPY(member) \
+    memcpy(event_copy->member, event->member, \
+                sizeof(*event->member) * touch_count)
+
+    _COPY(ids);
+    _COPY(tap_counts);
+    _COPY(phases);
+    _COPY(timestamps);
+    _COPY(x);
+    _COPY(y);
+    _COPY(width);
+    _COPY(height);
+
+#undef _COPY
+
+    return event_copy;
+}
+
+mt_event_soa_t *
+mt_event_to_soa
+            (const mt_event_t * event)
+{
+    const mt_event_touch_t * touch;
+    mt_event_soa_t * soa_event;
+    uint16_t touch_index;
+
+    assert(event != 0);
+
+    soa_event = mt_event_soa_init(event->info.touch_count);
+    soa_event->info.flags = event->info.flags;
+    soa_event->info.timestamp = event->info.timestamp;
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        touch = &event->touchset[touch_index];
+
+        soa_event->ids[touch_index] = touch->id;
+        soa_event->tap_counts[touch_index] = touch->tap_count;
+        soa_event->phases[touch_index] = touch->phase;
+        soa_event->timestamps[touch_index] = touch->timestamp;
+        soa_event->x[touch_index] = touch->where.origin.x;
+        soa_event->y[touch_index] = touch->where.origin.y;
+        soa_event->width[touch_index] = touch->where.size.width;
+        soa_event->height[touch_index] = touch->where.size.height;
+    }
+
+    return soa_event;
+}
+
+mt_event_t *
+mt_event_from_soa
+            (const mt_event_soa_t * event)
+{
+    mt_event_touch_t * touch;
+    mt_event_t * aos_event;
+    uint16_t touch_index;
+
+    assert(event != 0);
+
+    aos_event = mt_event_init(event->info.touch_count);
+    aos_event->info.flags = event->info.flags;
+    aos_event->info.timestamp = event->info.timestamp;
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        touch = &aos_event->touchset[touch_index];
+
+        touch->id = event->ids[touch_index];
+        touch->tap_count = event->tap_counts[touch_index];
+        touch->phase = event->phases[touch_index];
+        touch->timestamp = event->timestamps[touch_index];
+        touch->where.origin.x = event->x[touch_index];
+        touch->where.origin.y = event->y[touch_index];
+        touch->where.size.width = event->width[touch_index];
+        touch->where.size.height = event->height[touch_index];
+    }
+
+    return aos_event;
+}
@@ -0,0 +1,762 @@
+/*
+ *  gesture.c
+ *  irtouchd gesture recognition processing engine
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "wire.h"
+#include "options.h"
+
+/* Gesture packet layout, all integers are little endian & real values
+ * are IEEE 754 single precision:
+ *
+ *      0   magic 'M' 'G'
+ *      2   version
+ *      3   phase
+ *      4   recognized kinds, u16
+ *      6   touch count, u16
+ *      8   frame timestamp in microseconds, u64
+ *      16  centroid x & y, u16 fixed-point normalized values
+ *      20  translation x & y since the gesture began
+ *      28  scale since the gesture began
+ *      32  rotation since the gesture began, in radians
+ *      36  velocity x & y of the centroid, per second
+ */
+#define _VERSION 1
+
+#define _PHASE 3
+#define _KINDS 4
+#define _TOUCH_COUNT 6
+#define _TIMESTAMP 8
+#define _X 16
+#define _Y 18
+#define _TRANSLATION_X 20
+#define _TRANSLATION_Y 24
+#define _SCALE 28
+#define _ROTATION 32
+#define _VELOCITY_X 36
+#define _VELOCITY_Y 40
+#define _LENGTH 44
+
+#define _DEFAULT_PAN_THRESHOLD 0.02
+#define _DEFAULT_PINCH_THRESHOLD 0.1
+#define _DEFAULT_ROTATE_THRESHOLD 0.1
+#define _DEFAULT_SWIPE_VELOCITY 1.0
+
+/* Weight of the last frame into the centroid's velocity */
+#define _VELOCITY_SMOOTHING 0.5
+
+/* Touches closer to their centroid do not tell a scale nor an angle */
+#define _MIN_SPREAD 1e-4
+
+/* Fibonacci hashing, ids are often consecutive */
+#define _ID_HASH(id) ((uint32_t)(id) * 2654435761U >> 7)
+
+typedef struct
+{
+    /* Touches are down, a gesture packet was given */
+    int active;
+    int began;
+
+    uint16_t kinds;
+
+    /* Previous frame, touches being relative to their centroid */
+    double timestamp;
+    double x;
+    double y;
+    double spread;
+    uint16_t touch_count;
+    double * offsets;
+    uint16_t offsets_size;
+
+    /* Ids of the touches of the previous frame, when all of them have one,
+     * found back by an open addressing table of their index plus 1, & 
+     * index in it of each touch of the current frame.
+     */
+    int has_ids;
+    uint32_t * ids;
+    uint16_t * id_slots;
+    uint32_t id_slots_mask;
+    uint16_t * matches;
+
+    /* Without ids, distance of each touch of the previous frame to its
+     * closest neighbour, or a lower bound of it once the touches moved.
+     */
+    double * spacings;
+    int exact_spacings;
+
+    /* Since the touches went down */
+    double translation_x;
+    double translation_y;
+    double scale;
+    double rotation;
+
+    double velocity_x;
+    double velocity_y;
+
+    uint8_t data [_LENGTH];
+}
+_tracker_t;
+
+struct _chain_layer_driver_data_t
+{
+    /* Frames are only replaced by the gestures */
+    int replace;
+
+    double pan_threshold;
+    double pinch_threshold;
+    double rotate_threshold;
+    double swipe_velocity;
+
+    _tracker_t * trackers [MT_SENDER_MAX];
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data);
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static _tracker_t *
+_get_tracker
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from);
+
+static int
+_track
+            (mt_chain_layer_driver_data_t * driver_data,
+            _tracker_t * tracker,
+            const mt_event_t * event);
+
+static int
+_match
+            (_tracker_t * tracker,
+            const mt_event_t * event);
+
+static int
+_match_by_id
+            (_tracker_t * tracker,
+            const mt_event_t * event);
+
+static int
+_match_by_index
+            (_tracker_t * tracker,
+            const mt_event_t * event);
+
+static double
+_moved
+            (const _tracker_t * tracker,
+            const mt_event_t * event,
+            uint16_t touch_index);
+
+static void
+_anchor
+            (_tracker_t * tracker,
+            const mt_event_t * event,
+            double x,
+            double y,
+            int matched);
+
+static void
+_measure_spacings
+            (_tracker_t * tracker);
+
+static void
+_write_header
+            (_tracker_t * tracker,
+            int phase,
+            const mt_event_t * event);
+
+static void
+_write_float
+            (uint8_t * data,
+            double value);
+
+static double
+_read_float
+            (const uint8_t * data);
+
+
+const mt_chain_layer_driver_t mt_chain_gesture_driver =
+{
+    .init = _init,
+    .destroy = _destroy,
+    .process = _process
+};
+
+int
+mt_gesture_decode
+            (const mt_packet_t * packet,
+            mt_gesture_t * gesture)
+{
+    const uint8_t * data;
+
+    assert(packet != 0 && gesture != 0);
+
+    if (packet->type != PACKET_RAW || packet->content.raw.length < _LENGTH)
+        return -1;
+
+    data = packet->content.raw.data;
+    if (data[0] != 'M' || data[1] != 'G' || data[2] != _VERSION)
+        return -1;
+
+    gesture->phase = data[_PHASE];
+    gesture->kinds = mt_wire_read_u16(data + _KINDS);
+    gesture->touch_count = mt_wire_read_u16(data + _TOUCH_COUNT);
+    gesture->timestamp = mt_wire_read_u64(data + _TIMESTAMP) / 1e6;
+    gesture->x = mt_wire_dequantize(mt_wire_read_u16(data + _X));
+    gesture->y = mt_wire_dequantize(mt_wire_read_u16(data + _Y));
+    gesture->translation_x = _read_float(data + _TRANSLATION_X);
+    gesture->translation_y = _read_float(data + _TRANSLATION_Y);
+    gesture->scale = _read_float(data + _SCALE);
+    gesture->rotation = _read_float(data + _ROTATION);
+    gesture->velocity_x = _read_float(data + _VELOCITY_X);
+    gesture->velocity_y = _read_float(data + _VELOCITY_Y);
+
+    return 0;
+}
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    (*driver_data)->replace = strcmp(mt_options_get_string(options, "mode",
+                "append"), "replace") == 0;
+
+    (*driver_data)->pan_threshold = mt_options_get_double(options,
+                "pan_threshold", _DEFAULT_PAN_THRESHOLD);
+    (*driver_data)->pinch_threshold = mt_options_get_double(options,
+                "pinch_threshold", _DEFAULT_PINCH_THRESHOLD);
+    (*driver_data)->rotate_threshold = mt_options_get_double(options,
+                "rotate_threshold", _DEFAULT_ROTATE_THRESHOLD);
+    (*driver_data)->swipe_velocity = mt_options_get_double(options,
+                "swipe_velocity", _DEFAULT_SWIPE_VELOCITY);
+
+    return 0;
+}
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data)
+{
+    uint32_t sender;
+
+    for (sender = 0; sender < MT_SENDER_MAX; sender ++)
+        if (driver_data->trackers[sender] != 0) {
+            free(driver_data->trackers[sender]->offsets);
+            free(driver_data->trackers[sender]->ids);
+            free(driver_data->trackers[sender]->id_slots);
+            free(driver_data->trackers[sender]->matches);
+            free(driver_data->trackers[sender]->spacings);
+            free(driver_data->trackers[sender]);
+        }
+
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    mt_packet_t gesture_packet;
+    _tracker_t * tracker;
+    int result;
+
+    if (packet->type != PACKET_EVENT
+                || (tracker = _get_tracker(driver_data, from)) == 0)
+        return (*accept)(layer, from, packet);
+
+    result = 0;
+
+    if (driver_data->replace == 0)
+        result = (*accept)(layer, from, packet);
+
+    if (_track(driver_data, tracker, packet->content.event.event) != 0) {
+        /* Not reference counted: copied by whoever keeps it */
+        memset(&gesture_packet, 0, sizeof(gesture_packet));
+        gesture_packet.type = PACKET_RAW;
+        gesture_packet.content.raw.data = tracker->data;
+        gesture_packet.content.raw.length = _LENGTH;
+
+        if ((*accept)(layer, from, &gesture_packet) != 0)
+            result = -1;
+    }
+
+    return result;
+}
+
+static _tracker_t *
+_get_tracker
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from)
+{
+    if (from >= MT_SENDER_MAX)
+        return 0;
+
+    if (driver_data->trackers[from] == 0) {
+        driver_data->trackers[from] = calloc(1,
+                    sizeof(*driver_data->trackers[from]));
+        assert(driver_data->trackers[from] != 0);
+    }
+
+    return driver_data->trackers[from];
+}
+
+/* Update the gesture of the sender with its new frame, return 1 if a
+ * gesture packet was written.
+ */
+static int
+_track
+            (mt_chain_layer_driver_data_t * driver_data,
+            _tracker_t * tracker,
+            const mt_event_t * event)
+{
+    const mt_event_touch_t * touch;
+    uint16_t anchor_index;
+    uint16_t touch_index;
+    double x;
+    double y;
+    double spread;
+    double cross;
+    double dot;
+    double duration;
+    int reanchor;
+
+    /* The touches went up */
+    if (event->info.touch_count == 0) {
+        if (tracker->active == 0)
+            return 0;
+
+        tracker->active = 0;
+
+        if (hypot(tracker->velocity_x, tracker->velocity_y)
+                    >= driver_data->swipe_velocity)
+            tracker->kinds |= MT_GESTURE_SWIPE;
+
+        if (tracker->began == 0 && tracker->kinds == 0)
+            return 0;
+
+        tracker->began = 0;
+        _write_header(tracker, GESTURE_ENDED, event);
+
+        return 1;
+    }
+
+    reanchor = tracker->active == 0
+                || event->info.touch_count != tracker->touch_count;
+
+    for (x = 0, y = 0, touch_index = 0;
+                touch_index < event->info.touch_count; touch_index ++) {
+        touch = &event->touchset[touch_index];
+
+        x += touch->where.origin.x;
+        y += touch->where.origin.y;
+
+        /* Another touch took the place of one which went up */
+        if (touch->phase == INPUT_TOUCH_BEGAN)
+            reanchor = 1;
+    }
+
+    x /= event->info.touch_count;
+    y /= event->info.touch_count;
+
+    if (tracker->active == 0) {
+        tracker->active = 1;
+        tracker->began = 0;
+        tracker->kinds = 0;
+        tracker->translation_x = 0;
+        tracker->translation_y = 0;
+        tracker->scale = 1;
+        tracker->rotation = 0;
+        tracker->velocity_x = 0;
+        tracker->velocity_y = 0;
+    }
+
+    /* Touches are only compared to the same touches of the previous
+     * frame, the gesture goes on from the new set.
+     */
+    if (reanchor || _match(tracker, event) != 0) {
+        _anchor(tracker, event, x, y, 0);
+
+        return 0;
+    }
+
+    tracker->translation_x += x - tracker->x;
+    tracker->translation_y += y - tracker->y;
+
+    duration = event->info.timestamp - tracker->timestamp;
+    if (duration > 0) {
+        tracker->velocity_x += _VELOCITY_SMOOTHING
+                    * ((x - tracker->x) / duration - tracker->velocity_x);
+        tracker->velocity_y += _VELOCITY_SMOOTHING
+                    * ((y - tracker->y) / duration - tracker->velocity_y);
+    }
+
+    if (event->info.touch_count >= 2) {
+        for (spread = 0, cross = 0, dot = 0, touch_index = 0;
+                    touch_index < event->info.touch_count; touch_index ++) {
+            double offset_x;
+            double offset_y;
+
+            touch = &event->touchset[touch_index];
+            offset_x = touch->where.origin.x - x;
+            offset_y = touch->where.origin.y - y;
+
+            spread += hypot(offset_x, offset_y);
+
+            anchor_index = tracker->matches[touch_index];
+
+            cross += tracker->offsets[2 * anchor_index] * offset_y
+                        - tracker->offsets[2 * anchor_index + 1] * offset_x;
+            dot += tracker->offsets[2 * anchor_index] * offset_x
+                        + tracker->offsets[2 * anchor_index + 1] * offset_y;
+        }
+
+        spread /= event->info.touch_count;
+
+        if (spread > _MIN_SPREAD && tracker->spread > _MIN_SPREAD) {
+            tracker->scale *= spread / tracker->spread;
+            tracker->rotation += atan2(cross, dot);
+        }
+    }
+
+    _anchor(tracker, event, x, y, 1);
+
+    if (hypot(tracker->translation_x, tracker->translation_y)
+                >= driver_data->pan_threshold)
+        tracker->kinds |= MT_GESTURE_PAN;
+
+    if (fabs(tracker->scale - 1) >= driver_data->pinch_threshold)
+        tracker->kinds |= MT_GESTURE_PINCH;
+
+    if (fabs(tracker->rotation) >= driver_data->rotate_threshold)
+        tracker->kinds |= MT_GESTURE_ROTATE;
+
+    if (tracker->kinds == 0)
+        return 0;
+
+    _write_header(tracker, tracker->began ? GESTURE_CHANGED
+                : GESTURE_BEGAN, event);
+    tracker->began = 1;
+
+    return 1;
+}
+
+/* Find which touch of the previous frame each touch continues, by id
+ * when both frames have them. Inputs without ids may reorder touches, so
+ * their order is only trusted when each touch is still closest to the
+ * previous touch of the same index. Return -1 when the touches must be
+ * anchored again.
+ */
+static int
+_match
+            (_tracker_t * tracker,
+            const mt_event_t * event)
+{
+    uint16_t touch_index;
+    int has_ids;
+
+    for (has_ids = 1, touch_index = 0;
+                touch_index < event->info.touch_count; touch_index ++)
+        if (event->touchset[touch_index].id == 0)
+            has_ids = 0;
+
+    if (has_ids != tracker->has_ids)
+        return -1;
+
+    if (has_ids)
+        return _match_by_id(tracker, event);
+
+    /* Bounds of the spacings may have become too loose to tell */
+    if (_match_by_index(tracker, event) != 0) {
+        if (tracker->exact_spacings)
+            return -1;
+
+        _measure_spacings(tracker);
+
+        return _match_by_index(tracker, event);
+    }
+
+    return 0;
+}
+
+static int
+_match_by_id
+            (_tracker_t * tracker,
+            const mt_event_t * event)
+{
+    uint16_t touch_index;
+    uint32_t slot;
+    uint32_t id;
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        id = event->touchset[touch_index].id;
+
+        for (slot = _ID_HASH(id) & tracker->id_slots_mask;
+                    tracker->id_slots[slot] != 0
+                    && tracker->ids[tracker->id_slots[slot] - 1] != id;
+                    slot = (slot + 1) & tracker->id_slots_mask)
+            ;
+
+        if (tracker->id_slots[slot] == 0)
+            return -1;
+
+        tracker->matches[touch_index] = tracker->id_slots[slot] - 1;
+    }
+
+    return 0;
+}
+
+/* A touch closer to the previous touch of its index than half the
+ * spacing of that touch is closer to it than to any other.
+ */
+static int
+_match_by_index
+            (_tracker_t * tracker,
+            const mt_event_t * event)
+{
+    uint16_t touch_index;
+    double farthest;
+    double moved;
+
+    for (farthest = 0, touch_index = 0;
+                touch_index < event->info.touch_count; touch_index ++) {
+        moved = _moved(tracker, event, touch_index);
+
+        if (2 * moved >= tracker->spacings[touch_index])
+            return -1;
+
+        if (moved > farthest)
+            farthest = moved;
+    }
+
+    /* Two touches got closer by at most the sum of their moves */
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        tracker->spacings[touch_index] -= _moved(tracker, event,
+                    touch_index) + farthest;
+        tracker->matches[touch_index] = touch_index;
+    }
+
+    tracker->exact_spacings = 0;
+
+    return 0;
+}
+
+static double
+_moved
+            (const _tracker_t * tracker,
+            const mt_event_t * event,
+            uint16_t touch_index)
+{
+    return hypot(event->touchset[touch_index].where.origin.x - tracker->x
+                - tracker->offsets[2 * touch_index],
+                event->touchset[touch_index].where.origin.y - tracker->y
+                - tracker->offsets[2 * touch_index + 1]);
+}
+
+/* Remember the frame the next one is compared to */
+static void
+_anchor
+            (_tracker_t * tracker,
+            const mt_event_t * event,
+            double x,
+            double y,
+            int matched)
+{
+    uint16_t touch_index;
+    uint32_t slot;
+    double offset_x;
+    double offset_y;
+
+    /* Only grows, frames with as many touches as before allocate nothing */
+    if (event->info.touch_count > tracker->offsets_size) {
+        tracker->offsets = realloc(tracker->offsets,
+                    2 * sizeof(*tracker->offsets) * event->info.touch_count);
+        tracker->ids = realloc(tracker->ids,
+                    sizeof(*tracker->ids) * event->info.touch_count);
+        tracker->matches = realloc(tracker->matches,
+                    sizeof(*tracker->matches) * event->info.touch_count);
+        tracker->spacings = realloc(tracker->spacings,
+                    sizeof(*tracker->spacings) * event->info.touch_count);
+
+        /* At most half full */
+        for (tracker->id_slots_mask = 1; tracker->id_slots_mask
+                    < 2 * (uint32_t)event->info.touch_count;
+                    tracker->id_slots_mask *= 2)
+            ;
+
+        free(tracker->id_slots);
+        tracker->id_slots = malloc(sizeof(*tracker->id_slots)
+                    * tracker->id_slots_mask);
+        tracker->id_slots_mask --;
+
+        assert(tracker->offsets != 0 && tracker->ids != 0
+                    && tracker->matches != 0 && tracker->spacings != 0
+                    && tracker->id_slots != 0);
+
+        tracker->offsets_size = event->info.touch_count;
+    }
+
+    tracker->spread = 0;
+    tracker->has_ids = 1;
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        tracker->ids[touch_index] = event->touchset[touch_index].id;
+        if (tracker->ids[touch_index] == 0)
+            tracker->has_ids = 0;
+
+        offset_x = event->touchset[touch_index].where.origin.x - x;
+        offset_y = event->touchset[touch_index].where.origin.y - y;
+
+        tracker->offsets[2 * touch_index] = offset_x;
+        tracker->offsets[2 * touch_index + 1] = offset_y;
+        tracker->spread += hypot(offset_x, offset_y);
+    }
+
+    tracker->spread /= event->info.touch_count;
+    tracker->touch_count = event->info.touch_count;
+    tracker->timestamp = event->info.timestamp;
+    tracker->x = x;
+    tracker->y = y;
+
+    if (tracker->has_ids) {
+        memset(tracker->id_slots, 0, sizeof(*tracker->id_slots)
+                    * (tracker->id_slots_mask + 1));
+
+        for (touch_index = 0; touch_index < tracker->touch_count;
+                    touch_index ++) {
+            for (slot = _ID_HASH(tracker->ids[touch_index])
+                        & tracker->id_slots_mask; tracker->id_slots[slot] != 0;
+                        slot = (slot + 1) & tracker->id_slots_mask)
+                ;
+
+            tracker->id_slots[slot] = touch_index + 1;
+        }
+    }
+    /* Matched touches already updated the bounds of their spacings */
+    else if (matched == 0)
+        _measure_spacings(tracker);
+}
+
+/* Quadratic, only done when the touches are anchored again or the bounds
+ * are too loose.
+ */
+static void
+_measure_spacings
+            (_tracker_t * tracker)
+{
+    uint16_t touch_index;
+    uint16_t other_index;
+    double distance;
+
+    for (touch_index = 0; touch_index < tracker->touch_count;
+                touch_index ++)
+        tracker->spacings[touch_index] = HUGE_VAL;
+
+    for (touch_index = 0; touch_index < tracker->touch_count;
+                touch_index ++)
+        for (other_index = touch_index + 1;
+                    other_index < tracker->touch_count; other_index ++) {
+            distance = hypot(tracker->offsets[2 * touch_index]
+                        - tracker->offsets[2 * other_index],
+                        tracker->offsets[2 * touch_index + 1]
+                        - tracker->offsets[2 * other_index + 1]);
+
+            if (distance < tracker->spacings[touch_index])
+                tracker->spacings[touch_index] = distance;
+            if (distance < tracker->spacings[other_index])
+                tracker->spacings[other_index] = distance;
+        }
+
+    tracker->exact_spacings = 1;
+}
+
+static void
+_write_header
+            (_tracker_t * tracker,
+            int phase,
+            const mt_event_t * event)
+{
+    uint8_t * data;
+
+    data = tracker->data;
+
+    data[0] = 'M';
+    data[1] = 'G';
+    data[2] = _VERSION;
+    data[_PHASE] = phase;
+    mt_wire_write_u16(data + _KINDS, tracker->kinds);
+    mt_wire_write_u16(data + _TOUCH_COUNT, event->info.touch_count);
+    mt_wire_write_u64(data + _TIMESTAMP, event->info.timestamp > 0
+                ? (uint64_t)(event->info.timestamp * 1e6 + 0.5) : 0);
+    mt_wire_write_u16(data + _X, mt_wire_quantize(tracker->x));
+    mt_wire_write_u16(data + _Y, mt_wire_quantize(tracker->y));
+    _write_float(data + _TRANSLATION_X, tracker->translation_x);
+    _write_float(data + _TRANSLATION_Y, tracker->translation_y);
+    _write_float(data + _SCALE, tracker->scale);
+    _write_float(data + _ROTATION, tracker->rotation);
+    _write_float(data + _VELOCITY_X, tracker->velocity_x);
+    _write_float(data + _VELOCITY_Y, tracker->velocity_y);
+}
+
+static void
+_write_float
+            (uint8_t * data,
+            double value)
+{
+    uint32_t bits;
+    float single;
+
+    single = value;
+    memcpy(&bits, &single, sizeof(bits));
+
+    mt_wire_write_u32(data, bits);
+}
+
+static double
+_read_float
+            (const uint8_t * data)
+{
+    uint32_t bits;
+    float single;
+
+    bits = mt_wire_read_u32(data);
+    memcpy(&single, &bits, sizeof(single));
+
+    return single;
+}
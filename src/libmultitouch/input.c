@@ -13,13 +13,18 @@
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
+#include <sched.h>
 #include <peach.h>
 
 #include <multitouch.h>
 
+#include "stats.h"
+#include "reactor.h"
+
 struct _input_t
 {
     char * id;
+    mt_sender_t sender;
 
     enum
     {
@@ -37,10 +42,19 @@ struct _input_t
     pthread_t polling_thread;
     int driver_must_stop_polling;
 
-    peach_set_t * listeners;
+    /* Watch of the driver's descriptor, when served by the reactor */
+    int watch;
+
+    /* Listeners are read without locking by the polling thread: writers
+     * publish a new array, then wait for readers to leave the old one.
+     */
+    struct _listeners_t * volatile listeners;
+    volatile uint32_t listeners_readers;
     pthread_mutex_t listeners_lock;
 
     mt_chain_t * post_processing_chain;
+
+    mt_histogram_t * commit_latencies;
 };
 
 typedef struct
@@ -50,6 +64,13 @@ typedef struct
 }
 _listener_t;
 
+typedef struct _listeners_t
+{
+    uint16_t count;
+    _listener_t listeners [];
+}
+_listeners_t;
+
 
 static int
 _polling_thread_run
@@ -67,13 +88,17 @@ _input_driver_commit
 static int
 _give_packet_to_listeners
             (const mt_input_t * input,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
 
-static int
-_give_packet_to_listener
-            (_listener_t * listener,
-            va_list arguments);
+static _listeners_t *
+_listeners_init
+            (uint16_t count);
+
+static void
+_publish_listeners
+            (mt_input_t * input,
+            _listeners_t * listeners);
 
 static int
 _driver_must_stop_polling
@@ -83,6 +108,10 @@ static void *
 _polling_thread
             (void * argument);
 
+static int
+_on_readable
+            (void * argument);
+
 static void
 _lock_listeners
             (const mt_input_t * input);
@@ -112,19 +141,34 @@ mt_input_init
     input->driver = driver;
     pthread_mutex_init(&input->listeners_lock, 0);
 
+    if ((input->sender = mt_sender_intern(input_id)) == MT_SENDER_INVALID) {
+        peach_log_debug(1, "Input '%s': too many senders.\n", input_id);
+
+        goto clean;
+    }
+
     if ((*input->driver->init)(input, &input->driver_data,
                 options) != 0)
         goto clean;
 
-    input->listeners = peach_set_init(10, 4);
+    input->listeners = _listeners_init(0);
 
     input->post_processing_chain = mt_chain_init(input,
                 (mt_device_packet_process_t)_give_packet_to_listeners);
 
-    _polling_thread_run(input);
+    input->commit_latencies = mt_histogram_init();
+
+    if (_polling_thread_run(input) != 0)
+        goto clean_driver;
 
     return input;
 
+clean_driver:
+    mt_chain_destroy(input->post_processing_chain);
+    mt_histogram_destroy(input->commit_latencies);
+    free(input->listeners);
+    (*input->driver->destroy)(input, input->driver_data);
+
 clean:
     pthread_mutex_destroy(&input->listeners_lock);
     free(input->id);
@@ -144,22 +188,46 @@ mt_input_destroy
 
     (*input->driver->destroy)(input, input->driver_data);
 
-    peach_set_destroy(input->listeners, (peach_set_clean_t)free);
+    free(input->listeners);
 
     free(input->id);
     pthread_mutex_destroy(&input->listeners_lock);
 
     mt_chain_destroy(input->post_processing_chain);
+    mt_histogram_destroy(input->commit_latencies);
     free(input);
 }
 
+int
+mt_input_get_commit_latencies
+            (const mt_input_t * input,
+            mt_histogram_t * histogram)
+{
+    assert(input != 0);
+
+    return mt_histogram_copy(histogram, input->commit_latencies);
+}
+
+int
+mt_input_get_layer_latencies
+            (const mt_input_t * input,
+            uint16_t index,
+            mt_histogram_t * histogram)
+{
+    assert(input != 0);
+
+    return mt_chain_get_layer_latencies(input->post_processing_chain, 
+                index, histogram);
+}
+
 int
 mt_input_polling_start(mt_input_t * input)
 {
     if (input->state == INPUT_POLLING_STARTED) 
         goto exit_with_failure;
 
-    _polling_thread_run(input);
+    if (_polling_thread_run(input) != 0)
+        goto exit_with_failure;
 
     return 0;
 
@@ -188,6 +256,15 @@ mt_input_get_id
     return input->id;
 }
 
+mt_sender_t
+mt_input_get_sender
+            (const mt_input_t * input)
+{
+    assert(input != 0);
+
+    return input->sender;
+}
+
 int 
 mt_input_push_post_processing_engine
             (mt_input_t * input,
@@ -216,18 +293,66 @@ mt_input_bind
             mt_device_packet_process_t process,
             void * data)
 {
-    _listener_t * listener;
+    _listeners_t * listeners;
+
+    assert(input != 0);
     assert(process != 0);
 
-    listener = malloc(sizeof(*listener));
-    assert(listener != 0);
+    _lock_listeners(input);
+
+    listeners = _listeners_init(input->listeners->count + 1);
+    memcpy(listeners->listeners, input->listeners->listeners,
+                sizeof(*listeners->listeners) * input->listeners->count);
+
+    listeners->listeners[input->listeners->count].process = process;
+    listeners->listeners[input->listeners->count].data = data;
+
+    _publish_listeners(input, listeners);
+
+    _unlock_listeners(input);
+}
 
-    listener->process = process;
-    listener->data = data;
+int
+mt_input_unbind
+            (mt_input_t * input,
+            mt_device_packet_process_t process,
+            void * data)
+{
+    _listeners_t * listeners;
+    uint16_t listener_index;
+
+    assert(input != 0);
 
     _lock_listeners(input);
-    peach_set_add(input->listeners, listener);
+
+    for (listener_index = 0; listener_index < input->listeners->count; 
+                listener_index ++)
+        if (input->listeners->listeners[listener_index].process == process
+                    && input->listeners->listeners[listener_index].data 
+                        == data)
+            break;
+
+    if (listener_index == input->listeners->count)
+        goto exit_with_failure;
+
+    listeners = _listeners_init(input->listeners->count - 1);
+    memcpy(listeners->listeners, input->listeners->listeners,
+                sizeof(*listeners->listeners) * listener_index);
+    memcpy(listeners->listeners + listener_index, 
+                input->listeners->listeners + listener_index + 1,
+                sizeof(*listeners->listeners) 
+                * (listeners->count - listener_index));
+
+    _publish_listeners(input, listeners);
+
     _unlock_listeners(input);
+
+    return 0;
+
+exit_with_failure:
+    _unlock_listeners(input);
+
+    return -1;
 }
 
 static peach_hash_t * _drivers = 0;
@@ -298,6 +423,30 @@ _polling_thread_run
 {
     pthread_attr_t polling_thread_attribute;
     int result;
+    int fd;
+
+    input->watch = -1;
+
+    /* Drivers without a descriptor to watch fall back on 'run' */
+    if (input->driver->on_readable != 0 
+                && (fd = (*input->driver->get_fd)(input, 
+                    input->driver_data)) >= 0) {
+        mt_chain_compile(input->post_processing_chain);
+
+        /* The reactor may already have been started with a given size */
+        mt_reactor_start(0);
+
+        if ((input->watch = mt_reactor_add(fd, _on_readable, input)) < 0) {
+            peach_log_debug(1, "Input '%s': could not watch its "
+                        "descriptor.\n", input->id);
+
+            return -1;
+        }
+
+        input->state = INPUT_POLLING_STARTED;
+
+        return 0;
+    }
 
     pthread_attr_init(&polling_thread_attribute);
     pthread_attr_setdetachstate(&polling_thread_attribute,
@@ -305,6 +454,8 @@ _polling_thread_run
 
     input->driver_must_stop_polling = 0;
 
+    mt_chain_compile(input->post_processing_chain);
+
     if ((result = pthread_create(&input->polling_thread, 
                 &polling_thread_attribute, _polling_thread, input)) 
                 != 0) {
@@ -317,15 +468,25 @@ _polling_thread_run
 
     pthread_attr_destroy(&polling_thread_attribute);
 
+    if (result != 0)
+        return -1;
+
     input->state = INPUT_POLLING_STARTED;
 
-    return result;
+    return 0;
 }
 
 static int
 _polling_thread_stop
             (mt_input_t * input)
 {
+    if (input->watch >= 0) {
+        mt_reactor_remove(input->watch);
+        input->state = INPUT_POLLING_STOPPED;
+
+        return 0;
+    }
+
     input->driver_must_stop_polling = 1;
 
     if (pthread_kill(input->polling_thread, SIGUSR1) != 0)
@@ -347,45 +508,81 @@ _input_driver_commit
             (const mt_input_t * input,
             const mt_packet_t * packet)
 {
-    return mt_chain_transmit(input->post_processing_chain, 
-                mt_input_get_id(input), packet);
+    uint64_t committed_at;
+    int result;
+
+    if (! MT_STATS_ENABLED())
+        return mt_chain_transmit(input->post_processing_chain, 
+                    input->sender, packet);
+
+    committed_at = mt_stats_now();
+    result = mt_chain_transmit(input->post_processing_chain, 
+                input->sender, packet);
+    mt_histogram_add(input->commit_latencies, mt_stats_now() - committed_at);
+
+    return result;
 }
 
 static int
 _give_packet_to_listeners
             (const mt_input_t * input,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet)
 {
+    mt_input_t * reader;
+    const _listeners_t * listeners;
+    uint16_t listener_index;
     int result;
 
-    _lock_listeners(input);
+    reader = (mt_input_t *)input;
 
-    result = peach_set_foreach(input->listeners, 
-                (peach_set_predicate_t)_give_packet_to_listener, from, packet);
+    __sync_fetch_and_add(&reader->listeners_readers, 1);
 
-    _unlock_listeners(input);
+    listeners = reader->listeners;
+
+    for (result = 0, listener_index = 0; listener_index < listeners->count; 
+                listener_index ++)
+        if ((*listeners->listeners[listener_index].process)(
+                    listeners->listeners[listener_index].data, 
+                    from, packet) != 0)
+            result = -1;
+
+    __sync_fetch_and_sub(&reader->listeners_readers, 1);
 
     return result;
 }
 
-static int
-_give_packet_to_listener
-            (_listener_t * listener,
-            va_list arguments)
+static _listeners_t *
+_listeners_init
+            (uint16_t count)
 {
-    const char * input_id;
-    const mt_packet_t * packet;
+    _listeners_t * listeners;
 
-    input_id = va_arg(arguments, const char *);
-    packet = va_arg(arguments, const mt_packet_t *);
+    listeners = malloc(sizeof(*listeners) 
+                + sizeof(*listeners->listeners) * count);
+    assert(listeners != 0);
 
-    peach_log_debug(3, "Input '%s': sending packet to listener.\n",
-                input_id);
+    listeners->count = count;
 
-    return (*listener->process)(listener->data, input_id, packet);
+    return listeners;
 }
 
+static void
+_publish_listeners
+            (mt_input_t * input,
+            _listeners_t * listeners)
+{
+    _listeners_t * old_listeners;
+
+    old_listeners = __sync_lock_test_and_set(&input->listeners, listeners);
+    __sync_synchronize();
+
+    /* Readers which may still be walking the old array exit quickly */
+    while (input->listeners_readers != 0)
+        sched_yield();
+
+    free(old_listeners);
+}
 
 static int
 _driver_must_stop_polling
@@ -399,6 +596,7 @@ _polling_thread
             (void * argument)
 {
     sigset_t blocked_signal;
+    sigset_t wait_mask;
     mt_input_t * input;
 
     input = argument;
@@ -413,16 +611,40 @@ _polling_thread
                     "the polling thread: '%s'\n", input->id, strerror_r(errno, 
                     error_message_buffer, sizeof(error_message_buffer)));
 
-        goto exit;
+        goto wait_for_stop;
     }
 
     (*input->driver->run)(input, input->driver_data, _input_driver_commit,
                 _driver_must_stop_polling);
 
-exit:
+wait_for_stop:
+    /* Drivers return early once they have nothing left to read. SIGUSR1 
+     * is only let through by sigsuspend, so that a stop requested after 
+     * the test stays pending instead of being lost.
+     */
+    sigemptyset(&blocked_signal);
+    sigaddset(&blocked_signal, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &blocked_signal, &wait_mask);
+    sigdelset(&wait_mask, SIGUSR1);
+
+    while (! input->driver_must_stop_polling)
+        sigsuspend(&wait_mask);
+
     pthread_exit(0);
 }
 
+static int
+_on_readable
+            (void * argument)
+{
+    mt_input_t * input;
+
+    input = argument;
+
+    return (*input->driver->on_readable)(input, input->driver_data, 
+                _input_driver_commit);
+}
+
 static void
 _lock_listeners
             (const mt_input_t * input)
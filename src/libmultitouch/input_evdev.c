@@ -0,0 +1,620 @@
+/*
+ *  input_evdev.c
+ *  irtouchd evdev input driver function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/input.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+
+#define _DEFAULT_SLOTS_COUNT 16
+#define _MAX_SLOTS_COUNT 256
+#define _DEFAULT_READ_BATCH 64
+#define _DEFAULT_AXIS_MAXIMUM 65535
+
+/* Older headers only have the timeval */
+#ifndef input_event_sec
+#define input_event_sec time.tv_sec
+#define input_event_usec time.tv_usec
+#endif
+
+typedef struct
+{
+    /* -1 when no contact is tracked by the slot */
+    int32_t tracking_id;
+
+    int32_t x;
+    int32_t y;
+    int32_t touch_major;
+    int32_t touch_minor;
+
+    /* Since the last frame */
+    int began;
+    int moved;
+}
+_slot_t;
+
+typedef struct
+{
+    int32_t minimum;
+    int32_t maximum;
+}
+_axis_t;
+
+struct _input_driver_data_t
+{
+    int fd;
+    int owns_fd;
+
+    /* Regular files (i.e. recordings) can not be waited with epoll */
+    int pollable;
+
+    /* Not an evdev device, e.g. a pipe or a recording: ranges come from
+     * the options & resync is not possible.
+     */
+    int is_device;
+
+    /* Events are read in batches, a stream may cut the last one */
+    uint8_t * buffer;
+    size_t buffer_size;
+    size_t buffer_length;
+
+    _slot_t * slots;
+    uint16_t slots_count;
+    int32_t slot;
+
+    _axis_t x;
+    _axis_t y;
+
+    /* SYN_DROPPED was read, events are ignored up to the next SYN_REPORT */
+    int dropped;
+};
+
+static int
+_open
+            (mt_input_driver_data_t * driver_data,
+            const peach_hash_t * options);
+
+static void
+_get_axis
+            (mt_input_driver_data_t * driver_data,
+            uint16_t code,
+            _axis_t * axis,
+            const peach_hash_t * options,
+            const char * minimum_option,
+            const char * maximum_option);
+
+static int
+_read_events
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit);
+
+static void
+_process_event
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            const struct input_event * input_event,
+            mt_input_driver_commit_t driver_commit);
+
+static void
+_process_abs
+            (mt_input_driver_data_t * driver_data,
+            uint16_t code,
+            int32_t value);
+
+static void
+_resync
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data);
+
+static void
+_commit_frame
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            const struct input_event * input_event,
+            mt_input_driver_commit_t driver_commit);
+
+static int
+_evdev_driver_init
+            (const mt_input_t * input,
+            mt_input_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_evdev_driver_destroy
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data);
+
+static int
+_evdev_driver_run
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on);
+
+static int
+_evdev_driver_get_fd
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data);
+
+static int
+_evdev_driver_on_readable
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit);
+
+
+const mt_input_driver_t mt_input_evdev_driver =
+{
+    .init = _evdev_driver_init,
+    .destroy = _evdev_driver_destroy,
+    .run = _evdev_driver_run,
+    .get_fd = _evdev_driver_get_fd,
+    .on_readable = _evdev_driver_on_readable
+};
+
+static int
+_evdev_driver_init
+            (const mt_input_t * input,
+            mt_input_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    struct input_absinfo absinfo;
+    struct stat fd_stat;
+    long slots_count;
+    long read_batch;
+    uint16_t slot;
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    if (_open(*driver_data, options) != 0)
+        goto clean;
+
+    (*driver_data)->pollable = fstat((*driver_data)->fd, &fd_stat) != 0
+                || ! S_ISREG(fd_stat.st_mode);
+
+    /* Only devices answer, & only protocol B ones have slots */
+    if (ioctl((*driver_data)->fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) == 0) {
+        int clock_id;
+
+        (*driver_data)->is_device = 1;
+        slots_count = absinfo.maximum + 1;
+        (*driver_data)->slot = absinfo.value;
+
+        /* Timestamps are compared with the ones taken by the library */
+        clock_id = CLOCK_MONOTONIC;
+        ioctl((*driver_data)->fd, EVIOCSCLOCKID, &clock_id);
+    }
+    else
+        slots_count = mt_options_get_integer(options, "slots",
+                    _DEFAULT_SLOTS_COUNT);
+
+    if (slots_count < 1 || slots_count > _MAX_SLOTS_COUNT) {
+        peach_log_debug(1, "Input '%s': unsupported slots count %ld.\n",
+                    mt_input_get_id(input), slots_count);
+
+        goto clean_fd;
+    }
+
+    (*driver_data)->slots_count = slots_count;
+    (*driver_data)->slots = calloc(slots_count,
+                sizeof(*(*driver_data)->slots));
+    assert((*driver_data)->slots != 0);
+
+    for (slot = 0; slot < slots_count; slot ++)
+        (*driver_data)->slots[slot].tracking_id = -1;
+
+    _get_axis(*driver_data, ABS_MT_POSITION_X, &(*driver_data)->x, options,
+                "x_min", "x_max");
+    _get_axis(*driver_data, ABS_MT_POSITION_Y, &(*driver_data)->y, options,
+                "y_min", "y_max");
+
+    read_batch = mt_options_get_integer(options, "read_batch",
+                _DEFAULT_READ_BATCH);
+    if (read_batch < 1 || read_batch > UINT16_MAX)
+        read_batch = _DEFAULT_READ_BATCH;
+
+    (*driver_data)->buffer_size = sizeof(struct input_event) * read_batch;
+    (*driver_data)->buffer = malloc((*driver_data)->buffer_size);
+    assert((*driver_data)->buffer != 0);
+
+    /* Contacts already down are reported as beginning */
+    if ((*driver_data)->is_device)
+        _resync(input, *driver_data);
+
+    return 0;
+
+clean_fd:
+    if ((*driver_data)->owns_fd)
+        close((*driver_data)->fd);
+
+clean:
+    free(*driver_data);
+
+    return -1;
+}
+
+static int
+_evdev_driver_destroy
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data)
+{
+    if (driver_data->owns_fd)
+        close(driver_data->fd);
+
+    free(driver_data->buffer);
+    free(driver_data->slots);
+    free(driver_data);
+
+    return 0;
+}
+
+/* Only used for recordings, which can not be served by the reactor */
+static int
+_evdev_driver_run
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on)
+{
+    /* Until the end of the recording */
+    while (! (*must_stop_polling_on)(input))
+        if (_read_events(input, driver_data, driver_commit) != 0)
+            break;
+
+    return 0;
+}
+
+static int
+_evdev_driver_get_fd
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data)
+{
+    return driver_data->pollable ? driver_data->fd : -1;
+}
+
+static int
+_evdev_driver_on_readable
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit)
+{
+    return _read_events(input, driver_data, driver_commit);
+}
+
+/* Open the 'path' option, or use the descriptor of the 'fd' option */
+static int
+_open
+            (mt_input_driver_data_t * driver_data,
+            const peach_hash_t * options)
+{
+    const char * path;
+    int flags;
+
+    if ((driver_data->fd = mt_options_get_integer(options, "fd", -1)) >= 0) {
+        if ((flags = fcntl(driver_data->fd, F_GETFL)) < 0)
+            goto exit_with_failure;
+
+        fcntl(driver_data->fd, F_SETFL, flags | O_NONBLOCK);
+
+        return 0;
+    }
+
+    if ((path = mt_options_get_string(options, "path", 0)) == 0) {
+        peach_log_debug(1, "Evdev: neither 'path' nor 'fd' option given.\n");
+
+        goto exit_with_failure;
+    }
+
+    if ((driver_data->fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC))
+                < 0)
+        goto exit_with_failure;
+
+    driver_data->owns_fd = 1;
+
+    return 0;
+
+exit_with_failure:
+    {
+        char error_message_buffer [80];
+
+        peach_log_debug(1, "Evdev: could not open the device: '%s'\n",
+                    strerror_r(errno, error_message_buffer,
+                    sizeof(error_message_buffer)));
+    }
+
+    return -1;
+}
+
+static void
+_get_axis
+            (mt_input_driver_data_t * driver_data,
+            uint16_t code,
+            _axis_t * axis,
+            const peach_hash_t * options,
+            const char * minimum_option,
+            const char * maximum_option)
+{
+    struct input_absinfo absinfo;
+
+    if (driver_data->is_device
+                && ioctl(driver_data->fd, EVIOCGABS(code), &absinfo) == 0) {
+        axis->minimum = absinfo.minimum;
+        axis->maximum = absinfo.maximum;
+    }
+    else {
+        axis->minimum = mt_options_get_integer(options, minimum_option, 0);
+        axis->maximum = mt_options_get_integer(options, maximum_option,
+                    _DEFAULT_AXIS_MAXIMUM);
+    }
+
+    if (axis->maximum <= axis->minimum)
+        axis->maximum = axis->minimum + 1;
+}
+
+/* Read a batch of events, return -1 at the end of the stream */
+static int
+_read_events
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit)
+{
+    const struct input_event * input_event;
+    ssize_t length;
+    size_t offset;
+
+    length = read(driver_data->fd, driver_data->buffer
+                + driver_data->buffer_length,
+                driver_data->buffer_size - driver_data->buffer_length);
+
+    if (length < 0) {
+        char error_message_buffer [80];
+
+        if (errno == EAGAIN || errno == EINTR)
+            return 0;
+
+        /* e.g. ENODEV once the device is unplugged */
+        peach_log_debug(1, "Input '%s': could not read events: '%s'\n",
+                    mt_input_get_id(input), strerror_r(errno,
+                    error_message_buffer, sizeof(error_message_buffer)));
+
+        return -1;
+    }
+
+    if (length == 0) {
+        peach_log_debug(2, "Input '%s': end of the events stream.\n",
+                    mt_input_get_id(input));
+
+        return -1;
+    }
+
+    driver_data->buffer_length += length;
+
+    for (offset = 0; driver_data->buffer_length - offset
+                >= sizeof(*input_event); offset += sizeof(*input_event)) {
+        input_event = (const struct input_event *)(driver_data->buffer
+                    + offset);
+
+        _process_event(input, driver_data, input_event, driver_commit);
+    }
+
+    driver_data->buffer_length -= offset;
+    memmove(driver_data->buffer, driver_data->buffer + offset,
+                driver_data->buffer_length);
+
+    return 0;
+}
+
+static void
+_process_event
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            const struct input_event * input_event,
+            mt_input_driver_commit_t driver_commit)
+{
+    if (input_event->type == EV_SYN) {
+        switch (input_event->code) {
+            case SYN_DROPPED:
+                peach_log_debug(2, "Input '%s': events dropped by the "
+                            "kernel, resyncing.\n", mt_input_get_id(input));
+
+                driver_data->dropped = 1;
+                break;
+            case SYN_REPORT:
+                if (driver_data->dropped) {
+                    driver_data->dropped = 0;
+                    _resync(input, driver_data);
+                }
+
+                _commit_frame(input, driver_data, input_event,
+                            driver_commit);
+                break;
+        }
+
+        return;
+    }
+
+    /* Incomplete frames are replaced by the device's state */
+    if (driver_data->dropped)
+        return;
+
+    if (input_event->type == EV_ABS)
+        _process_abs(driver_data, input_event->code, input_event->value);
+}
+
+static void
+_process_abs
+            (mt_input_driver_data_t * driver_data,
+            uint16_t code,
+            int32_t value)
+{
+    _slot_t * slot;
+
+    if (code == ABS_MT_SLOT) {
+        driver_data->slot = value;
+        return;
+    }
+
+    /* Slots beyond the ones announced by the device are ignored */
+    if (driver_data->slot < 0 || driver_data->slot >= driver_data->slots_count)
+        return;
+
+    slot = &driver_data->slots[driver_data->slot];
+
+    switch (code) {
+        case ABS_MT_TRACKING_ID:
+            if (value < 0)
+                slot->tracking_id = -1;
+            else if (value != slot->tracking_id) {
+                slot->tracking_id = value;
+                slot->began = 1;
+            }
+            break;
+        case ABS_MT_POSITION_X:
+            slot->x = value;
+            slot->moved = 1;
+            break;
+        case ABS_MT_POSITION_Y:
+            slot->y = value;
+            slot->moved = 1;
+            break;
+        case ABS_MT_TOUCH_MAJOR:
+            slot->touch_major = value;
+            slot->moved = 1;
+            break;
+        case ABS_MT_TOUCH_MINOR:
+            slot->touch_minor = value;
+            slot->moved = 1;
+            break;
+    }
+}
+
+/* Replace the slots by the device's state, after events were dropped */
+static void
+_resync
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data)
+{
+    static const uint16_t codes [] =
+    {
+        ABS_MT_TRACKING_ID,
+        ABS_MT_POSITION_X,
+        ABS_MT_POSITION_Y,
+        ABS_MT_TOUCH_MAJOR,
+        ABS_MT_TOUCH_MINOR
+    };
+    struct input_absinfo absinfo;
+    int32_t values [_MAX_SLOTS_COUNT + 1];
+    size_t values_size;
+    uint16_t code_index;
+    uint16_t slot;
+
+    if (! driver_data->is_device) {
+        peach_log_debug(2, "Input '%s': could not resync, not a device.\n",
+                    mt_input_get_id(input));
+
+        return;
+    }
+
+    /* The code, then one value per slot */
+    values_size = sizeof(*values) * (driver_data->slots_count + 1);
+
+    for (code_index = 0; code_index < sizeof(codes) / sizeof(*codes);
+                code_index ++) {
+        values[0] = codes[code_index];
+
+        if (ioctl(driver_data->fd, EVIOCGMTSLOTS(values_size), values) < 0)
+            continue;
+
+        for (slot = 0; slot < driver_data->slots_count; slot ++) {
+            driver_data->slot = slot;
+            _process_abs(driver_data, codes[code_index], values[slot + 1]);
+        }
+    }
+
+    if (ioctl(driver_data->fd, EVIOCGABS(ABS_MT_SLOT), &absinfo) == 0)
+        driver_data->slot = absinfo.value;
+}
+
+/* One event per SYN_REPORT, holding every tracked contact */
+static void
+_commit_frame
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            const struct input_event * input_event,
+            mt_input_driver_commit_t driver_commit)
+{
+    mt_event_t * event;
+    mt_packet_t * packet;
+    mt_event_touch_t * touch;
+    _slot_t * slot;
+    uint16_t touch_count;
+    uint16_t slot_index;
+    double x_range;
+    double y_range;
+
+    for (touch_count = 0, slot_index = 0;
+                slot_index < driver_data->slots_count; slot_index ++)
+        if (driver_data->slots[slot_index].tracking_id >= 0)
+            touch_count ++;
+
+    event = mt_event_init(touch_count);
+    event->info.timestamp = input_event->input_event_sec
+                + input_event->input_event_usec / 1e6;
+
+    x_range = driver_data->x.maximum - driver_data->x.minimum;
+    y_range = driver_data->y.maximum - driver_data->y.minimum;
+
+    for (touch = event->touchset, slot_index = 0;
+                slot_index < driver_data->slots_count; slot_index ++) {
+        slot = &driver_data->slots[slot_index];
+
+        if (slot->tracking_id >= 0) {
+            /* Tracking ids start at 0 */
+            touch->id = (uint32_t)slot->tracking_id + 1;
+            touch->timestamp = event->info.timestamp;
+
+            if (slot->began)
+                touch->phase = INPUT_TOUCH_BEGAN;
+            else if (slot->moved)
+                touch->phase = INPUT_TOUCH_MOVED;
+            else
+                touch->phase = INPUT_TOUCH_STATIONARY;
+
+            touch->where.origin.x = (slot->x - driver_data->x.minimum)
+                        / x_range;
+            touch->where.origin.y = (slot->y - driver_data->y.minimum)
+                        / y_range;
+            touch->where.size.width = slot->touch_major / x_range;
+            touch->where.size.height = (slot->touch_minor != 0
+                        ? slot->touch_minor : slot->touch_major) / y_range;
+
+            touch ++;
+        }
+
+        slot->began = 0;
+        slot->moved = 0;
+    }
+
+    packet = mt_packet_init_event(event, mt_event_destroy);
+    (*driver_commit)(input, packet);
+    mt_packet_destroy(packet);
+}
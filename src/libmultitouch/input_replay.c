@@ -0,0 +1,447 @@
+/*
+ *  input_replay.c
+ *  irtouchd replay input driver function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+#include "capture.h"
+
+#define _MAX_MAPPINGS 64
+
+/* Packets point into the mapping, which is unmapped once the input &
+ * every packet are gone.
+ */
+typedef struct
+{
+    /* Odd while the mapping is registered or unregistered */
+    volatile uint32_t sequence;
+
+    /* Null when the registry's slot is free */
+    uint8_t * volatile data;
+    volatile size_t length;
+
+    uint32_t references;
+}
+_mapping_t;
+
+struct _input_driver_data_t
+{
+    _mapping_t * mapping;
+
+    /* 0 to replay as fast as possible */
+    double speed;
+
+    /* Only replay the packets of this sender, if not null */
+    const char * sender_name;
+};
+
+/* Packets' destructors only get the payload, which tells its mapping.
+ * Mappings are looked up without the lock, which only serializes their
+ * registration & unregistration.
+ */
+static struct
+{
+    pthread_mutex_t lock;
+    _mapping_t mappings [_MAX_MAPPINGS];
+}
+_registry = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static _mapping_t *
+_mapping_init
+            (const char * path);
+
+static void
+_mapping_release
+            (const void * address);
+
+static void
+_release_event
+            (mt_event_t * event);
+
+static void
+_release_raw
+            (void * data);
+
+static void
+_sleep_until
+            (const struct timespec * deadline,
+            const mt_input_t * input,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on);
+
+static int
+_replay_driver_init
+            (const mt_input_t * input,
+            mt_input_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_replay_driver_destroy
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data);
+
+static int
+_replay_driver_run
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on);
+
+
+const mt_input_driver_t mt_input_replay_driver =
+{
+    .init = _replay_driver_init,
+    .destroy = _replay_driver_destroy,
+    .run = _replay_driver_run
+};
+
+static int
+_replay_driver_init
+            (const mt_input_t * input,
+            mt_input_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    const mt_capture_header_t * header;
+    const char * path;
+
+    if ((path = mt_options_get_string(options, "path", 0)) == 0) {
+        peach_log_debug(1, "Input '%s': no 'path' option given.\n",
+                    mt_input_get_id(input));
+
+        goto exit_with_failure;
+    }
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    if (((*driver_data)->mapping = _mapping_init(path)) == 0)
+        goto clean;
+
+    header = (const mt_capture_header_t *)(*driver_data)->mapping->data;
+
+    if ((*driver_data)->mapping->length < sizeof(*header)
+                || memcmp(header->magic, MT_CAPTURE_MAGIC,
+                    sizeof(header->magic)) != 0
+                || header->version != MT_CAPTURE_VERSION
+                || header->header_length < sizeof(*header)
+                || header->header_length > (*driver_data)->mapping->length
+                || header->header_length % MT_CAPTURE_ALIGNMENT != 0) {
+        peach_log_debug(1, "Input '%s': '%s' is not a capture.\n",
+                    mt_input_get_id(input), path);
+
+        goto clean_mapping;
+    }
+
+    (*driver_data)->speed = mt_options_get_double(options, "speed", 1.);
+    if ((*driver_data)->speed < 0)
+        (*driver_data)->speed = 0;
+
+    (*driver_data)->sender_name = mt_options_get_string(options, "sender",
+                0);
+    if ((*driver_data)->sender_name != 0)
+        (*driver_data)->sender_name = strdup((*driver_data)->sender_name);
+
+    return 0;
+
+clean_mapping:
+    _mapping_release((*driver_data)->mapping->data);
+
+clean:
+    free(*driver_data);
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_replay_driver_destroy
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data)
+{
+    _mapping_release(driver_data->mapping->data);
+
+    free((char *)driver_data->sender_name);
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_replay_driver_run
+            (const mt_input_t * input,
+            mt_input_driver_data_t * driver_data,
+            mt_input_driver_commit_t driver_commit,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on)
+{
+    const mt_capture_record_t * record;
+    const uint8_t * payload;
+    uint8_t selected_senders [MT_SENDER_MAX / 8];
+    struct timespec started_at;
+    struct timespec deadline;
+    mt_packet_t * packet;
+    uint64_t first_timestamp;
+    uint64_t delay;
+    uint64_t replayed;
+    size_t offset;
+
+    clock_gettime(CLOCK_MONOTONIC, &started_at);
+
+    memset(selected_senders, driver_data->sender_name == 0 ? 0xff : 0,
+                sizeof(selected_senders));
+
+    first_timestamp = 0;
+    replayed = 0;
+
+    for (offset = ((const mt_capture_header_t *)driver_data->mapping->data)
+                ->header_length; ! (*must_stop_polling_on)(input);
+                offset += sizeof(*record) + MT_CAPTURE_ALIGN(record->length)) {
+
+        /* A capture may end with a partially written record */
+        if (driver_data->mapping->length - offset < sizeof(*record))
+            break;
+
+        record = (const mt_capture_record_t *)(driver_data->mapping->data
+                    + offset);
+        payload = (const uint8_t *)(record + 1);
+
+        if (driver_data->mapping->length - offset - sizeof(*record)
+                    < MT_CAPTURE_ALIGN(record->length)
+                || record->sender >= MT_SENDER_MAX)
+            break;
+
+        if (record->type == MT_CAPTURE_RECORD_SENDER) {
+            if (driver_data->sender_name != 0) {
+                if (strlen(driver_data->sender_name) == record->length
+                            && memcmp(driver_data->sender_name, payload,
+                                record->length) == 0)
+                    selected_senders[record->sender / 8]
+                                |= 1 << record->sender % 8;
+                else
+                    selected_senders[record->sender / 8]
+                                &= ~(1 << record->sender % 8);
+            }
+
+            continue;
+        }
+
+        if ((selected_senders[record->sender / 8]
+                    & (1 << record->sender % 8)) == 0)
+            continue;
+
+        if (record->type == MT_CAPTURE_RECORD_EVENT
+                    && (record->length < sizeof(((mt_event_t *)0)->info)
+                        || record->length != mt_event_get_length(
+                            (const mt_event_t *)payload)))
+            continue;
+
+        /* Keep the original spacing of the packets */
+        if (driver_data->speed > 0) {
+            if (replayed == 0)
+                first_timestamp = record->timestamp;
+
+            delay = record->timestamp > first_timestamp
+                        ? (record->timestamp - first_timestamp)
+                            / driver_data->speed
+                        : 0;
+
+            deadline.tv_sec = started_at.tv_sec + delay / 1000000000ULL;
+            deadline.tv_nsec = started_at.tv_nsec + delay % 1000000000ULL;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec ++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+
+            _sleep_until(&deadline, input, must_stop_polling_on);
+        }
+
+        __sync_fetch_and_add(&driver_data->mapping->references, 1);
+
+        if (record->type == MT_CAPTURE_RECORD_EVENT)
+            packet = mt_packet_init_event((mt_event_t *)payload,
+                        _release_event);
+        else
+            packet = mt_packet_init_raw((void *)payload, record->length,
+                        _release_raw);
+
+        (*driver_commit)(input, packet);
+        mt_packet_destroy(packet);
+
+        replayed ++;
+    }
+
+    peach_log_debug(2, "Input '%s': %llu packets replayed.\n",
+                mt_input_get_id(input), (unsigned long long)replayed);
+
+    return 0;
+}
+
+/* Map 'path' & register the mapping, with the input's reference */
+static _mapping_t *
+_mapping_init
+            (const char * path)
+{
+    _mapping_t * mapping;
+    struct stat file_stat;
+    uint16_t mapping_index;
+    uint8_t * data;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        goto exit_with_failure;
+
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0)
+        goto clean_fd;
+
+    /* Private & writable, so engines can't modify the file */
+    if ((data = mmap(0, file_stat.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+        goto clean_fd;
+
+    madvise(data, file_stat.st_size, MADV_SEQUENTIAL);
+
+    close(fd);
+
+    pthread_mutex_lock(&_registry.lock);
+
+    for (mapping_index = 0; mapping_index < _MAX_MAPPINGS; mapping_index ++)
+        if (_registry.mappings[mapping_index].data == 0)
+            break;
+
+    mapping = 0;
+
+    if (mapping_index < _MAX_MAPPINGS) {
+        mapping = &_registry.mappings[mapping_index];
+
+        mapping->sequence ++;
+        __sync_synchronize();
+
+        mapping->data = data;
+        mapping->length = file_stat.st_size;
+        mapping->references = 1;
+
+        __sync_synchronize();
+        mapping->sequence ++;
+    }
+
+    pthread_mutex_unlock(&_registry.lock);
+
+    if (mapping == 0) {
+        peach_log_debug(1, "Replay: too many captures replayed.\n");
+
+        munmap(data, file_stat.st_size);
+    }
+
+    return mapping;
+
+clean_fd:
+    close(fd);
+
+exit_with_failure:
+    {
+        char error_message_buffer [80];
+
+        peach_log_debug(1, "Replay: could not map '%s': '%s'\n", path,
+                    strerror_r(errno, error_message_buffer,
+                    sizeof(error_message_buffer)));
+    }
+
+    return 0;
+}
+
+/* Drop a reference on the mapping holding 'address' */
+static void
+_mapping_release
+            (const void * address)
+{
+    _mapping_t * mapping;
+    uint16_t mapping_index;
+    uint32_t sequence;
+    uint8_t * data;
+    size_t length;
+    int holds;
+
+    for (mapping_index = 0; mapping_index < _MAX_MAPPINGS;
+                mapping_index ++) {
+        mapping = &_registry.mappings[mapping_index];
+
+        /* Read again while the slot is being changed */
+        do {
+            sequence = mapping->sequence;
+            __sync_synchronize();
+
+            data = mapping->data;
+            holds = data != 0 && (const uint8_t *)address >= data
+                        && (const uint8_t *)address < data + mapping->length;
+
+            __sync_synchronize();
+        } while ((sequence & 1) != 0 || sequence != mapping->sequence);
+
+        if (holds)
+            break;
+    }
+
+    assert(mapping_index < _MAX_MAPPINGS);
+
+    if (__sync_sub_and_fetch(&mapping->references, 1) != 0)
+        return;
+
+    length = mapping->length;
+
+    pthread_mutex_lock(&_registry.lock);
+
+    mapping->sequence ++;
+    __sync_synchronize();
+
+    mapping->data = 0;
+    mapping->length = 0;
+
+    __sync_synchronize();
+    mapping->sequence ++;
+
+    pthread_mutex_unlock(&_registry.lock);
+
+    munmap(data, length);
+}
+
+static void
+_release_event
+            (mt_event_t * event)
+{
+    _mapping_release(event);
+}
+
+static void
+_release_raw
+            (void * data)
+{
+    _mapping_release(data);
+}
+
+static void
+_sleep_until
+            (const struct timespec * deadline,
+            const mt_input_t * input,
+            mt_input_driver_must_stop_polling_t must_stop_polling_on)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, 0)
+                == EINTR)
+        if ((*must_stop_polling_on)(input))
+            break;
+}
@@ -0,0 +1,140 @@
+/*
+ *  options.c
+ *  irtouchd options function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <peach.h>
+
+#include "options.h"
+
+const char *
+mt_options_get_string
+            (const peach_hash_t * options,
+            const char * name,
+            const char * default_value)
+{
+    const char * value;
+
+    assert(name != 0);
+
+    if (options == 0)
+        goto exit_with_default;
+
+    if ((value = peach_hash_get(options, name, strlen(name))) == 0)
+        goto exit_with_default;
+
+    return value;
+
+exit_with_default:
+    return default_value;
+}
+
+long
+mt_options_get_integer
+            (const peach_hash_t * options,
+            const char * name,
+            long default_value)
+{
+    const char * value;
+    char * end;
+    long integer;
+
+    if ((value = mt_options_get_string(options, name, 0)) == 0)
+        goto exit_with_default;
+
+    integer = strtol(value, &end, 0);
+    if (end == value || *end != '\0') {
+        peach_log_debug(1, "Options: '%s' is not an integer: '%s'.\n",
+                    name, value);
+
+        goto exit_with_default;
+    }
+
+    return integer;
+
+exit_with_default:
+    return default_value;
+}
+
+double
+mt_options_get_double
+            (const peach_hash_t * options,
+            const char * name,
+            double default_value)
+{
+    const char * value;
+    char * end;
+    double real;
+
+    if ((value = mt_options_get_string(options, name, 0)) == 0)
+        goto exit_with_default;
+
+    real = strtod(value, &end);
+    if (end == value || *end != '\0') {
+        peach_log_debug(1, "Options: '%s' is not a number: '%s'.\n",
+                    name, value);
+
+        goto exit_with_default;
+    }
+
+    return real;
+
+exit_with_default:
+    return default_value;
+}
+
+int
+mt_options_get_doubles
+            (const peach_hash_t * options,
+            const char * name,
+            double * values,
+            size_t count)
+{
+    const char * value;
+    const char * next;
+    char * end;
+    double * reals;
+    size_t index;
+
+    if ((value = mt_options_get_string(options, name, 0)) == 0)
+        goto exit_with_failure;
+
+    reals = malloc(sizeof(*reals) * (count ? count : 1));
+    assert(reals != 0);
+
+    for (index = 0, next = value; ; index ++) {
+        next += strspn(next, " \t,");
+        if (*next == '\0' || index == count)
+            break;
+
+        reals[index] = strtod(next, &end);
+        if (end == next)
+            break;
+
+        next = end;
+    }
+
+    if (index != count || *next != '\0') {
+        peach_log_debug(1, "Options: '%s' is not a list of %zu numbers: "
+                    "'%s'.\n", name, count, value);
+
+        goto clean;
+    }
+
+    memcpy(values, reals, sizeof(*reals) * count);
+    free(reals);
+
+    return 0;
+
+clean:
+    free(reals);
+exit_with_failure:
+    return -1;
+}
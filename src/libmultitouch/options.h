@@ -0,0 +1,51 @@
+/*
+ *  options.h
+ *  irtouchd options private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _OPTIONS_H_
+#define _OPTIONS_H_
+
+#include <stddef.h>
+#include <peach.h>
+
+/**
+ * Options are C strings stored into a peach hash, these helpers
+ * return 'default_value' when 'options' is null, the option is
+ * missing or malformed.
+ */
+extern const char *
+mt_options_get_string
+            (const peach_hash_t * options,
+            const char * name,
+            const char * default_value);
+
+extern long
+mt_options_get_integer
+            (const peach_hash_t * options,
+            const char * name,
+            long default_value);
+
+extern double
+mt_options_get_double
+            (const peach_hash_t * options,
+            const char * name,
+            double default_value);
+
+/**
+ * Fill 'values' with the 'count' numbers, separated by spaces or commas,
+ * of the option. Returns -1 & leaves 'values' untouched when it is
+ * missing or does not hold exactly 'count' numbers.
+ */
+extern int
+mt_options_get_doubles
+            (const peach_hash_t * options,
+            const char * name,
+            double * values,
+            size_t count);
+
+#endif
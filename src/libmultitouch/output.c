@@ -13,10 +13,22 @@
 #include <pthread.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
+#include <sched.h>
 #include <peach.h>
 
 #include <multitouch.h>
 
+#include "ring.h"
+#include "options.h"
+#include "stats.h"
+#include "workers.h"
+
+#define _DEFAULT_QUEUE_CAPACITY 256
+#define _MAX_QUEUE_CAPACITY 65536
+#define _DEFAULT_BATCH_SIZE 64
+#define _DEFAULT_BLOCK_TIMEOUT 10
+
 struct _output_t
 {
     char * id;
@@ -27,20 +39,88 @@ struct _output_t
     pthread_t transmiting_thread;
     volatile int must_stop_transmiting;
 
-    pthread_cond_t packet_available;
-    pthread_mutex_t lock_packets;
-    peach_list_t * packets_to_transmit;
+    /* Shared outputs are a task of the workers pool instead of having a 
+     * transmiting thread. 'scheduled' counts the requests made since the
+     * task was submitted, so it is never queued nor run twice at once.
+     */
+    int shared;
+    volatile int scheduled;
+    mt_workers_task_t task;
+
+    struct _packet_handler_t * packet_handlers;
+
+    /* Futex word the transmiting thread sleeps on when the queue is empty */
+    volatile int waiting_packets;
+    mt_ring_t * packets_to_transmit;
+
+    /* What producers do when the queue is full */
+    enum
+    {
+        OUTPUT_DROP_NEWEST,
+        OUTPUT_DROP_OLDEST,
+        OUTPUT_BLOCK,
+        OUTPUT_COALESCE
+    }
+    overload_policy;
+    uint64_t block_timeout;
+
+    /* Futex word blocked producers sleep on, bumped by the transmiting
+     * thread when it makes room while some are waiting.
+     */
+    volatile int room_sequence;
+    volatile uint32_t blocked_producers;
+
+    /* When coalescing, events wait into one slot per sender, the queue 
+     * only holds a token telling the slot of a sender is pending.
+     */
+    struct _pending_t * pending;
+
+    volatile mt_output_stats_t stats;
+
+    /* Packets leaving the pre processing chain, waiting for the driver's 
+     * transmit_batch function.
+     */
+    struct
+    {
+        uint16_t size;
+        uint16_t length;
+        mt_sender_t * from;
+        const mt_packet_t ** packets;
+    }
+    batch;
 
     mt_chain_t * pre_processing_chain;
+
+    mt_histogram_t * queue_latencies;
+    mt_histogram_t * transmit_latencies;
 };
 
-typedef struct
+typedef struct _packet_handler_t
 {
-    char * from;
-    mt_packet_t * packet;
+    mt_sender_t from;
+
+    /* 0 for the token of a pending event */
+    const mt_packet_t * packet;
+
+    /* 0 when stats were not enabled at enqueue time */
+    uint64_t enqueued_at;
 }
 _packet_handler_t;
 
+typedef struct _pending_t
+{
+    pthread_mutex_t lock;
+
+    const mt_packet_t * packet;
+    uint64_t enqueued_at;
+
+    /* The pending event could not absorb a frame, which was queued after
+     * it: following frames are queued too until the event is transmitted.
+     */
+    int sealed;
+}
+_pending_t;
+
 static int
 _transmiting_thread_run
             (mt_output_t * output);
@@ -57,22 +137,97 @@ static void *
 _transmiting_thread
             (void * argument);
 
+static void
+_run_scheduled
+            (void * argument);
+
+static void
+_schedule
+            (mt_output_t * output);
+
+static void
+_transmit_packets
+            (mt_output_t * output,
+            uint16_t packets_count);
+
 static int
 _give_packet_to_driver
             (mt_output_t * output,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet);
 
+static int
+_give_batch_to_driver
+            (mt_output_t * output);
+
 static uint16_t 
 _get_packets_to_transmit
             (mt_output_t * output,
             uint16_t requested_packets_count,
             _packet_handler_t * packet_handler);
 
+static int
+_push
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static int
+_pop
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static int
+_make_pending
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static void
+_take_pending
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static int
+_push_dropping_oldest
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static int
+_push_coalescing
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static int
+_push_blocking
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler);
+
+static int
+_coalesce_packet_handlers
+            (_packet_handler_t * packet_handler,
+            const _packet_handler_t * older_packet_handler);
+
 static void
-_packet_handler_destroy
+_make_room
+            (mt_output_t * output);
+
+static void
+_record_queue_latencies
+            (mt_output_t * output,
+            uint16_t packets_count,
+            const _packet_handler_t * packet_handlers);
+
+static void
+_wake_transmiting_thread
+            (mt_output_t * output);
+
+static void
+_packet_handler_clean
             (_packet_handler_t * packet_handler);
 
+static void
+_packets_to_transmit_clean
+            (mt_output_t * output);
+
 
 mt_output_t *
 mt_output_init
@@ -81,6 +236,11 @@ mt_output_init
             const peach_hash_t * options)
 {
     mt_output_t * output;
+    const char * overload_policy;
+    const char * execution;
+    long queue_capacity;
+    long block_timeout;
+    long batch_size;
 
     assert(output_id != 0);
     assert(driver != 0);
@@ -91,10 +251,62 @@ mt_output_init
     output->id = strdup(output_id);
     output->driver = driver;
 
-    output->packets_to_transmit = peach_list_init();
+    queue_capacity = mt_options_get_integer(options, "queue_capacity",
+                _DEFAULT_QUEUE_CAPACITY);
+    if (queue_capacity < 1 || queue_capacity > _MAX_QUEUE_CAPACITY)
+        queue_capacity = _DEFAULT_QUEUE_CAPACITY;
+
+    output->packets_to_transmit = mt_ring_init(queue_capacity,
+                sizeof(_packet_handler_t));
+
+    overload_policy = mt_options_get_string(options, "overload_policy",
+                "drop_newest");
+    if (strcmp(overload_policy, "drop_oldest") == 0)
+        output->overload_policy = OUTPUT_DROP_OLDEST;
+    else if (strcmp(overload_policy, "block") == 0)
+        output->overload_policy = OUTPUT_BLOCK;
+    else if (strcmp(overload_policy, "coalesce") == 0)
+        output->overload_policy = OUTPUT_COALESCE;
+    else {
+        if (strcmp(overload_policy, "drop_newest") != 0)
+            peach_log_debug(1, "Output '%s': unknown overload policy '%s', "
+                        "dropping newest packets.\n", output->id, 
+                        overload_policy);
+
+        output->overload_policy = OUTPUT_DROP_NEWEST;
+    }
+
+    block_timeout = mt_options_get_integer(options, "block_timeout",
+                _DEFAULT_BLOCK_TIMEOUT);
+    if (block_timeout < 1)
+        block_timeout = _DEFAULT_BLOCK_TIMEOUT;
+
+    output->block_timeout = block_timeout * 1000000ULL;
+
+    batch_size = mt_options_get_integer(options, "batch_size", 
+                _DEFAULT_BATCH_SIZE);
+    if (batch_size < 1 || batch_size > UINT16_MAX)
+        batch_size = _DEFAULT_BATCH_SIZE;
+
+    output->batch.size = batch_size;
 
-    pthread_cond_init(&output->packet_available, 0);
-    pthread_mutex_init(&output->lock_packets, 0);
+    output->batch.from = malloc(sizeof(*output->batch.from) 
+                * output->batch.size);
+    assert(output->batch.from != 0);
+    output->batch.packets = malloc(sizeof(*output->batch.packets) 
+                * output->batch.size);
+    assert(output->batch.packets != 0);
+
+    output->packet_handlers = malloc(sizeof(*output->packet_handlers) 
+                * output->batch.size);
+    assert(output->packet_handlers != 0);
+
+    execution = mt_options_get_string(options, "execution", "dedicated");
+    if (strcmp(execution, "shared") == 0)
+        output->shared = 1;
+    else if (strcmp(execution, "dedicated") != 0)
+        peach_log_debug(1, "Output '%s': unknown execution '%s', using a "
+                    "dedicated thread.\n", output->id, execution);
 
     if ((*output->driver->init)(output, &output->driver_data, options) != 0)
         goto clean;
@@ -102,15 +314,28 @@ mt_output_init
     output->pre_processing_chain = mt_chain_init(output,
                 (mt_device_packet_process_t)_give_packet_to_driver);
 
+    output->queue_latencies = mt_histogram_init();
+    output->transmit_latencies = mt_histogram_init();
+
+    if (mt_options_get_integer(options, "coalescing", 0) != 0) {
+        mt_sender_t sender;
+
+        output->pending = calloc(MT_SENDER_MAX, sizeof(*output->pending));
+        assert(output->pending != 0);
+
+        for (sender = 0; sender < MT_SENDER_MAX; sender ++)
+            pthread_mutex_init(&output->pending[sender].lock, 0);
+    }
+
     _transmiting_thread_run(output);
 
     return output;
 
 clean:
-    pthread_mutex_destroy(&output->lock_packets);
-    pthread_cond_destroy(&output->packet_available);
-    peach_list_destroy(output->packets_to_transmit, 
-                (peach_list_clean_t)_packet_handler_destroy);
+    mt_ring_destroy(output->packets_to_transmit);
+    free(output->batch.from);
+    free(output->batch.packets);
+    free(output->packet_handlers);
     free(output->id);
     free(output);
 
@@ -127,12 +352,25 @@ mt_output_destroy
 
     (*output->driver->destroy)(output, output->driver_data);
 
-    peach_list_destroy(output->packets_to_transmit, 0);
-    pthread_mutex_destroy(&output->lock_packets);
-    pthread_cond_destroy(&output->packet_available);
+    _packets_to_transmit_clean(output);
+    mt_ring_destroy(output->packets_to_transmit);
+    if (output->pending != 0) {
+        mt_sender_t sender;
+
+        for (sender = 0; sender < MT_SENDER_MAX; sender ++)
+            pthread_mutex_destroy(&output->pending[sender].lock);
+
+        free(output->pending);
+    }
+    free(output->batch.from);
+    free(output->batch.packets);
+    free(output->packet_handlers);
 
     mt_chain_destroy(output->pre_processing_chain);
 
+    mt_histogram_destroy(output->queue_latencies);
+    mt_histogram_destroy(output->transmit_latencies);
+
     free(output->id);
     free(output);
 }
@@ -146,6 +384,24 @@ mt_output_get_id
     return output->id;
 }
 
+const mt_output_driver_t *
+mt_output_get_driver
+            (const mt_output_t * output)
+{
+    assert(output != 0);
+
+    return output->driver;
+}
+
+mt_output_driver_data_t *
+mt_output_get_driver_data
+            (const mt_output_t * output)
+{
+    assert(output != 0);
+
+    return output->driver_data;
+}
+
 extern int 
 mt_output_push_pre_processing_engine
             (mt_output_t * output,
@@ -159,28 +415,105 @@ mt_output_push_pre_processing_engine
 int
 mt_output_transmit
             (mt_output_t * output,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet)
 {
-    _packet_handler_t * packet_handler;
-
-    packet_handler = malloc(sizeof(*packet_handler));
-    assert(packet_handler != 0);
+    _packet_handler_t packet_handler;
 
-    packet_handler->from = strdup(from);
-    packet_handler->packet = mt_packet_copy(packet);
+    packet_handler.from = from;
+    packet_handler.packet = mt_packet_acquire(packet);
+    packet_handler.enqueued_at = MT_STATS_ENABLED() ? mt_stats_now() : 0;
 
     peach_log_debug(3, "Output '%s': queing packet from '%s'.\n",
-            mt_output_get_id(output), from);
+            mt_output_get_id(output), mt_sender_get_name(from));
 
-    pthread_mutex_lock(&output->lock_packets);
+    /* Merged into the pending event of the sender, which is already 
+     * queued.
+     */
+    if (output->pending != 0 && packet->type == PACKET_EVENT
+                && _make_pending(output, &packet_handler) == 1) {
+        __sync_fetch_and_add(&output->stats.enqueued, 1);
+        __sync_fetch_and_add(&output->stats.coalesced, 1);
 
-    peach_list_push_bottom(output->packets_to_transmit, packet_handler);
-    pthread_cond_signal(&output->packet_available);
+        return 0;
+    }
+
+    if (_push(output, &packet_handler) != 0) {
+
+        peach_log_debug(2, "Output '%s': queue is full, dropping packet "
+                    "from '%s'.\n", mt_output_get_id(output), 
+                    mt_sender_get_name(from));
 
-    pthread_mutex_unlock(&output->lock_packets);
+        __sync_fetch_and_add(&output->stats.dropped_newest, 1);
+
+        goto clean;
+    }
+
+    __sync_fetch_and_add(&output->stats.enqueued, 1);
+
+    if (output->shared)
+        _schedule(output);
+    else
+        _wake_transmiting_thread(output);
 
     return 0;
+
+clean:
+    /* Give back the pending event a dropped token stood for */
+    if (packet_handler.packet == 0)
+        _take_pending(output, &packet_handler);
+
+    _packet_handler_clean(&packet_handler);
+
+    return -1;
+}
+
+void
+mt_output_get_stats
+            (const mt_output_t * output,
+            mt_output_stats_t * stats)
+{
+    assert(output != 0);
+    assert(stats != 0);
+
+    stats->enqueued = output->stats.enqueued;
+    stats->dropped_newest = output->stats.dropped_newest;
+    stats->dropped_oldest = output->stats.dropped_oldest;
+    stats->blocked = output->stats.blocked;
+    stats->block_timeouts = output->stats.block_timeouts;
+    stats->coalesced = output->stats.coalesced;
+}
+
+int
+mt_output_get_queue_latencies
+            (const mt_output_t * output,
+            mt_histogram_t * histogram)
+{
+    assert(output != 0);
+
+    return mt_histogram_copy(histogram, output->queue_latencies);
+}
+
+int
+mt_output_get_transmit_latencies
+            (const mt_output_t * output,
+            mt_histogram_t * histogram)
+{
+    assert(output != 0);
+
+    return mt_histogram_copy(histogram, output->transmit_latencies);
+}
+
+int
+mt_output_get_layer_latencies
+            (const mt_output_t * output,
+            uint16_t index,
+            mt_histogram_t * histogram)
+{
+    assert(output != 0);
+
+    return mt_chain_get_layer_latencies(output->pre_processing_chain, 
+                index, histogram);
 }
 
 static peach_hash_t * _drivers = 0;
@@ -249,15 +582,29 @@ static int
 _transmiting_thread_run
             (mt_output_t * output)
 {
+    static volatile uint16_t next_affinity = 0;
     pthread_attr_t transmiting_thread_attribute;
     int result;
 
+    output->must_stop_transmiting = 0;
+
+    mt_chain_compile(output->pre_processing_chain);
+
+    if (output->shared) {
+        /* The pool may already have been started with a given size */
+        mt_workers_start(0);
+
+        output->task.run = _run_scheduled;
+        output->task.data = output;
+        output->task.affinity = __sync_fetch_and_add(&next_affinity, 1);
+
+        return 0;
+    }
+
     pthread_attr_init(&transmiting_thread_attribute);
     pthread_attr_setdetachstate(&transmiting_thread_attribute,
                 PTHREAD_CREATE_JOINABLE);
 
-    output->must_stop_transmiting = 0;
-
     if ((result = pthread_create(&output->transmiting_thread, 
                     &transmiting_thread_attribute, _transmiting_thread, 
                     output)) != 0) {
@@ -279,11 +626,23 @@ _transmiting_thread_stop
 {
     output->must_stop_transmiting = 1;
 
+    if (output->shared) {
+        __sync_synchronize();
+
+        /* Wait for the task to be run a last time, then keep it from
+         * being submitted again.
+         */
+        while (__sync_bool_compare_and_swap(&output->scheduled, 0, 1) == 0)
+            sched_yield();
+
+        return 0;
+    }
+
     if (pthread_kill(output->transmiting_thread, SIGUSR1) != 0)
         goto exit_with_failure;
 
-    if (pthread_cond_signal(&output->packet_available) != 0)
-        goto exit_with_failure;
+    output->waiting_packets = 0;
+    mt_futex_wake(&output->waiting_packets, 1);
 
     if (pthread_join(output->transmiting_thread, 0) != 0)
         goto exit_with_failure;
@@ -308,7 +667,7 @@ _transmiting_thread
 {
     sigset_t blocked_signal;
     mt_output_t * output;
-    _packet_handler_t packet_handler;
+    uint16_t packets_count;
 
     output = argument;
 
@@ -326,27 +685,151 @@ _transmiting_thread
         goto exit;
     }
 
-    while(_get_packets_to_transmit(output, 1, &packet_handler) == 1) {
+    while((packets_count = _get_packets_to_transmit(output, 
+                output->batch.size, output->packet_handlers)) > 0)
+        _transmit_packets(output, packets_count);
+
+exit:
+    pthread_exit(0);
+}
 
-        mt_chain_transmit(output->pre_processing_chain, packet_handler.from,
-                    packet_handler.packet);
+/* Task of a shared output, transmiting at most a batch per run so other 
+ * outputs get their turn.
+ */
+static void
+_run_scheduled
+            (void * argument)
+{
+    mt_output_t * output;
+    uint16_t packets_count;
+    int scheduled;
+
+    output = argument;
+    scheduled = output->scheduled;
 
-        free(packet_handler.from);
-        mt_packet_destroy(packet_handler.packet);
+    if (_must_stop_transmiting(output) != 0)
+        goto release;
+
+    for (packets_count = 0; packets_count < output->batch.size
+                && _pop(output, &output->packet_handlers[packets_count]) == 0;
+                packets_count ++)
+        ;
+
+    if (packets_count > 0) {
+        _make_room(output);
+        _transmit_packets(output, packets_count);
     }
 
-exit:
-    pthread_exit(0);
+    if (_must_stop_transmiting(output) != 0)
+        goto release;
+
+    /* Packets may be left, or were queued while running */
+    if (packets_count == output->batch.size 
+                || __sync_bool_compare_and_swap(&output->scheduled, 
+                    scheduled, 0) == 0)
+        mt_workers_submit(&output->task);
+
+    return;
+
+release:
+    __sync_lock_release(&output->scheduled);
+}
+
+static void
+_schedule
+            (mt_output_t * output)
+{
+    if (__sync_fetch_and_add(&output->scheduled, 1) == 0)
+        mt_workers_submit(&output->task);
+}
+
+static void
+_transmit_packets
+            (mt_output_t * output,
+            uint16_t packets_count)
+{
+    _packet_handler_t * packet_handlers;
+    uint16_t packet_index;
+
+    packet_handlers = output->packet_handlers;
+
+    if (MT_STATS_ENABLED())
+        _record_queue_latencies(output, packets_count, packet_handlers);
+
+    for (packet_index = 0; packet_index < packets_count; packet_index ++)
+        mt_chain_transmit(output->pre_processing_chain, 
+                    packet_handlers[packet_index].from,
+                    packet_handlers[packet_index].packet);
+
+    _give_batch_to_driver(output);
+
+    for (packet_index = 0; packet_index < packets_count; packet_index ++)
+        _packet_handler_clean(&packet_handlers[packet_index]);
 }
 
 static int
 _give_packet_to_driver
             (mt_output_t * output,
-            const char * from,
+            mt_sender_t from,
             const mt_packet_t * packet)
 {
-    return (*output->driver->transmit)(output, output->driver_data, 
-            from, packet);
+    uint64_t transmit_started_at;
+    int result;
+
+    if (output->driver->transmit_batch == 0) {
+        if (! MT_STATS_ENABLED())
+            return (*output->driver->transmit)(output, output->driver_data, 
+                        from, packet);
+
+        transmit_started_at = mt_stats_now();
+        result = (*output->driver->transmit)(output, output->driver_data, 
+                    from, packet);
+        mt_histogram_add(output->transmit_latencies, 
+                    mt_stats_now() - transmit_started_at);
+
+        return result;
+    }
+
+    result = 0;
+    if (output->batch.length == output->batch.size)
+        result = _give_batch_to_driver(output);
+
+    /* Engines may build packets which do not outlive this call */
+    output->batch.from[output->batch.length] = from;
+    output->batch.packets[output->batch.length] = mt_packet_acquire(packet);
+    output->batch.length ++;
+
+    return result;
+}
+
+static int
+_give_batch_to_driver
+            (mt_output_t * output)
+{
+    uint64_t transmit_started_at;
+    uint16_t packet_index;
+    int result;
+
+    if (output->batch.length == 0)
+        return 0;
+
+    transmit_started_at = MT_STATS_ENABLED() ? mt_stats_now() : 0;
+
+    result = (*output->driver->transmit_batch)(output, output->driver_data,
+                output->batch.from, output->batch.packets, 
+                output->batch.length);
+
+    if (transmit_started_at != 0)
+        mt_histogram_add(output->transmit_latencies, 
+                    mt_stats_now() - transmit_started_at);
+
+    for (packet_index = 0; packet_index < output->batch.length; 
+                packet_index ++)
+        mt_packet_release(output->batch.packets[packet_index]);
+
+    output->batch.length = 0;
+
+    return result;
 }
 
 static uint16_t
@@ -357,40 +840,322 @@ _get_packets_to_transmit
 {
     uint16_t packets_count;
 
-    pthread_mutex_lock(&output->lock_packets);
+    for (packets_count = 0; _must_stop_transmiting(output) == 0; ) {
 
-    for (packets_count = 0; _must_stop_transmiting(output) == 0 
-                && requested_packets_count > 0; ) {
+        /* Drain everything available, up to the requested count */
+        while (packets_count < requested_packets_count 
+                    && _pop(output, &packet_handlers[packets_count]) == 0)
+            packets_count ++;
+
+        if (packets_count > 0) {
+            _make_room(output);
+            break;
+        }
 
-        _packet_handler_t * current_packet_handler;
+        /* Announce we are going to sleep, then check again the queue
+         * to not miss a packet pushed in between.
+         */
+        output->waiting_packets = 1;
+        __sync_synchronize();
 
-        if ((current_packet_handler = 
-                    peach_list_pop_top(output->packets_to_transmit)) != 0) {
+        if (mt_ring_get_length(output->packets_to_transmit) == 0
+                    && _must_stop_transmiting(output) == 0)
+            mt_futex_wait(&output->waiting_packets, 1, 0);
 
-            packet_handlers->from = current_packet_handler->from;
-            packet_handlers->packet = current_packet_handler->packet;
+        output->waiting_packets = 0;
+    }
 
-            free(current_packet_handler);
+    return packets_count;
+}
 
-            requested_packets_count --;
-            packets_count ++;
-            packet_handlers ++;
+/* Push, or apply the overload policy when the queue is full */
+static int
+_push
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    if (mt_ring_push(output->packets_to_transmit, packet_handler) == 0)
+        return 0;
+
+    switch (output->overload_policy) {
+        case OUTPUT_DROP_OLDEST:
+            return _push_dropping_oldest(output, packet_handler);
+        case OUTPUT_COALESCE:
+            return _push_coalescing(output, packet_handler);
+        case OUTPUT_BLOCK:
+            return _push_blocking(output, packet_handler);
+        default:
+            return -1;
+    }
+}
+
+/* Pop the oldest packet, tokens are replaced by the pending event */
+static int
+_pop
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    if (mt_ring_pop(output->packets_to_transmit, packet_handler) != 0)
+        goto exit_with_failure;
+
+    if (packet_handler->packet == 0)
+        _take_pending(output, packet_handler);
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+/* Return 0 if the event is now pending & 'packet_handler' became its
+ * token, 1 if the event was merged into the pending one & -1 if it must
+ * be queued as is, as events of senders without a pending slot are.
+ */
+static int
+_make_pending
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    _pending_t * pending;
+    mt_event_t * event;
+    int result;
+
+    if (packet_handler->from >= MT_SENDER_MAX)
+        return -1;
+
+    pending = &output->pending[packet_handler->from];
+
+    pthread_mutex_lock(&pending->lock);
+
+    if (pending->packet == 0) {
+        pending->packet = packet_handler->packet;
+        pending->enqueued_at = packet_handler->enqueued_at;
+        packet_handler->packet = 0;
+
+        result = 0;
+    }
+    else if (pending->sealed == 0 && (event = mt_event_coalesce(
+                pending->packet->content.event.event,
+                packet_handler->packet->content.event.event)) != 0) {
+        mt_packet_release(pending->packet);
+        pending->packet = mt_packet_init_event(event, mt_event_destroy);
+
+        _packet_handler_clean(packet_handler);
+
+        result = 1;
+    }
+    else {
+        pending->sealed = 1;
+
+        result = -1;
+    }
+
+    pthread_mutex_unlock(&pending->lock);
+
+    return result;
+}
+
+static void
+_take_pending
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    _pending_t * pending;
+
+    /* Only senders with a pending slot have tokens */
+    assert(packet_handler->from < MT_SENDER_MAX);
+
+    pending = &output->pending[packet_handler->from];
+
+    pthread_mutex_lock(&pending->lock);
+
+    assert(pending->packet != 0);
+
+    packet_handler->packet = pending->packet;
+    packet_handler->enqueued_at = pending->enqueued_at;
+
+    pending->packet = 0;
+    pending->sealed = 0;
+
+    pthread_mutex_unlock(&pending->lock);
+}
+
+/* The queue is full: make room by dropping the oldest packets, which some
+ * other producer or the transmiting thread may have popped meanwhile.
+ */
+static int
+_push_dropping_oldest
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    _packet_handler_t oldest_packet_handler;
+
+    do {
+        if (_pop(output, &oldest_packet_handler) == 0) {
+            _packet_handler_clean(&oldest_packet_handler);
+            __sync_fetch_and_add(&output->stats.dropped_oldest, 1);
         }
-        else 
-            pthread_cond_wait(&output->packet_available, 
-                        &output->lock_packets);
     }
+    while (mt_ring_push(output->packets_to_transmit, packet_handler) != 0);
 
-    pthread_mutex_unlock(&output->lock_packets);
+    return 0;
+}
 
-    return packets_count;
+/* Like _push_dropping_oldest, but the oldest packet is merged into the 
+ * new one when they are frames of the same sender.
+ */
+static int
+_push_coalescing
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    _packet_handler_t oldest_packet_handler;
+
+    do {
+        if (_pop(output, &oldest_packet_handler) == 0) {
+            if (_coalesce_packet_handlers(packet_handler, 
+                        &oldest_packet_handler) == 0)
+                __sync_fetch_and_add(&output->stats.coalesced, 1);
+            else
+                __sync_fetch_and_add(&output->stats.dropped_oldest, 1);
+
+            _packet_handler_clean(&oldest_packet_handler);
+        }
+    }
+    while (mt_ring_push(output->packets_to_transmit, packet_handler) != 0);
+
+    return 0;
+}
+
+/* Wait for the transmiting thread to make room, up to 'block_timeout' */
+static int
+_push_blocking
+            (mt_output_t * output,
+            _packet_handler_t * packet_handler)
+{
+    struct timespec timeout;
+    uint64_t deadline;
+    uint64_t now;
+    int room_sequence;
+    int result;
+
+    __sync_fetch_and_add(&output->stats.blocked, 1);
+    __sync_fetch_and_add(&output->blocked_producers, 1);
+
+    deadline = mt_stats_now() + output->block_timeout;
+
+    do {
+        room_sequence = output->room_sequence;
+        __sync_synchronize();
+
+        if ((result = mt_ring_push(output->packets_to_transmit, 
+                    packet_handler)) == 0)
+            break;
+
+        if ((now = mt_stats_now()) >= deadline) {
+            __sync_fetch_and_add(&output->stats.block_timeouts, 1);
+            break;
+        }
+
+        timeout.tv_sec = (deadline - now) / 1000000000ULL;
+        timeout.tv_nsec = (deadline - now) % 1000000000ULL;
+
+        mt_futex_wait(&output->room_sequence, room_sequence, &timeout);
+    }
+    while (1);
+
+    __sync_fetch_and_sub(&output->blocked_producers, 1);
+
+    return result;
+}
+
+/* Replace 'packet_handler' packet by the merge of both frames, return -1
+ * if they can't be merged.
+ */
+static int
+_coalesce_packet_handlers
+            (_packet_handler_t * packet_handler,
+            const _packet_handler_t * older_packet_handler)
+{
+    mt_event_t * event;
+
+    if (packet_handler->from != older_packet_handler->from
+                || packet_handler->packet == 0
+                || packet_handler->packet->type != PACKET_EVENT
+                || older_packet_handler->packet->type != PACKET_EVENT)
+        goto exit_with_failure;
+
+    event = mt_event_coalesce(older_packet_handler->packet->content.event.event,
+                packet_handler->packet->content.event.event);
+    if (event == 0)
+        goto exit_with_failure;
+
+    mt_packet_release(packet_handler->packet);
+    packet_handler->packet = mt_packet_init_event(event, mt_event_destroy);
+
+    /* The merged frame holds data waiting since the older one */
+    if (older_packet_handler->enqueued_at != 0)
+        packet_handler->enqueued_at = older_packet_handler->enqueued_at;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+static void
+_make_room
+            (mt_output_t * output)
+{
+    if (output->blocked_producers == 0)
+        return;
+
+    __sync_fetch_and_add(&output->room_sequence, 1);
+    mt_futex_wake(&output->room_sequence, INT_MAX);
 }
 
 static void
-_packet_handler_destroy
+_record_queue_latencies
+            (mt_output_t * output,
+            uint16_t packets_count,
+            const _packet_handler_t * packet_handlers)
+{
+    uint64_t dequeued_at;
+    uint16_t packet_index;
+
+    dequeued_at = mt_stats_now();
+
+    for (packet_index = 0; packet_index < packets_count; packet_index ++)
+        if (packet_handlers[packet_index].enqueued_at != 0)
+            mt_histogram_add(output->queue_latencies, 
+                        dequeued_at - packet_handlers[packet_index].enqueued_at);
+}
+
+static void
+_wake_transmiting_thread
+            (mt_output_t * output)
+{
+    __sync_synchronize();
+
+    if (output->waiting_packets != 0 
+                && __sync_bool_compare_and_swap(&output->waiting_packets, 
+                    1, 0))
+        mt_futex_wake(&output->waiting_packets, 1);
+}
+
+static void
+_packet_handler_clean
             (_packet_handler_t * packet_handler)
 {
-    free(packet_handler->from);
-    mt_packet_destroy(packet_handler->packet);
-    free(packet_handler);
+    mt_packet_release(packet_handler->packet);
+}
+
+static void
+_packets_to_transmit_clean
+            (mt_output_t * output)
+{
+    _packet_handler_t packet_handler;
+
+    while (_pop(output, &packet_handler) == 0)
+        _packet_handler_clean(&packet_handler);
 }
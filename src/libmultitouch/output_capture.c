@@ -0,0 +1,362 @@
+/*
+ *  output_capture.c
+ *  irtouchd capture output driver function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+#include "capture.h"
+
+#define _DEFAULT_BUFFER_SIZE (1024 * 1024)
+
+struct _output_driver_data_t
+{
+    int fd;
+
+    /* Records are written once the buffer is full */
+    uint8_t * buffer;
+    size_t buffer_size;
+    size_t buffer_length;
+
+    /* Senders whose name was already written */
+    uint8_t known_senders [MT_SENDER_MAX / 8];
+};
+
+static int
+_append
+            (mt_output_driver_data_t * driver_data,
+            mt_sender_t sender,
+            uint8_t type,
+            uint64_t timestamp,
+            const void * payload,
+            size_t length);
+
+static int
+_capture_packet
+            (mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
+static int
+_flush
+            (mt_output_driver_data_t * driver_data);
+
+static int
+_write
+            (int fd,
+            struct iovec * iov,
+            int iov_count);
+
+static int
+_capture_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_capture_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data);
+
+static int
+_capture_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
+static int
+_capture_driver_transmit_batch
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count);
+
+
+const mt_output_driver_t mt_output_capture_driver =
+{
+    .init = _capture_driver_init,
+    .destroy = _capture_driver_destroy,
+    .transmit = _capture_driver_transmit,
+    .transmit_batch = _capture_driver_transmit_batch
+};
+
+static int
+_capture_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    mt_capture_header_t header;
+    const char * path;
+    long buffer_size;
+    int flags;
+
+    if ((path = mt_options_get_string(options, "path", 0)) == 0) {
+        peach_log_debug(1, "Output '%s': no 'path' option given.\n",
+                    mt_output_get_id(output));
+
+        goto exit_with_failure;
+    }
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    flags = O_WRONLY | O_CREAT | O_CLOEXEC;
+    flags |= mt_options_get_integer(options, "append", 0) ? O_APPEND
+                : O_TRUNC;
+
+    if (((*driver_data)->fd = open(path, flags, 0644)) < 0) {
+        char error_message_buffer [80];
+
+        peach_log_debug(1, "Output '%s': could not open '%s': '%s'\n",
+                    mt_output_get_id(output), path, strerror_r(errno,
+                    error_message_buffer, sizeof(error_message_buffer)));
+
+        goto clean;
+    }
+
+    buffer_size = mt_options_get_integer(options, "buffer_size",
+                _DEFAULT_BUFFER_SIZE);
+    if (buffer_size < (long)sizeof(header))
+        buffer_size = _DEFAULT_BUFFER_SIZE;
+
+    (*driver_data)->buffer_size = buffer_size;
+    (*driver_data)->buffer = malloc(buffer_size);
+    assert((*driver_data)->buffer != 0);
+
+    /* Appending to a capture, its header is already written */
+    if (lseek((*driver_data)->fd, 0, SEEK_END) == 0) {
+        memcpy(header.magic, MT_CAPTURE_MAGIC, sizeof(header.magic));
+        header.version = MT_CAPTURE_VERSION;
+        header.header_length = sizeof(header);
+
+        memcpy((*driver_data)->buffer, &header, sizeof(header));
+        (*driver_data)->buffer_length = sizeof(header);
+    }
+
+    return 0;
+
+clean:
+    free(*driver_data);
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_capture_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data)
+{
+    int result;
+
+    result = _flush(driver_data);
+
+    close(driver_data->fd);
+    free(driver_data->buffer);
+    free(driver_data);
+
+    return result;
+}
+
+static int
+_capture_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    return _capture_packet(driver_data, from, packet);
+}
+
+static int
+_capture_driver_transmit_batch
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count)
+{
+    uint16_t packet_index;
+    int result;
+
+    for (result = 0, packet_index = 0; packet_index < packets_count;
+                packet_index ++)
+        if (_capture_packet(driver_data, from[packet_index],
+                    packets[packet_index]) != 0)
+            result = -1;
+
+    return result;
+}
+
+static int
+_capture_packet
+            (mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    struct timespec now;
+    uint64_t timestamp;
+    const char * name;
+
+    /* Replays stop at records of senders they cannot name */
+    if (from >= MT_SENDER_MAX)
+        goto exit_with_failure;
+
+    if ((driver_data->known_senders[from / 8] & (1 << from % 8)) == 0) {
+        name = mt_sender_get_name(from);
+
+        if (_append(driver_data, from, MT_CAPTURE_RECORD_SENDER, 0, name,
+                    strlen(name)) != 0)
+            goto exit_with_failure;
+
+        driver_data->known_senders[from / 8] |= 1 << from % 8;
+    }
+
+    /* The event's timestamp is taken when the input built it, queuing
+     * delays are not recorded.
+     */
+    if (packet->type == PACKET_EVENT
+                && packet->content.event.event->info.timestamp > 0)
+        timestamp = packet->content.event.event->info.timestamp * 1e9;
+    else {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    return _append(driver_data, from, packet->type == PACKET_EVENT
+                ? MT_CAPTURE_RECORD_EVENT : MT_CAPTURE_RECORD_RAW,
+                timestamp, mt_packet_serialize(packet),
+                mt_packet_get_length(packet));
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_append
+            (mt_output_driver_data_t * driver_data,
+            mt_sender_t sender,
+            uint8_t type,
+            uint64_t timestamp,
+            const void * payload,
+            size_t length)
+{
+    static const uint8_t padding [MT_CAPTURE_ALIGNMENT] = { 0 };
+    mt_capture_record_t record;
+    struct iovec iov [3];
+    size_t record_length;
+
+    memset(&record, 0, sizeof(record));
+    record.timestamp = timestamp;
+    record.length = length;
+    record.sender = sender;
+    record.type = type;
+
+    record_length = sizeof(record) + MT_CAPTURE_ALIGN(length);
+
+    if (driver_data->buffer_length + record_length > driver_data->buffer_size
+                && _flush(driver_data) != 0)
+        goto exit_with_failure;
+
+    /* Larger than the whole buffer */
+    if (record_length > driver_data->buffer_size) {
+        iov[0].iov_base = &record;
+        iov[0].iov_len = sizeof(record);
+        iov[1].iov_base = (void *)payload;
+        iov[1].iov_len = length;
+        iov[2].iov_base = (void *)padding;
+        iov[2].iov_len = MT_CAPTURE_ALIGN(length) - length;
+
+        return _write(driver_data->fd, iov, 3);
+    }
+
+    memcpy(driver_data->buffer + driver_data->buffer_length, &record,
+                sizeof(record));
+    memcpy(driver_data->buffer + driver_data->buffer_length
+                + sizeof(record), payload, length);
+    memset(driver_data->buffer + driver_data->buffer_length
+                + sizeof(record) + length, 0,
+                MT_CAPTURE_ALIGN(length) - length);
+
+    driver_data->buffer_length += record_length;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_flush
+            (mt_output_driver_data_t * driver_data)
+{
+    struct iovec iov;
+
+    if (driver_data->buffer_length == 0)
+        return 0;
+
+    iov.iov_base = driver_data->buffer;
+    iov.iov_len = driver_data->buffer_length;
+
+    /* The buffer is dropped on failure, to not write a record twice */
+    driver_data->buffer_length = 0;
+
+    return _write(driver_data->fd, &iov, 1);
+}
+
+/* Write everything, 'iov' is modified */
+static int
+_write
+            (int fd,
+            struct iovec * iov,
+            int iov_count)
+{
+    ssize_t written;
+
+    while (iov_count > 0) {
+        if ((written = writev(fd, iov, iov_count)) < 0) {
+            char error_message_buffer [80];
+
+            if (errno == EINTR)
+                continue;
+
+            peach_log_debug(1, "Capture: could not write: '%s'\n",
+                        strerror_r(errno, error_message_buffer,
+                        sizeof(error_message_buffer)));
+
+            goto exit_with_failure;
+        }
+
+        for ( ; iov_count > 0 && (size_t)written >= iov->iov_len;
+                    iov ++, iov_count --)
+            written -= iov->iov_len;
+
+        if (iov_count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
@@ -0,0 +1,372 @@
+/*
+ *  output_shm.c
+ *  irtouchd shared memory output driver function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <peach.h>
+
+#include <multitouch.h>
+#include <multitouch_shm.h>
+
+#include "options.h"
+#include "wire.h"
+
+#define _DEFAULT_SLOTS_COUNT 1024
+#define _MAX_SLOTS_COUNT (1 << 20)
+#define _DEFAULT_SLOT_SIZE 2048
+#define _MAX_SLOT_SIZE (1 << 20)
+
+typedef char _senders_count_check [MT_SHM_SENDERS_COUNT == MT_SENDER_MAX
+            ? 1 : -1];
+
+typedef char _message_types_check [
+            (int)MT_SHM_MESSAGE_EVENT == MT_WIRE_MESSAGE_EVENT
+            && (int)MT_SHM_MESSAGE_ENCODED_EVENT
+                == MT_WIRE_MESSAGE_ENCODED_EVENT
+            && (int)MT_SHM_MESSAGE_RAW == MT_WIRE_MESSAGE_RAW ? 1 : -1];
+
+struct _output_driver_data_t
+{
+    char * name;
+
+    mt_shm_header_t * header;
+    size_t length;
+
+    /* The name may be taken over by another ring, see "replace" */
+    dev_t device;
+    ino_t inode;
+
+    /* Events are written as mt_event_t, or encoded */
+    int encode;
+
+    /* Position of the next message, only written by the producer */
+    uint64_t head;
+
+    /* Senders whose name was already written */
+    uint8_t known_senders [MT_SENDER_MAX / 8];
+};
+
+static int
+_publish
+            (mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
+static void
+_wake_readers
+            (mt_output_driver_data_t * driver_data);
+
+static int
+_shm_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_shm_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data);
+
+static int
+_shm_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
+static int
+_shm_driver_transmit_batch
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count);
+
+
+const mt_output_driver_t mt_output_shm_driver =
+{
+    .init = _shm_driver_init,
+    .destroy = _shm_driver_destroy,
+    .transmit = _shm_driver_transmit,
+    .transmit_batch = _shm_driver_transmit_batch
+};
+
+static int
+_shm_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    mt_shm_header_t * header;
+    struct stat status;
+    const char * name;
+    long slots_count;
+    long slot_size;
+    int fd;
+
+    if ((name = mt_options_get_string(options, "name", 0)) == 0) {
+        peach_log_debug(1, "Output '%s': no 'name' option given.\n",
+                    mt_output_get_id(output));
+
+        goto exit_with_failure;
+    }
+
+    slots_count = mt_options_get_integer(options, "slots",
+                _DEFAULT_SLOTS_COUNT);
+    if (slots_count < 1 || slots_count > _MAX_SLOTS_COUNT)
+        slots_count = _DEFAULT_SLOTS_COUNT;
+
+    /* Positions are masked */
+    while ((slots_count & (slots_count - 1)) != 0)
+        slots_count += slots_count & - slots_count;
+
+    slot_size = mt_options_get_integer(options, "slot_size",
+                _DEFAULT_SLOT_SIZE);
+    if (slot_size < 1 || slot_size > _MAX_SLOT_SIZE)
+        slot_size = _DEFAULT_SLOT_SIZE;
+
+    slot_size = (sizeof(mt_shm_slot_t) + slot_size + 63) & ~63L;
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    (*driver_data)->name = strdup(name);
+    (*driver_data)->encode = strcmp(mt_options_get_string(options,
+                "encoding", "native"), "compact") == 0;
+
+    /* Readers of a replaced ring keep it until they detach */
+    if (mt_options_get_integer(options, "replace", 0) == 1
+                && shm_unlink(name) == 0)
+        peach_log_debug(1, "Output '%s': replacing the ring '%s'.\n",
+                    mt_output_get_id(output), name);
+
+    if ((fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC,
+                    mt_options_get_integer(options, "mode", 0600))) < 0)
+        goto clean;
+
+    (*driver_data)->length = sizeof(*header)
+                + MT_SHM_SENDER_NAME_LENGTH * MT_SENDER_MAX
+                + slots_count * slot_size;
+    (*driver_data)->length = ((*driver_data)->length + 63) & ~(size_t)63;
+
+    if (ftruncate(fd, (*driver_data)->length) != 0
+                || fstat(fd, &status) != 0)
+        goto clean_fd;
+
+    (*driver_data)->device = status.st_dev;
+    (*driver_data)->inode = status.st_ino;
+
+    if ((header = mmap(0, (*driver_data)->length, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0)) == MAP_FAILED)
+        goto clean_fd;
+
+    close(fd);
+
+    (*driver_data)->header = header;
+
+    header->version = MT_SHM_VERSION;
+    header->slots_count = slots_count;
+    header->slot_size = slot_size;
+    header->sender_names_offset = sizeof(*header);
+    header->slots_offset = (sizeof(*header)
+                + MT_SHM_SENDER_NAME_LENGTH * MT_SENDER_MAX + 63) & ~63UL;
+
+    __sync_synchronize();
+    header->magic = MT_SHM_MAGIC;
+
+    peach_log_debug(2, "Output '%s': publishing '%s', %ld slots of %ld "
+                "bytes.\n", mt_output_get_id(output), name, slots_count,
+                slot_size);
+
+    return 0;
+
+clean_fd:
+    close(fd);
+    shm_unlink(name);
+
+clean:
+    {
+        char error_message_buffer [80];
+
+        peach_log_debug(1, "Output '%s': could not create '%s': '%s'\n",
+                    mt_output_get_id(output), name, strerror_r(errno,
+                    error_message_buffer, sizeof(error_message_buffer)));
+    }
+
+    free((*driver_data)->name);
+    free(*driver_data);
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_shm_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data)
+{
+    struct stat status;
+    int fd;
+
+    /* The futex word changes, so sleeping readers do not wait for a 
+     * message.
+     */
+    driver_data->header->closed = 1;
+    __sync_synchronize();
+    driver_data->header->head_futex = (uint32_t)driver_data->head + 1;
+    syscall(SYS_futex, &driver_data->header->head_futex, FUTEX_WAKE,
+                INT_MAX, 0, 0, 0);
+
+    munmap(driver_data->header, driver_data->length);
+
+    /* Unless another output replaced the ring */
+    if ((fd = shm_open(driver_data->name, O_RDONLY | O_CLOEXEC, 0)) >= 0) {
+        if (fstat(fd, &status) == 0 && status.st_dev == driver_data->device
+                    && status.st_ino == driver_data->inode)
+            shm_unlink(driver_data->name);
+
+        close(fd);
+    }
+
+    free(driver_data->name);
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_shm_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    int result;
+
+    result = _publish(driver_data, from, packet);
+    _wake_readers(driver_data);
+
+    return result;
+}
+
+/* Readers are woken once per batch */
+static int
+_shm_driver_transmit_batch
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count)
+{
+    uint16_t packet_index;
+    int result;
+
+    for (result = 0, packet_index = 0; packet_index < packets_count;
+                packet_index ++)
+        if (_publish(driver_data, from[packet_index],
+                    packets[packet_index]) != 0)
+            result = -1;
+
+    _wake_readers(driver_data);
+
+    return result;
+}
+
+static int
+_publish
+            (mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    mt_shm_header_t * header;
+    mt_shm_slot_t * slot;
+    size_t capacity;
+    size_t length;
+    uint8_t type;
+
+    header = driver_data->header;
+    capacity = header->slot_size - sizeof(*slot);
+
+    if (packet->type == PACKET_EVENT && driver_data->encode) {
+        type = MT_SHM_MESSAGE_ENCODED_EVENT;
+        length = mt_packet_get_encoded_length(packet);
+    }
+    else {
+        type = packet->type == PACKET_EVENT ? MT_SHM_MESSAGE_EVENT
+                    : MT_SHM_MESSAGE_RAW;
+        length = mt_packet_get_length(packet);
+    }
+
+    if (length > capacity) {
+        __sync_fetch_and_add(&header->dropped, 1);
+
+        goto exit_with_failure;
+    }
+
+    /* Names are published before the first message of their sender,
+     * readers name senders past the table "".
+     */
+    if (from < MT_SENDER_MAX
+                && (driver_data->known_senders[from / 8]
+                    & (1 << from % 8)) == 0) {
+        strncpy((char *)header + header->sender_names_offset
+                    + (size_t)from * MT_SHM_SENDER_NAME_LENGTH,
+                    mt_sender_get_name(from), MT_SHM_SENDER_NAME_LENGTH - 1);
+
+        driver_data->known_senders[from / 8] |= 1 << from % 8;
+    }
+
+    slot = mt_shm_get_slot(header, driver_data->head);
+
+    /* Readers of the previous message of this slot see it changing */
+    slot->sequence = 2 * driver_data->head + 1;
+    __sync_synchronize();
+
+    slot->length = length;
+    slot->sender = from;
+    slot->type = type;
+
+    if (type == MT_SHM_MESSAGE_ENCODED_EVENT)
+        mt_packet_encode(packet, slot->data, capacity);
+    else
+        memcpy(slot->data, mt_packet_serialize(packet), length);
+
+    __sync_synchronize();
+    slot->sequence = 2 * driver_data->head + 2;
+
+    driver_data->head ++;
+
+    __sync_synchronize();
+    header->head = driver_data->head;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+static void
+_wake_readers
+            (mt_output_driver_data_t * driver_data)
+{
+    mt_shm_header_t * header;
+
+    header = driver_data->header;
+    header->head_futex = (uint32_t)driver_data->head;
+
+    __sync_synchronize();
+
+    /* Readers are spinning, or not waiting at all */
+    if (header->waiters == 0)
+        return;
+
+    syscall(SYS_futex, &header->head_futex, FUTEX_WAKE, INT_MAX, 0, 0, 0);
+}
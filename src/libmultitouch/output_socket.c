@@ -0,0 +1,685 @@
+/*
+ *  output_socket.c
+ *  irtouchd socket output drivers function
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+#include "wire.h"
+
+/* Packets sent by each call */
+#define _CHUNK_SIZE 64
+
+#define _HEADER_LENGTH 8
+#define _MAX_UDP_DATAGRAM_LENGTH 65507
+
+struct _output_driver_data_t
+{
+    int type;
+    struct sockaddr_storage address;
+    socklen_t address_length;
+
+    /* -1 until connected, & once the receiver went away */
+    int fd;
+    int failing;
+
+    int encode;
+    int blocking;
+    long send_buffer;
+    long busy_poll;
+
+    /* Larger datagrams are dropped, 0 if there is no limit */
+    size_t max_length;
+
+    /* Each packet of the chunk is sent from its header & its payload */
+    uint8_t headers [_CHUNK_SIZE][_HEADER_LENGTH];
+    struct iovec iov [_CHUNK_SIZE * 2];
+    struct mmsghdr messages [_CHUNK_SIZE];
+
+    /* Events of the chunk, when encoded */
+    uint8_t * encoded;
+    size_t encoded_size;
+
+    /* Only updated by the output's transmission */
+    volatile mt_output_socket_stats_t stats;
+};
+
+static int
+_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options,
+            int type,
+            const struct sockaddr * address,
+            socklen_t address_length);
+
+static int
+_connect
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data);
+
+static void
+_disconnect
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            int error);
+
+static uint16_t
+_prepare_chunk
+            (mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count);
+
+static int
+_send_datagrams
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            uint16_t messages_count);
+
+static int
+_send_stream
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            uint16_t messages_count);
+
+static int
+_unix_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options,
+            int type);
+
+static int
+_unix_dgram_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_unix_stream_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_udp_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_socket_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data);
+
+static int
+_socket_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet);
+
+static int
+_socket_driver_transmit_batch
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count);
+
+
+const mt_output_driver_t mt_output_unix_dgram_driver =
+{
+    .init = _unix_dgram_driver_init,
+    .destroy = _socket_driver_destroy,
+    .transmit = _socket_driver_transmit,
+    .transmit_batch = _socket_driver_transmit_batch
+};
+
+const mt_output_driver_t mt_output_unix_stream_driver =
+{
+    .init = _unix_stream_driver_init,
+    .destroy = _socket_driver_destroy,
+    .transmit = _socket_driver_transmit,
+    .transmit_batch = _socket_driver_transmit_batch
+};
+
+const mt_output_driver_t mt_output_udp_driver =
+{
+    .init = _udp_driver_init,
+    .destroy = _socket_driver_destroy,
+    .transmit = _socket_driver_transmit,
+    .transmit_batch = _socket_driver_transmit_batch
+};
+
+int
+mt_output_socket_get_stats
+            (const mt_output_t * output,
+            mt_output_socket_stats_t * stats)
+{
+    const mt_output_driver_t * driver;
+    mt_output_driver_data_t * driver_data;
+
+    assert(stats != 0);
+
+    driver = mt_output_get_driver(output);
+    if (driver != &mt_output_unix_dgram_driver
+                && driver != &mt_output_unix_stream_driver
+                && driver != &mt_output_udp_driver)
+        return -1;
+
+    driver_data = mt_output_get_driver_data(output);
+
+    stats->sent = driver_data->stats.sent;
+    stats->calls = driver_data->stats.calls;
+    stats->partial_writes = driver_data->stats.partial_writes;
+    stats->dropped = driver_data->stats.dropped;
+    stats->connections = driver_data->stats.connections;
+
+    return 0;
+}
+
+static int
+_unix_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options,
+            int type)
+{
+    struct sockaddr_un address;
+    const char * path;
+
+    if ((path = mt_options_get_string(options, "path", 0)) == 0) {
+        peach_log_debug(1, "Output '%s': no 'path' option given.\n",
+                    mt_output_get_id(output));
+
+        goto exit_with_failure;
+    }
+
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        peach_log_debug(1, "Output '%s': '%s' is too long.\n",
+                    mt_output_get_id(output), path);
+
+        goto exit_with_failure;
+    }
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+
+    return _init(output, driver_data, options, type,
+                (const struct sockaddr *)&address, sizeof(address));
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_unix_dgram_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    return _unix_driver_init(output, driver_data, options, SOCK_DGRAM);
+}
+
+static int
+_unix_stream_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    return _unix_driver_init(output, driver_data, options, SOCK_STREAM);
+}
+
+static int
+_udp_driver_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    struct addrinfo * addresses;
+    struct addrinfo hints;
+    const char * host;
+    const char * port;
+    int error;
+    int result;
+
+    host = mt_options_get_string(options, "host", "127.0.0.1");
+
+    if ((port = mt_options_get_string(options, "port", 0)) == 0) {
+        peach_log_debug(1, "Output '%s': no 'port' option given.\n",
+                    mt_output_get_id(output));
+
+        goto exit_with_failure;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_NUMERICSERV;
+
+    if ((error = getaddrinfo(host, port, &hints, &addresses)) != 0) {
+        peach_log_debug(1, "Output '%s': could not resolve '%s:%s': '%s'\n",
+                    mt_output_get_id(output), host, port,
+                    gai_strerror(error));
+
+        goto exit_with_failure;
+    }
+
+    result = _init(output, driver_data, options, SOCK_DGRAM,
+                addresses->ai_addr, addresses->ai_addrlen);
+
+    freeaddrinfo(addresses);
+
+    if (result == 0)
+        (*driver_data)->max_length = _MAX_UDP_DATAGRAM_LENGTH;
+
+    return result;
+
+exit_with_failure:
+    return -1;
+}
+
+static int
+_init
+            (const mt_output_t * output,
+            mt_output_driver_data_t ** driver_data,
+            const peach_hash_t * options,
+            int type,
+            const struct sockaddr * address,
+            socklen_t address_length)
+{
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    (*driver_data)->type = type;
+    memcpy(&(*driver_data)->address, address, address_length);
+    (*driver_data)->address_length = address_length;
+    (*driver_data)->fd = -1;
+
+    (*driver_data)->encode = strcmp(mt_options_get_string(options,
+                "encoding", "native"), "compact") == 0;
+    (*driver_data)->blocking = mt_options_get_integer(options, "blocking",
+                0) != 0;
+    (*driver_data)->send_buffer = mt_options_get_integer(options,
+                "send_buffer", 0);
+    (*driver_data)->busy_poll = mt_options_get_integer(options,
+                "busy_poll", 0);
+
+    /* The receiver may not be there yet */
+    _connect(output, *driver_data);
+
+    return 0;
+}
+
+static int
+_socket_driver_destroy
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data)
+{
+    if (driver_data->fd >= 0)
+        close(driver_data->fd);
+
+    peach_log_debug(2, "Output '%s': %llu packets sent by %llu calls, "
+                "%llu dropped.\n", mt_output_get_id(output),
+                (unsigned long long)driver_data->stats.sent,
+                (unsigned long long)driver_data->stats.calls,
+                (unsigned long long)driver_data->stats.dropped);
+
+    free(driver_data->encoded);
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_socket_driver_transmit
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet)
+{
+    return _socket_driver_transmit_batch(output, driver_data, &from,
+                &packet, 1);
+}
+
+static int
+_socket_driver_transmit_batch
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count)
+{
+    uint16_t chunk_length;
+    uint16_t messages_count;
+    int result;
+
+    for (result = 0; packets_count > 0; packets_count -= chunk_length,
+                from += chunk_length, packets += chunk_length) {
+        chunk_length = packets_count < _CHUNK_SIZE ? packets_count
+                    : _CHUNK_SIZE;
+
+        if (_connect(output, driver_data) != 0) {
+            driver_data->stats.dropped += chunk_length;
+            result = -1;
+
+            continue;
+        }
+
+        messages_count = _prepare_chunk(driver_data, from, packets,
+                    chunk_length);
+        if (messages_count < chunk_length)
+            result = -1;
+
+        if (messages_count == 0)
+            continue;
+
+        if ((driver_data->type == SOCK_DGRAM
+                    ? _send_datagrams(output, driver_data, messages_count)
+                    : _send_stream(output, driver_data, messages_count))
+                != 0)
+            result = -1;
+    }
+
+    return result;
+}
+
+static int
+_connect
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data)
+{
+    int value;
+    int fd;
+
+    if (driver_data->fd >= 0)
+        return 0;
+
+    if ((fd = socket(driver_data->address.ss_family,
+                    driver_data->type | SOCK_CLOEXEC, 0)) < 0)
+        goto exit_with_failure;
+
+    if (driver_data->send_buffer > 0) {
+        value = driver_data->send_buffer;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &value, sizeof(value));
+    }
+
+#ifdef SO_BUSY_POLL
+    if (driver_data->busy_poll > 0) {
+        value = driver_data->busy_poll;
+        if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &value,
+                    sizeof(value)) != 0 && driver_data->failing == 0)
+            peach_log_debug(2, "Output '%s': could not busy poll.\n",
+                        mt_output_get_id(output));
+    }
+#endif
+
+    if (connect(fd, (const struct sockaddr *)&driver_data->address,
+                driver_data->address_length) != 0)
+        goto clean_fd;
+
+    driver_data->fd = fd;
+    driver_data->failing = 0;
+    driver_data->stats.connections ++;
+
+    return 0;
+
+clean_fd:
+    close(fd);
+
+exit_with_failure:
+    /* Only the first of the attempts made while the receiver is away */
+    if (driver_data->failing == 0) {
+        char error_message_buffer [80];
+
+        peach_log_debug(2, "Output '%s': could not connect: '%s'\n",
+                    mt_output_get_id(output), strerror_r(errno,
+                    error_message_buffer, sizeof(error_message_buffer)));
+    }
+
+    driver_data->failing = 1;
+
+    return -1;
+}
+
+static void
+_disconnect
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            int error)
+{
+    char error_message_buffer [80];
+
+    peach_log_debug(2, "Output '%s': disconnected: '%s'\n",
+                mt_output_get_id(output), strerror_r(error,
+                error_message_buffer, sizeof(error_message_buffer)));
+
+    close(driver_data->fd);
+    driver_data->fd = -1;
+}
+
+/* Fill the messages of the chunk, return how many there are once the
+ * packets too large are dropped.
+ */
+static uint16_t
+_prepare_chunk
+            (mt_output_driver_data_t * driver_data,
+            const mt_sender_t * from,
+            const mt_packet_t * const * packets,
+            uint16_t packets_count)
+{
+    struct iovec * iov;
+    size_t encoded_length;
+    size_t length;
+    uint16_t packet_index;
+    uint16_t messages_count;
+    uint8_t type;
+
+    /* The buffer is sized first, as messages point into it */
+    if (driver_data->encode) {
+        for (encoded_length = 0, packet_index = 0;
+                    packet_index < packets_count; packet_index ++)
+            if (packets[packet_index]->type == PACKET_EVENT)
+                encoded_length += mt_packet_get_encoded_length(
+                            packets[packet_index]);
+
+        if (encoded_length > driver_data->encoded_size) {
+            driver_data->encoded = realloc(driver_data->encoded,
+                        encoded_length);
+            assert(driver_data->encoded != 0);
+
+            driver_data->encoded_size = encoded_length;
+        }
+    }
+
+    for (encoded_length = 0, messages_count = 0, packet_index = 0;
+                packet_index < packets_count; packet_index ++) {
+        iov = &driver_data->iov[messages_count * 2];
+
+        if (packets[packet_index]->type == PACKET_EVENT
+                    && driver_data->encode) {
+            type = MT_WIRE_MESSAGE_ENCODED_EVENT;
+            length = mt_packet_encode(packets[packet_index],
+                        driver_data->encoded + encoded_length,
+                        driver_data->encoded_size - encoded_length);
+
+            iov[1].iov_base = driver_data->encoded + encoded_length;
+            encoded_length += length;
+        }
+        else {
+            type = packets[packet_index]->type == PACKET_EVENT
+                        ? MT_WIRE_MESSAGE_EVENT : MT_WIRE_MESSAGE_RAW;
+            length = mt_packet_get_length(packets[packet_index]);
+
+            iov[1].iov_base = (void *)mt_packet_serialize(
+                        packets[packet_index]);
+        }
+
+        if ((driver_data->max_length > 0 && _HEADER_LENGTH + length
+                    > driver_data->max_length) || length > UINT32_MAX) {
+            driver_data->stats.dropped ++;
+
+            continue;
+        }
+
+        iov[1].iov_len = length;
+
+        mt_wire_write_u32(driver_data->headers[messages_count], length);
+        mt_wire_write_u16(driver_data->headers[messages_count] + 4,
+                    from[packet_index]);
+        driver_data->headers[messages_count][6] = type;
+        driver_data->headers[messages_count][7] = 0;
+
+        iov[0].iov_base = driver_data->headers[messages_count];
+        iov[0].iov_len = _HEADER_LENGTH;
+
+        memset(&driver_data->messages[messages_count], 0,
+                    sizeof(driver_data->messages[messages_count]));
+        driver_data->messages[messages_count].msg_hdr.msg_iov = iov;
+        driver_data->messages[messages_count].msg_hdr.msg_iovlen = 2;
+
+        messages_count ++;
+    }
+
+    return messages_count;
+}
+
+/* Datagrams are dropped rather than waiting for room, unless blocking */
+static int
+_send_datagrams
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            uint16_t messages_count)
+{
+    uint16_t sent_count;
+    int flags;
+    int result;
+
+    flags = MSG_NOSIGNAL | (driver_data->blocking ? 0 : MSG_DONTWAIT);
+
+    for (sent_count = 0; sent_count < messages_count; ) {
+        result = sendmmsg(driver_data->fd, driver_data->messages
+                    + sent_count, messages_count - sent_count, flags);
+        driver_data->stats.calls ++;
+
+        if (result < 0) {
+            if (errno == EINTR)
+                continue;
+
+            /* Only this datagram */
+            if (errno == EMSGSIZE) {
+                driver_data->stats.dropped ++;
+                sent_count ++;
+
+                continue;
+            }
+
+            /* Refused earlier UDP datagrams only tell that nothing
+             * listens for now, unlike a unix receiver which went away.
+             */
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS
+                        && (errno != ECONNREFUSED
+                            || driver_data->address.ss_family == AF_UNIX))
+                _disconnect(output, driver_data, errno);
+
+            driver_data->stats.dropped += messages_count - sent_count;
+
+            goto exit_with_failure;
+        }
+
+        if (result < messages_count - sent_count)
+            driver_data->stats.partial_writes ++;
+
+        driver_data->stats.sent += result;
+        sent_count += result;
+    }
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+/* Streams can't drop a packet partially written, they wait for room */
+static int
+_send_stream
+            (const mt_output_t * output,
+            mt_output_driver_data_t * driver_data,
+            uint16_t messages_count)
+{
+    struct msghdr message;
+    size_t remaining;
+    ssize_t written;
+    uint16_t iov_index;
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = driver_data->iov;
+    message.msg_iovlen = messages_count * 2;
+
+    for (remaining = 0, iov_index = 0; iov_index < message.msg_iovlen;
+                iov_index ++)
+        remaining += driver_data->iov[iov_index].iov_len;
+
+    while (message.msg_iovlen > 0) {
+        written = sendmsg(driver_data->fd, &message, MSG_NOSIGNAL);
+        driver_data->stats.calls ++;
+
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+
+            _disconnect(output, driver_data, errno);
+
+            /* The receiver gets the packets up to the one cut */
+            driver_data->stats.dropped += (message.msg_iovlen + 1) / 2;
+            driver_data->stats.sent += messages_count
+                        - (message.msg_iovlen + 1) / 2;
+
+            goto exit_with_failure;
+        }
+
+        if ((size_t)written < remaining)
+            driver_data->stats.partial_writes ++;
+
+        remaining -= written;
+
+        for ( ; message.msg_iovlen > 0
+                    && (size_t)written >= message.msg_iov->iov_len;
+                    message.msg_iov ++, message.msg_iovlen --)
+            written -= message.msg_iov->iov_len;
+
+        if (message.msg_iovlen > 0) {
+            message.msg_iov->iov_base = (uint8_t *)message.msg_iov->iov_base
+                        + written;
+            message.msg_iov->iov_len -= written;
+        }
+    }
+
+    driver_data->stats.sent += messages_count;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
@@ -12,6 +12,8 @@
 
 #include <multitouch.h>
 
+#include "wire.h"
+
 mt_packet_t *
 mt_packet_init_event
             (mt_event_t * event,
@@ -19,9 +21,10 @@ mt_packet_init_event
 {
     mt_packet_t * packet;
 
-    packet = calloc(1, sizeof(*packet));
-    assert(packet != 0);
+    packet = mt_pool_alloc(sizeof(*packet));
+    memset(packet, 0, sizeof(*packet));
 
+    packet->reference_count = 1;
     packet->type = PACKET_EVENT;
     packet->content.event.event = event;
     packet->content.event.destructor = destructor;
@@ -29,6 +32,24 @@ mt_packet_init_event
     return packet;
 }
 
+mt_packet_t *
+mt_packet_init_event_soa
+            (mt_event_soa_t * event,
+            void (*destructor)(mt_event_soa_t * event))
+{
+    mt_packet_t * packet;
+
+    packet = mt_pool_alloc(sizeof(*packet));
+    memset(packet, 0, sizeof(*packet));
+
+    packet->reference_count = 1;
+    packet->type = PACKET_EVENT_SOA;
+    packet->content.event_soa.event = event;
+    packet->content.event_soa.destructor = destructor;
+
+    return packet;
+}
+
 mt_packet_t *
 mt_packet_init_raw
             (void * data,
@@ -37,9 +58,10 @@ mt_packet_init_raw
 {
     mt_packet_t * packet;
 
-    packet = calloc(1, sizeof(*packet));
-    assert(packet != 0);
+    packet = mt_pool_alloc(sizeof(*packet));
+    memset(packet, 0, sizeof(*packet));
 
+    packet->reference_count = 1;
     packet->type = PACKET_RAW;
     packet->content.raw.data = data;
     packet->content.raw.length = length;
@@ -52,17 +74,53 @@ void
 mt_packet_destroy
             (mt_packet_t * packet)
 {
+    mt_packet_release(packet);
+}
+
+const mt_packet_t *
+mt_packet_acquire
+            (const mt_packet_t * packet)
+{
+    mt_packet_t * shared_packet;
+
+    assert(packet != 0);
+
+    /* Packets we do not own can't outlive their caller, share a copy */
+    if (packet->reference_count == 0)
+        return mt_packet_copy(packet);
+
+    shared_packet = (mt_packet_t *)packet;
+    __sync_fetch_and_add(&shared_packet->reference_count, 1);
+
+    return shared_packet;
+}
+
+void
+mt_packet_release
+            (const mt_packet_t * packet)
+{
+    mt_packet_t * shared_packet;
+
     assert(packet != 0);
+    assert(packet->reference_count > 0);
+
+    shared_packet = (mt_packet_t *)packet;
+    if (__sync_sub_and_fetch(&shared_packet->reference_count, 1) != 0)
+        return;
 
     if (packet->type == PACKET_RAW) {
         if (packet->content.raw.destructor != 0)
             (*packet->content.raw.destructor)(packet->content.raw.data);
+    } else if (packet->type == PACKET_EVENT_SOA) {
+        if (packet->content.event_soa.destructor != 0)
+            (*packet->content.event_soa.destructor)(
+                        packet->content.event_soa.event);
     } else {
         if (packet->content.event.destructor != 0)
             (*packet->content.event.destructor)(packet->content.event.event);
     }
 
-    free(packet);
+    mt_pool_free(shared_packet);
 }
 
 const void *
@@ -75,6 +133,8 @@ mt_packet_serialize
 
     if (packet->type == PACKET_EVENT)
         data = packet->content.event.event;
+    else if (packet->type == PACKET_EVENT_SOA)
+        data = 0;
     else
         data = packet->content.raw.data;
 
@@ -93,6 +153,8 @@ mt_packet_get_length
         length = sizeof(packet->content.event.event->info) 
                 + sizeof(*packet->content.event.event->touchset) 
                 * packet->content.event.event->info.touch_count;
+    else if (packet->type == PACKET_EVENT_SOA)
+        length = 0;
     else
         length = packet->content.raw.length;
 
@@ -107,25 +169,78 @@ mt_packet_copy
 
     assert(packet != 0);
 
-    packet_copy = malloc(sizeof(*packet_copy));
-    assert(packet_copy != 0);
+    packet_copy = mt_pool_alloc(sizeof(*packet_copy));
 
+    packet_copy->reference_count = 1;
     packet_copy->type = packet->type;
     if (packet->type == PACKET_EVENT) {
         packet_copy->content.event.event 
                 = mt_event_copy(packet->content.event.event);
         packet_copy->content.event.destructor = mt_event_destroy;
+    } else if (packet->type == PACKET_EVENT_SOA) {
+        packet_copy->content.event_soa.event 
+                = mt_event_soa_copy(packet->content.event_soa.event);
+        packet_copy->content.event_soa.destructor = mt_event_soa_destroy;
     } else { 
-        packet_copy->content.raw.data = malloc(packet->content.raw.length);
-        assert(packet_copy->content.raw.data != 0);
+        packet_copy->content.raw.data 
+                = mt_pool_alloc(packet->content.raw.length);
 
         packet_copy->content.raw.length = packet->content.raw.length;
 
         memcpy(packet_copy->content.raw.data, packet->content.raw.data,
                 packet->content.raw.length);
 
-        packet_copy->content.raw.destructor = free;
+        packet_copy->content.raw.destructor = mt_pool_free;
     }
 
     return packet_copy;
 }
+
+size_t
+mt_packet_get_encoded_length
+            (const mt_packet_t * packet)
+{
+    assert(packet != 0);
+
+    if (packet->type == PACKET_EVENT)
+        return mt_event_get_encoded_length(packet->content.event.event);
+
+    if (packet->type == PACKET_EVENT_SOA)
+        return MT_WIRE_HEADER_LENGTH + MT_WIRE_RECORD_LENGTH
+                    * packet->content.event_soa.event->info.touch_count;
+
+    return packet->content.raw.length;
+}
+
+size_t
+mt_packet_encode
+            (const mt_packet_t * packet,
+            void * buffer,
+            size_t size)
+{
+    mt_event_t * event;
+    size_t length;
+
+    assert(packet != 0);
+
+    if (packet->type == PACKET_EVENT)
+        return mt_event_encode(packet->content.event.event, buffer, size);
+
+    if (packet->type == PACKET_EVENT_SOA) {
+        event = mt_event_from_soa(packet->content.event_soa.event);
+        length = mt_event_encode(event, buffer, size);
+        mt_event_destroy(event);
+
+        return length;
+    }
+
+    if (packet->content.raw.length > size)
+        goto exit_with_failure;
+
+    memcpy(buffer, packet->content.raw.data, packet->content.raw.length);
+
+    return packet->content.raw.length;
+
+exit_with_failure:
+    return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ *  pool.c
+ *  irtouchd memory pool function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#define _EVENT_SIZE(touch_count) \
+            (sizeof(((mt_event_t *)0)->info) \
+            + sizeof(mt_event_touch_t) * (touch_count))
+
+typedef struct _block_t _block_t;
+
+typedef struct _pool_t _pool_t;
+
+struct _block_t
+{
+    _pool_t * pool;
+    _block_t * next;
+    uint32_t class_index;
+}
+__attribute__((aligned(16)));
+
+/* Each thread allocates from its own pool, blocks freed by an other thread
+ * are given back to their pool through a lock-free stack the owner drains 
+ * once its own free list is empty.
+ */
+struct _pool_t
+{
+    struct
+    {
+        _block_t * free_blocks;
+        _block_t * volatile remote_blocks;
+
+        uint64_t hits;
+        uint64_t misses;
+        volatile uint64_t remote_frees;
+    }
+    classes [MT_POOL_CLASSES_COUNT];
+
+    _pool_t * next;
+    _pool_t * next_orphan;
+};
+
+static const size_t _class_sizes [MT_POOL_CLASSES_COUNT] =
+{
+    sizeof(mt_packet_t),
+    _EVENT_SIZE(1),
+    _EVENT_SIZE(2),
+    _EVENT_SIZE(5),
+    _EVENT_SIZE(10),
+    _EVENT_SIZE(20),
+    _EVENT_SIZE(32)
+};
+
+static int
+_get_class_index
+            (size_t size);
+
+static _pool_t *
+_get_thread_pool(void);
+
+static void
+_create_thread_pool_key(void);
+
+static void
+_orphan_thread_pool
+            (void * pool);
+
+
+static __thread _pool_t * _thread_pool = 0;
+static pthread_key_t _thread_pool_key;
+static pthread_once_t _thread_pool_key_once = PTHREAD_ONCE_INIT;
+
+static pthread_mutex_t _pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static _pool_t * _pools = 0;
+static _pool_t * _orphan_pools = 0;
+static volatile uint64_t _oversized_allocations = 0;
+
+
+void *
+mt_pool_alloc
+            (size_t size)
+{
+    _pool_t * pool;
+    _block_t * block;
+    int class_index;
+
+    if ((class_index = _get_class_index(size)) < 0) {
+        block = malloc(sizeof(*block) + size);
+        assert(block != 0);
+
+        block->pool = 0;
+        __sync_fetch_and_add(&_oversized_allocations, 1);
+
+        return block + 1;
+    }
+
+    pool = _get_thread_pool();
+
+    if (pool->classes[class_index].free_blocks == 0 
+                && pool->classes[class_index].remote_blocks != 0)
+        pool->classes[class_index].free_blocks = __sync_lock_test_and_set(
+                    &pool->classes[class_index].remote_blocks, 0);
+
+    if ((block = pool->classes[class_index].free_blocks) != 0) {
+        pool->classes[class_index].free_blocks = block->next;
+        pool->classes[class_index].hits ++;
+    } else {
+        block = malloc(sizeof(*block) + _class_sizes[class_index]);
+        assert(block != 0);
+
+        block->pool = pool;
+        block->class_index = class_index;
+        pool->classes[class_index].misses ++;
+    }
+
+    return block + 1;
+}
+
+void
+mt_pool_free
+            (void * data)
+{
+    _block_t * block;
+    _pool_t * pool;
+
+    if (data == 0)
+        return;
+
+    block = (_block_t *)data - 1;
+    pool = block->pool;
+
+    if (pool == 0) {
+        free(block);
+
+        return;
+    }
+
+    if (pool == _thread_pool) {
+        block->next = pool->classes[block->class_index].free_blocks;
+        pool->classes[block->class_index].free_blocks = block;
+
+        return;
+    }
+
+    do 
+        block->next = pool->classes[block->class_index].remote_blocks;
+    while (__sync_bool_compare_and_swap(
+                &pool->classes[block->class_index].remote_blocks, 
+                block->next, block) == 0);
+
+    __sync_fetch_and_add(&pool->classes[block->class_index].remote_frees, 1);
+}
+
+void
+mt_pool_get_stats
+            (mt_pool_stats_t * stats)
+{
+    const _pool_t * pool;
+    int class_index;
+
+    assert(stats != 0);
+
+    memset(stats, 0, sizeof(*stats));
+
+    for (class_index = 0; class_index < MT_POOL_CLASSES_COUNT; 
+                class_index ++)
+        stats->classes[class_index].block_size = _class_sizes[class_index];
+
+    pthread_mutex_lock(&_pools_lock);
+
+    for (pool = _pools; pool != 0; pool = pool->next)
+        for (class_index = 0; class_index < MT_POOL_CLASSES_COUNT; 
+                    class_index ++) {
+            stats->classes[class_index].hits 
+                        += pool->classes[class_index].hits;
+            stats->classes[class_index].misses 
+                        += pool->classes[class_index].misses;
+            stats->classes[class_index].remote_frees 
+                        += pool->classes[class_index].remote_frees;
+        }
+
+    pthread_mutex_unlock(&_pools_lock);
+
+    stats->oversized_allocations = _oversized_allocations;
+}
+
+static int
+_get_class_index
+            (size_t size)
+{
+    int class_index;
+
+    for (class_index = 0; class_index < MT_POOL_CLASSES_COUNT; 
+                class_index ++)
+        if (size <= _class_sizes[class_index])
+            return class_index;
+
+    return -1;
+}
+
+static _pool_t *
+_get_thread_pool(void)
+{
+    _pool_t * pool;
+
+    if (_thread_pool != 0)
+        return _thread_pool;
+
+    pthread_once(&_thread_pool_key_once, _create_thread_pool_key);
+
+    /* Pools are never freed, blocks may still be in use by other threads.
+     * Instead, the pool of an exited thread is adopted by a new one.
+     */
+    pthread_mutex_lock(&_pools_lock);
+
+    if ((pool = _orphan_pools) != 0)
+        _orphan_pools = pool->next_orphan;
+    else {
+        pool = calloc(1, sizeof(*pool));
+        assert(pool != 0);
+
+        pool->next = _pools;
+        _pools = pool;
+    }
+
+    pthread_mutex_unlock(&_pools_lock);
+
+    peach_log_debug(2, "Pool: thread pool %p attached.\n", pool);
+
+    pthread_setspecific(_thread_pool_key, pool);
+    _thread_pool = pool;
+
+    return pool;
+}
+
+static void
+_create_thread_pool_key(void)
+{
+    pthread_key_create(&_thread_pool_key, _orphan_thread_pool);
+}
+
+static void
+_orphan_thread_pool
+            (void * pool)
+{
+    _pool_t * orphan;
+
+    orphan = pool;
+
+    pthread_mutex_lock(&_pools_lock);
+
+    orphan->next_orphan = _orphan_pools;
+    _orphan_pools = orphan;
+
+    pthread_mutex_unlock(&_pools_lock);
+
+    _thread_pool = 0;
+}
@@ -0,0 +1,369 @@
+/*
+ *  reactor.c
+ *  irtouchd reactor function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "reactor.h"
+
+#define _MAX_WATCHES 1024
+#define _MAX_EVENTS 64
+
+/* Epoll data of the eventfd signaling the shutdown */
+#define _SHUTDOWN_WATCH _MAX_WATCHES
+
+typedef struct
+{
+    int fd;
+    mt_reactor_callback_t on_readable;
+    void * data;
+
+    int used;
+    int watched;
+}
+_watch_t;
+
+typedef struct
+{
+    pthread_t thread;
+
+    int epoll_fd;
+    int shutdown_fd;
+
+    /* Held while dispatching events, so removed watches are never called.
+     * Epoll returns slots' indexes, not pointers which may be freed.
+     */
+    pthread_mutex_t lock;
+    uint16_t watches_count;
+    _watch_t watches [_MAX_WATCHES];
+}
+_reactor_thread_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+
+    _reactor_thread_t * threads;
+    uint16_t threads_count;
+}
+_reactor = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int
+_reactor_thread_init
+            (_reactor_thread_t * reactor_thread);
+
+static void
+_reactor_thread_destroy
+            (_reactor_thread_t * reactor_thread);
+
+static void *
+_reactor_thread
+            (void * argument);
+
+static void
+_unwatch
+            (_reactor_thread_t * reactor_thread,
+            _watch_t * watch);
+
+
+int
+mt_reactor_start
+            (uint16_t threads_count)
+{
+    uint16_t thread_index;
+
+    pthread_mutex_lock(&_reactor.lock);
+
+    if (_reactor.threads_count != 0)
+        goto exit_with_failure;
+
+    if (threads_count == 0)
+        threads_count = 1;
+
+    _reactor.threads = calloc(threads_count, sizeof(*_reactor.threads));
+    assert(_reactor.threads != 0);
+
+    for (thread_index = 0; thread_index < threads_count; thread_index ++)
+        if (_reactor_thread_init(&_reactor.threads[thread_index]) != 0)
+            goto clean;
+
+    _reactor.threads_count = threads_count;
+
+    peach_log_debug(1, "Reactor: %u threads started.\n", threads_count);
+
+    pthread_mutex_unlock(&_reactor.lock);
+
+    return 0;
+
+clean:
+    while (thread_index -- > 0)
+        _reactor_thread_destroy(&_reactor.threads[thread_index]);
+
+    free(_reactor.threads);
+    _reactor.threads = 0;
+
+exit_with_failure:
+    pthread_mutex_unlock(&_reactor.lock);
+
+    return -1;
+}
+
+void
+mt_reactor_stop(void)
+{
+    uint16_t thread_index;
+
+    pthread_mutex_lock(&_reactor.lock);
+
+    for (thread_index = 0; thread_index < _reactor.threads_count; 
+                thread_index ++)
+        _reactor_thread_destroy(&_reactor.threads[thread_index]);
+
+    free(_reactor.threads);
+    _reactor.threads = 0;
+    _reactor.threads_count = 0;
+
+    pthread_mutex_unlock(&_reactor.lock);
+}
+
+int
+mt_reactor_add
+            (int fd,
+            mt_reactor_callback_t on_readable,
+            void * data)
+{
+    _reactor_thread_t * reactor_thread;
+    struct epoll_event event;
+    uint16_t thread_index;
+    uint16_t watch_index;
+    int result;
+
+    assert(fd >= 0);
+    assert(on_readable != 0);
+
+    result = -1;
+
+    pthread_mutex_lock(&_reactor.lock);
+
+    assert(_reactor.threads_count != 0);
+
+    for (reactor_thread = &_reactor.threads[0], thread_index = 1; 
+                thread_index < _reactor.threads_count; thread_index ++)
+        if (_reactor.threads[thread_index].watches_count 
+                    < reactor_thread->watches_count)
+            reactor_thread = &_reactor.threads[thread_index];
+
+    pthread_mutex_lock(&reactor_thread->lock);
+
+    for (watch_index = 0; watch_index < _MAX_WATCHES; watch_index ++)
+        if (reactor_thread->watches[watch_index].used == 0)
+            break;
+
+    if (watch_index == _MAX_WATCHES) {
+        peach_log_debug(1, "Reactor: too many descriptors watched.\n");
+
+        goto exit;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = watch_index;
+
+    if (epoll_ctl(reactor_thread->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+        char error_message_buffer [80];
+
+        peach_log_debug(1, "Reactor: could not watch descriptor %d: '%s'\n",
+                    fd, strerror_r(errno, error_message_buffer, 
+                    sizeof(error_message_buffer)));
+
+        goto exit;
+    }
+
+    reactor_thread->watches[watch_index].fd = fd;
+    reactor_thread->watches[watch_index].on_readable = on_readable;
+    reactor_thread->watches[watch_index].data = data;
+    reactor_thread->watches[watch_index].used = 1;
+    reactor_thread->watches[watch_index].watched = 1;
+    reactor_thread->watches_count ++;
+
+    result = (reactor_thread - _reactor.threads) * _MAX_WATCHES + watch_index;
+
+exit:
+    pthread_mutex_unlock(&reactor_thread->lock);
+    pthread_mutex_unlock(&_reactor.lock);
+
+    return result;
+}
+
+void
+mt_reactor_remove
+            (int watch)
+{
+    _reactor_thread_t * reactor_thread;
+
+    assert(watch >= 0);
+
+    pthread_mutex_lock(&_reactor.lock);
+
+    assert(watch / _MAX_WATCHES < _reactor.threads_count);
+
+    reactor_thread = &_reactor.threads[watch / _MAX_WATCHES];
+
+    pthread_mutex_lock(&reactor_thread->lock);
+
+    _unwatch(reactor_thread, &reactor_thread->watches[watch % _MAX_WATCHES]);
+    reactor_thread->watches[watch % _MAX_WATCHES].used = 0;
+    reactor_thread->watches_count --;
+
+    pthread_mutex_unlock(&reactor_thread->lock);
+    pthread_mutex_unlock(&_reactor.lock);
+}
+
+static int
+_reactor_thread_init
+            (_reactor_thread_t * reactor_thread)
+{
+    struct epoll_event event;
+    char error_message_buffer [80];
+
+    if ((reactor_thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        goto exit_with_failure;
+
+    if ((reactor_thread->shutdown_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+        goto clean_epoll_fd;
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.u32 = _SHUTDOWN_WATCH;
+
+    if (epoll_ctl(reactor_thread->epoll_fd, EPOLL_CTL_ADD, 
+                reactor_thread->shutdown_fd, &event) != 0)
+        goto clean_shutdown_fd;
+
+    pthread_mutex_init(&reactor_thread->lock, 0);
+
+    if ((errno = pthread_create(&reactor_thread->thread, 0, _reactor_thread,
+                    reactor_thread)) != 0) {
+        pthread_mutex_destroy(&reactor_thread->lock);
+
+        goto clean_shutdown_fd;
+    }
+
+    return 0;
+
+clean_shutdown_fd:
+    close(reactor_thread->shutdown_fd);
+
+clean_epoll_fd:
+    close(reactor_thread->epoll_fd);
+
+exit_with_failure:
+    peach_log_debug(1, "Reactor: could not start thread: '%s'\n", 
+                strerror_r(errno, error_message_buffer, 
+                sizeof(error_message_buffer)));
+
+    return -1;
+}
+
+static void
+_reactor_thread_destroy
+            (_reactor_thread_t * reactor_thread)
+{
+    if (eventfd_write(reactor_thread->shutdown_fd, 1) != 0)
+        assert(0);
+
+    pthread_join(reactor_thread->thread, 0);
+
+    if (reactor_thread->watches_count != 0)
+        peach_log_debug(1, "Reactor: stopped with %u descriptors still "
+                    "watched.\n", reactor_thread->watches_count);
+
+    pthread_mutex_destroy(&reactor_thread->lock);
+    close(reactor_thread->shutdown_fd);
+    close(reactor_thread->epoll_fd);
+}
+
+static void *
+_reactor_thread
+            (void * argument)
+{
+    struct epoll_event events [_MAX_EVENTS];
+    _reactor_thread_t * reactor_thread;
+    sigset_t blocked_signal;
+    int must_stop;
+    int events_count;
+    int event_index;
+
+    reactor_thread = argument;
+
+    /* Signals are left to the application's threads */
+    sigfillset(&blocked_signal);
+    pthread_sigmask(SIG_BLOCK, &blocked_signal, 0);
+
+    for (must_stop = 0; must_stop == 0; ) {
+        if ((events_count = epoll_wait(reactor_thread->epoll_fd, events, 
+                        _MAX_EVENTS, -1)) < 0) {
+            char error_message_buffer [80];
+
+            if (errno == EINTR)
+                continue;
+
+            peach_log_debug(1, "Reactor: could not wait for events: '%s'\n",
+                        strerror_r(errno, error_message_buffer, 
+                        sizeof(error_message_buffer)));
+
+            break;
+        }
+
+        pthread_mutex_lock(&reactor_thread->lock);
+
+        for (event_index = 0; event_index < events_count; event_index ++) {
+            _watch_t * watch;
+
+            if (events[event_index].data.u32 == _SHUTDOWN_WATCH) {
+                must_stop = 1;
+                continue;
+            }
+
+            /* Removed after epoll_wait returned */
+            watch = &reactor_thread->watches[events[event_index].data.u32];
+            if (watch->watched == 0)
+                continue;
+
+            if ((*watch->on_readable)(watch->data) != 0)
+                _unwatch(reactor_thread, watch);
+        }
+
+        pthread_mutex_unlock(&reactor_thread->lock);
+    }
+
+    pthread_exit(0);
+}
+
+static void
+_unwatch
+            (_reactor_thread_t * reactor_thread,
+            _watch_t * watch)
+{
+    if (watch->watched == 0)
+        return;
+
+    epoll_ctl(reactor_thread->epoll_fd, EPOLL_CTL_DEL, watch->fd, 0);
+    watch->watched = 0;
+}
@@ -0,0 +1,40 @@
+/*
+ *  reactor.h
+ *  irtouchd reactor private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _REACTOR_H_
+#define _REACTOR_H_
+
+/**
+ * Called by a reactor thread when the watched descriptor is readable, 
+ * the descriptor is not watched anymore if -1 is returned.
+ */
+typedef int
+(*mt_reactor_callback_t)
+            (void * data);
+
+/**
+ * Watch 'fd' with the least loaded thread of the reactor, which must be 
+ * started. Return the watch or -1 on failure. 'fd' should not block, 
+ * 'on_readable' may be called while nothing is left to read.
+ */
+extern int
+mt_reactor_add
+            (int fd,
+            mt_reactor_callback_t on_readable,
+            void * data);
+
+/**
+ * Stop watching, once returned 'on_readable' is not running & will not 
+ * be called anymore. It must not be called from 'on_readable'.
+ */
+extern void
+mt_reactor_remove
+            (int watch);
+
+#endif
@@ -0,0 +1,228 @@
+/*
+ *  ring.c
+ *  irtouchd bounded ring function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "ring.h"
+
+#define _CACHE_LINE_SIZE 64
+
+typedef struct
+{
+    volatile uint32_t sequence;
+    unsigned char element [];
+}
+_slot_t;
+
+/* Producers & consumers positions live on their own cache lines */
+struct _ring_t
+{
+    uint32_t mask;
+    size_t element_size;
+    size_t slot_size;
+    unsigned char * slots;
+
+    volatile uint32_t enqueue_position
+                __attribute__((aligned(_CACHE_LINE_SIZE)));
+
+    volatile uint32_t dequeue_position
+                __attribute__((aligned(_CACHE_LINE_SIZE)));
+};
+
+static _slot_t *
+_get_slot
+            (const mt_ring_t * ring,
+            uint32_t position);
+
+
+mt_ring_t *
+mt_ring_init
+            (uint32_t capacity,
+            size_t element_size)
+{
+    mt_ring_t * ring;
+    uint32_t rounded_capacity;
+    uint32_t position;
+
+    assert(capacity > 0);
+    assert(capacity <= (UINT32_MAX >> 1) + 1);
+
+    for (rounded_capacity = 1; rounded_capacity < capacity; )
+        rounded_capacity <<= 1;
+
+    if (posix_memalign((void **)&ring, _CACHE_LINE_SIZE, sizeof(*ring)) != 0)
+        ring = 0;
+    assert(ring != 0);
+    memset(ring, 0, sizeof(*ring));
+
+    ring->mask = rounded_capacity - 1;
+    ring->element_size = element_size;
+    ring->slot_size = (sizeof(_slot_t) + element_size + sizeof(void *) - 1)
+                & ~(sizeof(void *) - 1);
+
+    if (posix_memalign((void **)&ring->slots, _CACHE_LINE_SIZE, 
+                ring->slot_size * rounded_capacity) != 0)
+        ring->slots = 0;
+    assert(ring->slots != 0);
+
+    for (position = 0; position < rounded_capacity; position ++)
+        _get_slot(ring, position)->sequence = position;
+
+    return ring;
+}
+
+void
+mt_ring_destroy
+            (mt_ring_t * ring)
+{
+    assert(ring != 0);
+
+    free(ring->slots);
+    free(ring);
+}
+
+int
+mt_ring_push
+            (mt_ring_t * ring,
+            const void * element)
+{
+    _slot_t * slot;
+    uint32_t position;
+
+    position = ring->enqueue_position;
+
+    for (;;) {
+        int32_t difference;
+
+        slot = _get_slot(ring, position);
+        difference = (int32_t)(slot->sequence - position);
+
+        if (difference == 0) {
+            uint32_t current_position;
+
+            current_position = __sync_val_compare_and_swap(
+                        &ring->enqueue_position, position, position + 1);
+
+            if (current_position == position)
+                break;
+
+            position = current_position;
+        }
+        else if (difference < 0)
+            goto exit_with_failure;
+        else
+            position = ring->enqueue_position;
+    }
+
+    memcpy(slot->element, element, ring->element_size);
+
+    __sync_synchronize();
+    slot->sequence = position + 1;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+int
+mt_ring_pop
+            (mt_ring_t * ring,
+            void * element)
+{
+    _slot_t * slot;
+    uint32_t position;
+
+    position = ring->dequeue_position;
+
+    for (;;) {
+        int32_t difference;
+
+        slot = _get_slot(ring, position);
+        difference = (int32_t)(slot->sequence - (position + 1));
+
+        if (difference == 0) {
+            uint32_t current_position;
+
+            current_position = __sync_val_compare_and_swap(
+                        &ring->dequeue_position, position, position + 1);
+
+            if (current_position == position)
+                break;
+
+            position = current_position;
+        }
+        else if (difference < 0)
+            goto exit_with_failure;
+        else
+            position = ring->dequeue_position;
+    }
+
+    memcpy(element, slot->element, ring->element_size);
+
+    __sync_synchronize();
+    slot->sequence = position + ring->mask + 1;
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+uint32_t
+mt_ring_get_length
+            (const mt_ring_t * ring)
+{
+    uint32_t dequeue_position;
+
+    /* Read the consumers position first, so the length never underflows */
+    dequeue_position = ring->dequeue_position;
+    __sync_synchronize();
+
+    return ring->enqueue_position - dequeue_position;
+}
+
+uint32_t
+mt_ring_get_capacity
+            (const mt_ring_t * ring)
+{
+    return ring->mask + 1;
+}
+
+int
+mt_futex_wait
+            (volatile int * address,
+            int value,
+            const struct timespec * timeout)
+{
+    return syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, timeout,
+                0, 0);
+}
+
+void
+mt_futex_wake
+            (volatile int * address,
+            int waiters_count)
+{
+    syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, waiters_count, 0, 0, 0);
+}
+
+static _slot_t *
+_get_slot
+            (const mt_ring_t * ring,
+            uint32_t position)
+{
+    return (_slot_t *)(ring->slots + ring->slot_size * (position & ring->mask));
+}
@@ -0,0 +1,71 @@
+/*
+ *  ring.h
+ *  irtouchd bounded ring private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _RING_H_
+#define _RING_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/**
+ * Bounded lock-free queue of fixed size elements, safe for 
+ * many producers & many consumers.
+ */
+typedef struct _ring_t mt_ring_t;
+
+extern mt_ring_t *
+mt_ring_init
+            (uint32_t capacity,
+            size_t element_size);
+
+extern void
+mt_ring_destroy
+            (mt_ring_t * ring);
+
+/**
+ * Copy 'element' into the ring, return -1 if the ring is full.
+ */
+extern int
+mt_ring_push
+            (mt_ring_t * ring,
+            const void * element);
+
+/**
+ * Copy the oldest element into 'element', return -1 if the ring is empty.
+ */
+extern int
+mt_ring_pop
+            (mt_ring_t * ring,
+            void * element);
+
+extern uint32_t
+mt_ring_get_length
+            (const mt_ring_t * ring);
+
+extern uint32_t
+mt_ring_get_capacity
+            (const mt_ring_t * ring);
+
+/**
+ * Sleep while '*address' equals 'value', or until 'timeout' expires
+ * if not null.
+ */
+extern int
+mt_futex_wait
+            (volatile int * address,
+            int value,
+            const struct timespec * timeout);
+
+extern void
+mt_futex_wake
+            (volatile int * address,
+            int waiters_count);
+
+#endif
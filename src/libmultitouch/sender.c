@@ -0,0 +1,100 @@
+/*
+ *  sender.c
+ *  irtouchd sender function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+/* Names are only appended, so readers can resolve a sender 
+ * without locking.
+ */
+static char * _names [MT_SENDER_MAX];
+static volatile uint32_t _names_count = 0;
+static pthread_mutex_t _names_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static mt_sender_t
+_lookup
+            (const char * name);
+
+
+mt_sender_t
+mt_sender_intern
+            (const char * name)
+{
+    mt_sender_t sender;
+
+    assert(name != 0);
+
+    pthread_mutex_lock(&_names_lock);
+
+    if ((sender = _lookup(name)) != MT_SENDER_INVALID)
+        goto exit;
+
+    if (_names_count == MT_SENDER_MAX) {
+        peach_log_debug(1, "Sender: could not intern '%s', table is full.\n",
+                    name);
+
+        goto exit;
+    }
+
+    sender = _names_count;
+    _names[sender] = strdup(name);
+
+    __sync_synchronize();
+    _names_count ++;
+
+    peach_log_debug(2, "Sender: '%s' interned as %u.\n", name, sender);
+
+exit:
+    pthread_mutex_unlock(&_names_lock);
+
+    return sender;
+}
+
+mt_sender_t
+mt_sender_lookup
+            (const char * name)
+{
+    mt_sender_t sender;
+
+    assert(name != 0);
+
+    pthread_mutex_lock(&_names_lock);
+    sender = _lookup(name);
+    pthread_mutex_unlock(&_names_lock);
+
+    return sender;
+}
+
+const char *
+mt_sender_get_name
+            (mt_sender_t sender)
+{
+    if (sender >= _names_count)
+        return "?";
+
+    return _names[sender];
+}
+
+static mt_sender_t
+_lookup
+            (const char * name)
+{
+    uint32_t sender;
+
+    for (sender = 0; sender < _names_count; sender ++)
+        if (strcmp(_names[sender], name) == 0)
+            return sender;
+
+    return MT_SENDER_INVALID;
+}
@@ -0,0 +1,500 @@
+/*
+ *  smoothing.c
+ *  irtouchd smoothing & prediction processing engine
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+
+#define _DEFAULT_MIN_CUTOFF 1.0
+#define _DEFAULT_BETA 10.0
+#define _DEFAULT_DERIVATE_CUTOFF 1.0
+
+/* Touches without a previous position are taken as is */
+#define _FIRST_DURATION 1e9
+
+/* Frames of a same timestamp */
+#define _MIN_DURATION 1e-6
+
+/* Raw & filtered positions & velocities of the touches of a frame, in the
+ * order of its touches.
+ */
+typedef struct
+{
+    uint32_t * ids;
+    double * raw_x;
+    double * raw_y;
+    double * x;
+    double * y;
+    double * velocity_x;
+    double * velocity_y;
+    double * timestamps;
+}
+_state_t;
+
+typedef struct
+{
+    _state_t previous;
+    _state_t next;
+
+    uint16_t touch_count;
+    uint16_t size;
+}
+_stream_t;
+
+struct _chain_layer_driver_data_t
+{
+    /* 1€ filter, cutoffs in Hz */
+    double min_cutoff;
+    double beta;
+    double derivate_cutoff;
+
+    /* Touches are moved where they should be this later, in seconds */
+    double horizon;
+
+    /* Previous state of the touches of the frame, gathered for the filter */
+    uint32_t size;
+    double * durations;
+    double * previous_raw_x;
+    double * previous_raw_y;
+    double * previous_x;
+    double * previous_y;
+    double * previous_velocity_x;
+    double * previous_velocity_y;
+
+    _stream_t * streams [MT_SENDER_MAX];
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data);
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static _stream_t *
+_get_stream
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from);
+
+static void
+_reserve
+            (mt_chain_layer_driver_data_t * driver_data,
+            _stream_t * stream,
+            uint16_t touch_count);
+
+static void
+_state_reserve
+            (_state_t * state,
+            uint16_t size);
+
+static void
+_state_destroy
+            (_state_t * state);
+
+static int32_t
+_find_state
+            (const _stream_t * stream,
+            uint32_t id,
+            uint16_t index);
+
+static void
+_gather
+            (mt_chain_layer_driver_data_t * driver_data,
+            const _stream_t * stream,
+            const mt_event_soa_t * event);
+
+static void
+_filter
+            (const mt_chain_layer_driver_data_t * driver_data,
+            uint32_t count,
+            const double * restrict raw,
+            const double * restrict durations,
+            const double * restrict previous_raw,
+            const double * restrict previous,
+            const double * restrict previous_velocity,
+            double * restrict filtered,
+            double * restrict velocity);
+
+static void
+_predict
+            (const mt_chain_layer_driver_data_t * driver_data,
+            const _stream_t * stream,
+            mt_event_soa_t * event);
+
+
+const mt_chain_layer_driver_t mt_chain_smoothing_driver =
+{
+    .init = _init,
+    .destroy = _destroy,
+    .process = _process,
+    .layout = MT_CHAIN_LAYOUT_EVENT_SOA
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    (*driver_data)->min_cutoff = mt_options_get_double(options,
+                "min_cutoff", _DEFAULT_MIN_CUTOFF);
+    if (!((*driver_data)->min_cutoff > 0))
+        (*driver_data)->min_cutoff = _DEFAULT_MIN_CUTOFF;
+
+    (*driver_data)->beta = mt_options_get_double(options, "beta",
+                _DEFAULT_BETA);
+    if ((*driver_data)->beta < 0)
+        (*driver_data)->beta = 0;
+
+    (*driver_data)->derivate_cutoff = mt_options_get_double(options,
+                "derivate_cutoff", _DEFAULT_DERIVATE_CUTOFF);
+    if (!((*driver_data)->derivate_cutoff > 0))
+        (*driver_data)->derivate_cutoff = _DEFAULT_DERIVATE_CUTOFF;
+
+    (*driver_data)->horizon = mt_options_get_double(options, "horizon", 0);
+
+    return 0;
+}
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data)
+{
+    uint32_t sender;
+
+    for (sender = 0; sender < MT_SENDER_MAX; sender ++)
+        if (driver_data->streams[sender] != 0) {
+            _state_destroy(&driver_data->streams[sender]->previous);
+            _state_destroy(&driver_data->streams[sender]->next);
+            free(driver_data->streams[sender]);
+        }
+
+    free(driver_data->durations);
+    free(driver_data->previous_raw_x);
+    free(driver_data->previous_raw_y);
+    free(driver_data->previous_x);
+    free(driver_data->previous_y);
+    free(driver_data->previous_velocity_x);
+    free(driver_data->previous_velocity_y);
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    mt_packet_t * smoothed_packet;
+    mt_event_soa_t * event;
+    _stream_t * stream;
+    _state_t state;
+    int result;
+
+    if (packet->type != PACKET_EVENT_SOA
+                || (stream = _get_stream(driver_data, from)) == 0)
+        return (*accept)(layer, from, packet);
+
+    event = mt_event_soa_copy(packet->content.event_soa.event);
+
+    _reserve(driver_data, stream, event->info.touch_count);
+
+    _gather(driver_data, stream, event);
+
+    _filter(driver_data, event->info.touch_count, event->x,
+                driver_data->durations, driver_data->previous_raw_x,
+                driver_data->previous_x,
+                driver_data->previous_velocity_x, stream->next.x,
+                stream->next.velocity_x);
+    _filter(driver_data, event->info.touch_count, event->y,
+                driver_data->durations, driver_data->previous_raw_y,
+                driver_data->previous_y,
+                driver_data->previous_velocity_y, stream->next.y,
+                stream->next.velocity_y);
+
+    _predict(driver_data, stream, event);
+
+    state = stream->previous;
+    stream->previous = stream->next;
+    stream->next = state;
+    stream->touch_count = event->info.touch_count;
+
+    smoothed_packet = mt_packet_init_event_soa(event, mt_event_soa_destroy);
+
+    result = (*accept)(layer, from, smoothed_packet);
+
+    mt_packet_destroy(smoothed_packet);
+
+    return result;
+}
+
+static _stream_t *
+_get_stream
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from)
+{
+    if (from >= MT_SENDER_MAX)
+        return 0;
+
+    if (driver_data->streams[from] == 0) {
+        driver_data->streams[from] = calloc(1,
+                    sizeof(*driver_data->streams[from]));
+        assert(driver_data->streams[from] != 0);
+    }
+
+    return driver_data->streams[from];
+}
+
+/* Arrays only grow, frames no larger than the previous ones allocate
+ * nothing but their copy.
+ */
+static void
+_reserve
+            (mt_chain_layer_driver_data_t * driver_data,
+            _stream_t * stream,
+            uint16_t touch_count)
+{
+    if (touch_count > stream->size) {
+        _state_reserve(&stream->previous, touch_count);
+        _state_reserve(&stream->next, touch_count);
+
+        stream->size = touch_count;
+    }
+
+    if (touch_count <= driver_data->size)
+        return;
+
+#define _GROW(array) \
+    do { \
+        driver_data->array = realloc(driver_data->array, \
+                    sizeof(*driver_data->array) * touch_count); \
+        assert(driver_data->array != 0); \
+    } while (0)
+
+    _GROW(durations);
+    _GROW(previous_raw_x);
+    _GROW(previous_raw_y);
+    _GROW(previous_x);
+    _GROW(previous_y);
+    _GROW(previous_velocity_x);
+    _GROW(previous_velocity_y);
+
+#undef _GROW
+
+    driver_data->size = touch_count;
+}
+
+static void
+_state_reserve
+            (_state_t * state,
+            uint16_t size)
+{
+    state->ids = realloc(state->ids, sizeof(*state->ids) * size);
+    state->raw_x = realloc(state->raw_x, sizeof(*state->raw_x) * size);
+    state->raw_y = realloc(state->raw_y, sizeof(*state->raw_y) * size);
+    state->x = realloc(state->x, sizeof(*state->x) * size);
+    state->y = realloc(state->y, sizeof(*state->y) * size);
+    state->velocity_x = realloc(state->velocity_x,
+                sizeof(*state->velocity_x) * size);
+    state->velocity_y = realloc(state->velocity_y,
+                sizeof(*state->velocity_y) * size);
+    state->timestamps = realloc(state->timestamps,
+                sizeof(*state->timestamps) * size);
+
+    assert(state->ids != 0 && state->raw_x != 0 && state->raw_y != 0
+                && state->x != 0 && state->y != 0
+                && state->velocity_x != 0 && state->velocity_y != 0
+                && state->timestamps != 0);
+}
+
+static void
+_state_destroy
+            (_state_t * state)
+{
+    free(state->ids);
+    free(state->raw_x);
+    free(state->raw_y);
+    free(state->x);
+    free(state->y);
+    free(state->velocity_x);
+    free(state->velocity_y);
+    free(state->timestamps);
+}
+
+/* Touches usually keep their index from a frame to the next one, those
+ * without an id are only matched by index.
+ */
+static int32_t
+_find_state
+            (const _stream_t * stream,
+            uint32_t id,
+            uint16_t index)
+{
+    uint16_t state_index;
+
+    if (index < stream->touch_count && stream->previous.ids[index] == id)
+        return index;
+
+    if (id == 0)
+        return -1;
+
+    for (state_index = 0; state_index < stream->touch_count;
+                state_index ++)
+        if (stream->previous.ids[state_index] == id)
+            return state_index;
+
+    return -1;
+}
+
+/* Copy the previous state of the touches into arrays in their order */
+static void
+_gather
+            (mt_chain_layer_driver_data_t * driver_data,
+            const _stream_t * stream,
+            const mt_event_soa_t * event)
+{
+    uint16_t touch_index;
+    int32_t state_index;
+    double timestamp;
+
+    memcpy(stream->next.raw_x, event->x,
+                sizeof(*event->x) * event->info.touch_count);
+    memcpy(stream->next.raw_y, event->y,
+                sizeof(*event->y) * event->info.touch_count);
+    memcpy(stream->next.ids, event->ids,
+                sizeof(*event->ids) * event->info.touch_count);
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        timestamp = event->timestamps[touch_index] > 0 
+                    ? event->timestamps[touch_index] : event->info.timestamp;
+        stream->next.timestamps[touch_index] = timestamp;
+
+        state_index = event->phases[touch_index] == INPUT_TOUCH_BEGAN ? -1
+                    : _find_state(stream, event->ids[touch_index],
+                        touch_index);
+
+        /* Starting from where the touch is, without moving */
+        if (state_index < 0) {
+            driver_data->durations[touch_index] = _FIRST_DURATION;
+            driver_data->previous_raw_x[touch_index] = event->x[touch_index];
+            driver_data->previous_raw_y[touch_index] = event->y[touch_index];
+            driver_data->previous_x[touch_index] = event->x[touch_index];
+            driver_data->previous_y[touch_index] = event->y[touch_index];
+            driver_data->previous_velocity_x[touch_index] = 0;
+            driver_data->previous_velocity_y[touch_index] = 0;
+
+            continue;
+        }
+
+        driver_data->durations[touch_index] = timestamp
+                    - stream->previous.timestamps[state_index];
+        if (driver_data->durations[touch_index] < _MIN_DURATION)
+            driver_data->durations[touch_index] = _MIN_DURATION;
+
+        driver_data->previous_raw_x[touch_index]
+                    = stream->previous.raw_x[state_index];
+        driver_data->previous_raw_y[touch_index]
+                    = stream->previous.raw_y[state_index];
+        driver_data->previous_x[touch_index]
+                    = stream->previous.x[state_index];
+        driver_data->previous_y[touch_index]
+                    = stream->previous.y[state_index];
+        driver_data->previous_velocity_x[touch_index]
+                    = stream->previous.velocity_x[state_index];
+        driver_data->previous_velocity_y[touch_index]
+                    = stream->previous.velocity_y[state_index];
+    }
+}
+
+/* 1€ filter of one coordinate of every touch. The loop has no branch, so
+ * the compiler can vectorize it.
+ */
+static void
+_filter
+            (const mt_chain_layer_driver_data_t * driver_data,
+            uint32_t count,
+            const double * restrict raw,
+            const double * restrict durations,
+            const double * restrict previous_raw,
+            const double * restrict previous,
+            const double * restrict previous_velocity,
+            double * restrict filtered,
+            double * restrict velocity)
+{
+    const double derivate_rate = 2 * M_PI * driver_data->derivate_cutoff;
+    const double min_rate = 2 * M_PI * driver_data->min_cutoff;
+    const double beta_rate = 2 * M_PI * driver_data->beta;
+    uint32_t index;
+
+    for (index = 0; index < count; index ++) {
+        double derivate_alpha;
+        double alpha;
+        double rate;
+
+        /* Smoothing factor of a cutoff: 1 / (1 + 1 / (2π cutoff duration)) */
+        derivate_alpha = derivate_rate * durations[index]
+                    / (derivate_rate * durations[index] + 1);
+
+        /* Derivated from the raw positions, which do not lag */
+        velocity[index] = previous_velocity[index] + derivate_alpha
+                    * ((raw[index] - previous_raw[index]) / durations[index]
+                        - previous_velocity[index]);
+
+        /* Faster touches are less smoothed, so they lag less */
+        rate = (min_rate + beta_rate * fabs(velocity[index]))
+                    * durations[index];
+        alpha = rate / (rate + 1);
+
+        filtered[index] = previous[index]
+                    + alpha * (raw[index] - previous[index]);
+    }
+}
+
+/* Move the touches where they should be at the horizon */
+static void
+_predict
+            (const mt_chain_layer_driver_data_t * driver_data,
+            const _stream_t * stream,
+            mt_event_soa_t * event)
+{
+    uint16_t touch_index;
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        event->x[touch_index] = stream->next.x[touch_index]
+                    + driver_data->horizon
+                    * stream->next.velocity_x[touch_index];
+        event->y[touch_index] = stream->next.y[touch_index]
+                    + driver_data->horizon
+                    * stream->next.velocity_y[touch_index];
+    }
+}
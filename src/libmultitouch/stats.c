@@ -0,0 +1,165 @@
+/*
+ *  stats.c
+ *  irtouchd latency statistics function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+
+#include <multitouch.h>
+
+#include "stats.h"
+
+#define _SUB_BUCKETS (1 << MT_HISTOGRAM_SUB_BUCKETS_BITS)
+
+#ifdef MT_WITH_STATS
+volatile int mt_stats_enabled = 0;
+#endif
+
+int
+mt_stats_enable
+            (int enable)
+{
+#ifdef MT_WITH_STATS
+    mt_stats_enabled = enable != 0;
+
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+mt_histogram_t *
+mt_histogram_init(void)
+{
+#ifdef MT_WITH_STATS
+    mt_histogram_t * histogram;
+
+    histogram = calloc(1, sizeof(*histogram));
+    assert(histogram != 0);
+
+    return histogram;
+#else
+    return 0;
+#endif
+}
+
+void
+mt_histogram_destroy
+            (mt_histogram_t * histogram)
+{
+    free(histogram);
+}
+
+int
+mt_histogram_copy
+            (mt_histogram_t * histogram,
+            const mt_histogram_t * source)
+{
+    assert(histogram != 0);
+
+    if (source == 0)
+        goto exit_with_failure;
+
+    memset(histogram, 0, sizeof(*histogram));
+    mt_histogram_merge(histogram, source);
+
+    return 0;
+
+exit_with_failure:
+    return -1;
+}
+
+/* Values below _SUB_BUCKETS have their own bucket, then each power of two 
+ * is split into _SUB_BUCKETS linear buckets.
+ */
+void
+mt_histogram_add
+            (mt_histogram_t * histogram,
+            uint64_t value)
+{
+    uint64_t max;
+    uint32_t index;
+    int msb;
+
+    if (value < _SUB_BUCKETS)
+        index = value;
+    else {
+        msb = 63 - __builtin_clzll(value);
+        index = (msb - MT_HISTOGRAM_SUB_BUCKETS_BITS + 1) * _SUB_BUCKETS
+                    + ((value >> (msb - MT_HISTOGRAM_SUB_BUCKETS_BITS))
+                    & (_SUB_BUCKETS - 1));
+    }
+
+    __sync_fetch_and_add(&histogram->counts[index], 1);
+
+    while ((max = histogram->max) < value
+                && ! __sync_bool_compare_and_swap(&histogram->max, max, value))
+        ;
+}
+
+void
+mt_histogram_merge
+            (mt_histogram_t * histogram,
+            const mt_histogram_t * other)
+{
+    uint32_t index;
+
+    for (index = 0; index < MT_HISTOGRAM_BUCKETS; index ++)
+        histogram->counts[index] += other->counts[index];
+
+    if (other->max > histogram->max)
+        histogram->max = other->max;
+}
+
+uint64_t
+mt_histogram_get_count
+            (const mt_histogram_t * histogram)
+{
+    uint64_t count;
+    uint32_t index;
+
+    for (count = 0, index = 0; index < MT_HISTOGRAM_BUCKETS; index ++)
+        count += histogram->counts[index];
+
+    return count;
+}
+
+/* Return the lower bound of the bucket holding the percentile */
+uint64_t
+mt_histogram_get_percentile
+            (const mt_histogram_t * histogram,
+            double percentile)
+{
+    uint64_t count;
+    uint64_t rank;
+    uint64_t seen;
+    uint32_t index;
+    int msb;
+
+    assert(percentile >= 0. && percentile <= 100.);
+
+    if ((count = mt_histogram_get_count(histogram)) == 0)
+        return 0;
+
+    rank = count * percentile / 100.;
+    if (rank >= count)
+        rank = count - 1;
+
+    for (seen = 0, index = 0; index < MT_HISTOGRAM_BUCKETS; index ++)
+        if ((seen += histogram->counts[index]) > rank)
+            break;
+
+    if (index < _SUB_BUCKETS)
+        return index;
+
+    msb = index / _SUB_BUCKETS + MT_HISTOGRAM_SUB_BUCKETS_BITS - 1;
+
+    return ((uint64_t)1 << msb) | ((uint64_t)(index % _SUB_BUCKETS) 
+                << (msb - MT_HISTOGRAM_SUB_BUCKETS_BITS));
+}
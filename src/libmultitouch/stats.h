@@ -0,0 +1,59 @@
+/*
+ *  stats.h
+ *  irtouchd latency statistics private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#include <multitouch.h>
+
+/* Stages record their latencies only when MT_STATS_ENABLED() is true,
+ * which is a constant when the library is built without MT_WITH_STATS.
+ */
+#ifdef MT_WITH_STATS
+extern volatile int mt_stats_enabled;
+# define MT_STATS_ENABLED() __builtin_expect(mt_stats_enabled, 0)
+#else
+# define MT_STATS_ENABLED() 0
+#endif
+
+/**
+ * Return a zeroed histogram, or 0 when the library is built without
+ * MT_WITH_STATS.
+ */
+extern mt_histogram_t *
+mt_histogram_init(void);
+
+extern void
+mt_histogram_destroy
+            (mt_histogram_t * histogram);
+
+/**
+ * Copy 'source' into 'histogram', return -1 when 'source' is null, e.g.
+ * when the library is built without MT_WITH_STATS.
+ */
+extern int
+mt_histogram_copy
+            (mt_histogram_t * histogram,
+            const mt_histogram_t * source);
+
+/* Monotonic time in nanoseconds */
+static inline uint64_t
+mt_stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,753 @@
+/*
+ *  tracking.c
+ *  irtouchd touch tracking processing engine
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <math.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "options.h"
+
+#define _DEFAULT_MAX_DISTANCE 0.05
+#define _MAX_GRID_SIZE 256
+
+/* Older frames do not tell where touches are going */
+#define _MAX_PREDICTION_DELAY 0.1
+
+typedef struct
+{
+    uint32_t id;
+
+    double x;
+    double y;
+    double velocity_x;
+    double velocity_y;
+}
+_touch_t;
+
+typedef struct
+{
+    uint32_t next_id;
+    double timestamp;
+
+    /* Touches of the previous frame, & the ones being built */
+    _touch_t * touches;
+    _touch_t * next_touches;
+    uint16_t touch_count;
+    uint16_t size;
+}
+_stream_t;
+
+typedef struct
+{
+    int32_t previous;
+    double cost;
+}
+_pair_t;
+
+struct _chain_layer_driver_data_t
+{
+    double max_distance;
+    int prediction;
+
+    /* Previous touches are looked up into a uniform grid over [0, 1]²,
+     * cells being at least 'max_distance' wide.
+     */
+    uint32_t grid_size;
+    double cell_size;
+    int32_t * cells;
+
+    /* Scratch, sized for the largest frames seen */
+    uint32_t capacity;
+    double * predicted;
+    int32_t * next_in_cell;
+    uint16_t * claims;
+    int32_t * columns;
+    int32_t * matches;
+    uint32_t * first_pairs;
+    uint16_t * pairs_counts;
+    int32_t * rows;
+
+    _pair_t * pairs;
+    size_t pairs_size;
+
+    /* Assignment of the ambiguous touches */
+    double * costs;
+    size_t costs_size;
+    double * row_potentials;
+    double * column_potentials;
+    double * minimums;
+    int32_t * assigned_rows;
+    int32_t * ways;
+    int32_t * column_touches;
+    char * used;
+
+    _stream_t * streams [MT_SENDER_MAX];
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options);
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data);
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept);
+
+static _stream_t *
+_get_stream
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from);
+
+static void
+_reserve
+            (mt_chain_layer_driver_data_t * driver_data,
+            _stream_t * stream,
+            uint32_t touch_count);
+
+static uint32_t
+_get_cell
+            (const mt_chain_layer_driver_data_t * driver_data,
+            double x,
+            double y,
+            int32_t shift_x,
+            int32_t shift_y);
+
+static void
+_match
+            (mt_chain_layer_driver_data_t * driver_data,
+            const _stream_t * stream,
+            const mt_event_t * event);
+
+static void
+_assign
+            (mt_chain_layer_driver_data_t * driver_data,
+            uint32_t rows_count);
+
+static void
+_solve
+            (mt_chain_layer_driver_data_t * driver_data,
+            uint32_t rows_count,
+            uint32_t columns_count);
+
+static void
+_update
+            (_stream_t * stream,
+            const int32_t * matches,
+            mt_event_t * event);
+
+
+const mt_chain_layer_driver_t mt_chain_tracking_driver =
+{
+    .init = _init,
+    .destroy = _destroy,
+    .process = _process
+};
+
+static int
+_init
+            (mt_chain_layer_driver_data_t ** driver_data,
+            const peach_hash_t * options)
+{
+    uint32_t cell_index;
+    double max_distance;
+
+    *driver_data = calloc(1, sizeof(**driver_data));
+    assert(*driver_data != 0);
+
+    max_distance = mt_options_get_double(options, "max_distance",
+                _DEFAULT_MAX_DISTANCE);
+    if (!(max_distance > 0))
+        max_distance = _DEFAULT_MAX_DISTANCE;
+
+    (*driver_data)->max_distance = max_distance;
+    (*driver_data)->prediction = mt_options_get_integer(options,
+                "prediction", 1) != 0;
+
+    (*driver_data)->grid_size = max_distance >= 1 ? 1
+                : (uint32_t)(1 / max_distance);
+    if ((*driver_data)->grid_size > _MAX_GRID_SIZE)
+        (*driver_data)->grid_size = _MAX_GRID_SIZE;
+
+    (*driver_data)->cell_size = 1. / (*driver_data)->grid_size;
+
+    (*driver_data)->cells = malloc(sizeof(*(*driver_data)->cells)
+                * (*driver_data)->grid_size * (*driver_data)->grid_size);
+    assert((*driver_data)->cells != 0);
+
+    for (cell_index = 0; cell_index < (*driver_data)->grid_size
+                * (*driver_data)->grid_size; cell_index ++)
+        (*driver_data)->cells[cell_index] = -1;
+
+    return 0;
+}
+
+static int
+_destroy
+            (mt_chain_layer_driver_data_t * driver_data)
+{
+    uint32_t sender;
+
+    for (sender = 0; sender < MT_SENDER_MAX; sender ++)
+        if (driver_data->streams[sender] != 0) {
+            free(driver_data->streams[sender]->touches);
+            free(driver_data->streams[sender]->next_touches);
+            free(driver_data->streams[sender]);
+        }
+
+    free(driver_data->cells);
+    free(driver_data->predicted);
+    free(driver_data->next_in_cell);
+    free(driver_data->claims);
+    free(driver_data->columns);
+    free(driver_data->matches);
+    free(driver_data->first_pairs);
+    free(driver_data->pairs_counts);
+    free(driver_data->rows);
+    free(driver_data->pairs);
+    free(driver_data->costs);
+    free(driver_data->row_potentials);
+    free(driver_data->column_potentials);
+    free(driver_data->minimums);
+    free(driver_data->assigned_rows);
+    free(driver_data->ways);
+    free(driver_data->column_touches);
+    free(driver_data->used);
+    free(driver_data);
+
+    return 0;
+}
+
+static int
+_process
+            (mt_chain_layer_t * layer,
+            mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from,
+            const mt_packet_t * packet,
+            mt_chain_driver_accept_t accept)
+{
+    mt_packet_t * tracked_packet;
+    mt_event_t * event;
+    _stream_t * stream;
+    int result;
+
+    if (packet->type != PACKET_EVENT
+                || (stream = _get_stream(driver_data, from)) == 0)
+        return (*accept)(layer, from, packet);
+
+    event = mt_event_copy(packet->content.event.event);
+
+    _reserve(driver_data, stream, event->info.touch_count);
+    _match(driver_data, stream, event);
+    _update(stream, driver_data->matches, event);
+
+    tracked_packet = mt_packet_init_event(event, mt_event_destroy);
+
+    result = (*accept)(layer, from, tracked_packet);
+
+    mt_packet_destroy(tracked_packet);
+
+    return result;
+}
+
+static _stream_t *
+_get_stream
+            (mt_chain_layer_driver_data_t * driver_data,
+            mt_sender_t from)
+{
+    if (from >= MT_SENDER_MAX)
+        return 0;
+
+    if (driver_data->streams[from] == 0) {
+        driver_data->streams[from] = calloc(1,
+                    sizeof(*driver_data->streams[from]));
+        assert(driver_data->streams[from] != 0);
+
+        driver_data->streams[from]->next_id = 1;
+    }
+
+    return driver_data->streams[from];
+}
+
+/* Scratch only grows, frames no larger than the previous ones allocate
+ * nothing but their copy.
+ */
+static void
+_reserve
+            (mt_chain_layer_driver_data_t * driver_data,
+            _stream_t * stream,
+            uint32_t touch_count)
+{
+    uint32_t capacity;
+
+    if (touch_count > stream->size) {
+        stream->touches = realloc(stream->touches,
+                    sizeof(*stream->touches) * touch_count);
+        stream->next_touches = realloc(stream->next_touches,
+                    sizeof(*stream->next_touches) * touch_count);
+        assert(stream->touches != 0 && stream->next_touches != 0);
+
+        stream->size = touch_count;
+    }
+
+    /* Previous & current touches, & as many dummy columns */
+    capacity = 2 * stream->size + 1;
+    if (capacity <= driver_data->capacity)
+        return;
+
+#define _GROW(array) \
+    do { \
+        driver_data->array = realloc(driver_data->array, \
+                    sizeof(*driver_data->array) * capacity); \
+        assert(driver_data->array != 0); \
+    } while (0)
+
+    _GROW(next_in_cell);
+    _GROW(claims);
+    _GROW(columns);
+    _GROW(matches);
+    _GROW(first_pairs);
+    _GROW(pairs_counts);
+    _GROW(rows);
+    _GROW(row_potentials);
+    _GROW(column_potentials);
+    _GROW(minimums);
+    _GROW(assigned_rows);
+    _GROW(ways);
+    _GROW(column_touches);
+    _GROW(used);
+
+#undef _GROW
+
+    /* Both coordinates of each previous touch */
+    driver_data->predicted = realloc(driver_data->predicted,
+                2 * sizeof(*driver_data->predicted) * capacity);
+    assert(driver_data->predicted != 0);
+
+    driver_data->capacity = capacity;
+}
+
+static uint32_t
+_get_cell
+            (const mt_chain_layer_driver_data_t * driver_data,
+            double x,
+            double y,
+            int32_t shift_x,
+            int32_t shift_y)
+{
+    int32_t cell_x;
+    int32_t cell_y;
+
+    /* Touches out of [0, 1]² are kept into the border cells */
+    cell_x = x > 0 ? (x < 1 ? (int32_t)(x / driver_data->cell_size)
+                : (int32_t)driver_data->grid_size - 1) : 0;
+    cell_y = y > 0 ? (y < 1 ? (int32_t)(y / driver_data->cell_size)
+                : (int32_t)driver_data->grid_size - 1) : 0;
+
+    cell_x += shift_x;
+    cell_y += shift_y;
+
+    if (cell_x < 0 || cell_y < 0 || cell_x >= (int32_t)driver_data->grid_size
+                || cell_y >= (int32_t)driver_data->grid_size)
+        return UINT32_MAX;
+
+    return cell_y * driver_data->grid_size + cell_x;
+}
+
+/* Find the previous touch of each touch of 'event' into 'matches', -1 for
+ * the touches which began.
+ */
+static void
+_match
+            (mt_chain_layer_driver_data_t * driver_data,
+            const _stream_t * stream,
+            const mt_event_t * event)
+{
+    const mt_event_touch_t * touch;
+    uint32_t touch_index;
+    uint32_t previous_index;
+    uint32_t rows_count;
+    uint32_t cell;
+    double max_cost;
+    double delay;
+    int32_t shift_x;
+    int32_t shift_y;
+    int32_t candidate;
+
+    delay = event->info.timestamp - stream->timestamp;
+    if (driver_data->prediction == 0 || !(delay > 0)
+                || delay > _MAX_PREDICTION_DELAY)
+        delay = 0;
+
+    /* Previous touches where they should be by now */
+    for (previous_index = 0; previous_index < stream->touch_count;
+                previous_index ++) {
+        const _touch_t * previous;
+        double * predicted;
+
+        previous = &stream->touches[previous_index];
+        predicted = &driver_data->predicted[2 * previous_index];
+
+        predicted[0] = previous->x + previous->velocity_x * delay;
+        predicted[1] = previous->y + previous->velocity_y * delay;
+
+        cell = _get_cell(driver_data, predicted[0], predicted[1], 0, 0);
+        driver_data->next_in_cell[previous_index] = driver_data->cells[cell];
+        driver_data->cells[cell] = previous_index;
+
+        driver_data->claims[previous_index] = 0;
+        driver_data->columns[previous_index] = -1;
+    }
+
+    max_cost = driver_data->max_distance * driver_data->max_distance;
+
+    /* Candidates are the previous touches close enough, into the 3x3
+     * cells around each touch.
+     */
+    for (driver_data->first_pairs[0] = 0, touch_index = 0;
+                touch_index < event->info.touch_count; touch_index ++) {
+        touch = &event->touchset[touch_index];
+
+        driver_data->matches[touch_index] = -1;
+        driver_data->pairs_counts[touch_index] = 0;
+
+        if (touch_index > 0)
+            driver_data->first_pairs[touch_index]
+                        = driver_data->first_pairs[touch_index - 1]
+                        + driver_data->pairs_counts[touch_index - 1];
+
+        for (shift_y = -1; shift_y <= 1; shift_y ++)
+            for (shift_x = -1; shift_x <= 1; shift_x ++) {
+                cell = _get_cell(driver_data, touch->where.origin.x,
+                            touch->where.origin.y, shift_x, shift_y);
+                if (cell == UINT32_MAX)
+                    continue;
+
+                for (candidate = driver_data->cells[cell]; candidate >= 0;
+                            candidate = driver_data->next_in_cell[candidate]) {
+                    _pair_t * pair;
+                    size_t pair_index;
+                    double distance_x;
+                    double distance_y;
+                    double cost;
+
+                    distance_x = touch->where.origin.x
+                                - driver_data->predicted[2 * candidate];
+                    distance_y = touch->where.origin.y
+                                - driver_data->predicted[2 * candidate + 1];
+                    cost = distance_x * distance_x + distance_y * distance_y;
+
+                    if (cost > max_cost)
+                        continue;
+
+                    pair_index = driver_data->first_pairs[touch_index]
+                                + driver_data->pairs_counts[touch_index];
+
+                    if (pair_index >= driver_data->pairs_size) {
+                        driver_data->pairs_size = 2 * pair_index + 16;
+                        driver_data->pairs = realloc(driver_data->pairs,
+                                    sizeof(*driver_data->pairs)
+                                    * driver_data->pairs_size);
+                        assert(driver_data->pairs != 0);
+                    }
+
+                    pair = &driver_data->pairs[pair_index];
+                    pair->previous = candidate;
+                    pair->cost = cost;
+
+                    driver_data->pairs_counts[touch_index] ++;
+                    driver_data->claims[candidate] ++;
+                }
+            }
+    }
+
+    /* Only the cells which were used are cleared */
+    for (previous_index = 0; previous_index < stream->touch_count;
+                previous_index ++)
+        driver_data->cells[_get_cell(driver_data,
+                    driver_data->predicted[2 * previous_index],
+                    driver_data->predicted[2 * previous_index + 1], 0, 0)]
+                    = -1;
+
+    /* Most touches have a single candidate, which has no other claimant */
+    for (rows_count = 0, touch_index = 0;
+                touch_index < event->info.touch_count; touch_index ++) {
+        if (driver_data->pairs_counts[touch_index] == 0)
+            continue;
+
+        candidate = driver_data->pairs[driver_data->first_pairs[
+                    touch_index]].previous;
+
+        if (driver_data->pairs_counts[touch_index] == 1
+                    && driver_data->claims[candidate] == 1)
+            driver_data->matches[touch_index] = candidate;
+        else
+            driver_data->rows[rows_count ++] = touch_index;
+    }
+
+    if (rows_count > 0)
+        _assign(driver_data, rows_count);
+}
+
+/* Match the ambiguous touches to their candidates minimizing the sum of
+ * the squared distances. Each touch may also begin, which costs as much
+ * as the farthest match.
+ */
+static void
+_assign
+            (mt_chain_layer_driver_data_t * driver_data,
+            uint32_t rows_count)
+{
+    const _pair_t * pair;
+    uint32_t candidates_count;
+    uint32_t columns_count;
+    uint32_t row_index;
+    uint32_t column_index;
+    uint32_t pair_index;
+    int32_t touch_index;
+    double max_cost;
+    double forbidden_cost;
+    double * costs;
+
+    /* Candidates of the ambiguous touches are their only other claimants */
+    for (candidates_count = 0, row_index = 0; row_index < rows_count;
+                row_index ++) {
+        touch_index = driver_data->rows[row_index];
+
+        for (pair_index = 0; pair_index < driver_data->pairs_counts[
+                    touch_index]; pair_index ++) {
+            pair = &driver_data->pairs[driver_data->first_pairs[touch_index]
+                        + pair_index];
+
+            if (driver_data->columns[pair->previous] < 0) {
+                driver_data->columns[pair->previous] = candidates_count;
+                driver_data->column_touches[candidates_count ++]
+                            = pair->previous;
+            }
+        }
+    }
+
+    columns_count = candidates_count + rows_count;
+
+    if ((size_t)rows_count * columns_count > driver_data->costs_size) {
+        driver_data->costs_size = (size_t)rows_count * columns_count;
+        driver_data->costs = realloc(driver_data->costs,
+                    sizeof(*driver_data->costs) * driver_data->costs_size);
+        assert(driver_data->costs != 0);
+    }
+
+    max_cost = driver_data->max_distance * driver_data->max_distance;
+
+    /* Higher than beginning every touch */
+    forbidden_cost = 1 + 2 * rows_count * max_cost;
+
+    for (row_index = 0; row_index < rows_count; row_index ++) {
+        costs = driver_data->costs + (size_t)row_index * columns_count;
+        touch_index = driver_data->rows[row_index];
+
+        for (column_index = 0; column_index < columns_count; column_index ++)
+            costs[column_index] = forbidden_cost;
+
+        for (pair_index = 0; pair_index < driver_data->pairs_counts[
+                    touch_index]; pair_index ++) {
+            pair = &driver_data->pairs[driver_data->first_pairs[touch_index]
+                        + pair_index];
+
+            costs[driver_data->columns[pair->previous]] = pair->cost;
+        }
+
+        costs[candidates_count + row_index] = max_cost;
+    }
+
+    _solve(driver_data, rows_count, columns_count);
+
+    for (column_index = 0; column_index < candidates_count; column_index ++) {
+        if (driver_data->assigned_rows[column_index + 1] != 0) {
+            row_index = driver_data->assigned_rows[column_index + 1] - 1;
+
+            if (driver_data->costs[(size_t)row_index * columns_count
+                        + column_index] < forbidden_cost)
+                driver_data->matches[driver_data->rows[row_index]]
+                            = driver_data->column_touches[column_index];
+        }
+
+        driver_data->columns[driver_data->column_touches[column_index]] = -1;
+    }
+}
+
+/* Hungarian algorithm with potentials, O(rows² columns). Columns are
+ * numbered from 1 into 'assigned_rows', which tells the row assigned to
+ * each of them plus one, or 0.
+ */
+static void
+_solve
+            (mt_chain_layer_driver_data_t * driver_data,
+            uint32_t rows_count,
+            uint32_t columns_count)
+{
+    double * row_potentials;
+    double * column_potentials;
+    double * minimums;
+    int32_t * assigned_rows;
+    int32_t * ways;
+    char * used;
+    uint32_t row_index;
+    uint32_t column_index;
+    uint32_t current_column;
+    uint32_t next_column;
+    uint32_t current_row;
+    double cost;
+    double delta;
+
+    row_potentials = driver_data->row_potentials;
+    column_potentials = driver_data->column_potentials;
+    minimums = driver_data->minimums;
+    assigned_rows = driver_data->assigned_rows;
+    ways = driver_data->ways;
+    used = driver_data->used;
+
+    memset(row_potentials, 0, sizeof(*row_potentials) * (rows_count + 1));
+    memset(column_potentials, 0,
+                sizeof(*column_potentials) * (columns_count + 1));
+    memset(assigned_rows, 0, sizeof(*assigned_rows) * (columns_count + 1));
+
+    for (row_index = 1; row_index <= rows_count; row_index ++) {
+        assigned_rows[0] = row_index;
+        current_column = 0;
+
+        for (column_index = 0; column_index <= columns_count;
+                    column_index ++) {
+            minimums[column_index] = HUGE_VAL;
+            used[column_index] = 0;
+        }
+
+        do {
+            used[current_column] = 1;
+            current_row = assigned_rows[current_column];
+            delta = HUGE_VAL;
+            next_column = 0;
+
+            for (column_index = 1; column_index <= columns_count;
+                        column_index ++) {
+                if (used[column_index])
+                    continue;
+
+                cost = driver_data->costs[(size_t)(current_row - 1)
+                            * columns_count + column_index - 1]
+                            - row_potentials[current_row]
+                            - column_potentials[column_index];
+
+                if (cost < minimums[column_index]) {
+                    minimums[column_index] = cost;
+                    ways[column_index] = current_column;
+                }
+
+                if (minimums[column_index] < delta) {
+                    delta = minimums[column_index];
+                    next_column = column_index;
+                }
+            }
+
+            for (column_index = 0; column_index <= columns_count;
+                        column_index ++)
+                if (used[column_index]) {
+                    row_potentials[assigned_rows[column_index]] += delta;
+                    column_potentials[column_index] -= delta;
+                }
+                else
+                    minimums[column_index] -= delta;
+
+            current_column = next_column;
+        }
+        while (assigned_rows[current_column] != 0);
+
+        do {
+            next_column = ways[current_column];
+            assigned_rows[current_column] = assigned_rows[next_column];
+            current_column = next_column;
+        }
+        while (current_column != 0);
+    }
+}
+
+/* Give the touches their ids & phases, they become the previous ones */
+static void
+_update
+            (_stream_t * stream,
+            const int32_t * matches,
+            mt_event_t * event)
+{
+    mt_event_touch_t * touch;
+    const _touch_t * previous;
+    _touch_t * next_touch;
+    _touch_t * touches;
+    uint16_t touch_index;
+    double delay;
+
+    delay = event->info.timestamp - stream->timestamp;
+
+    for (touch_index = 0; touch_index < event->info.touch_count;
+                touch_index ++) {
+        touch = &event->touchset[touch_index];
+        next_touch = &stream->next_touches[touch_index];
+
+        next_touch->x = touch->where.origin.x;
+        next_touch->y = touch->where.origin.y;
+
+        if (matches[touch_index] < 0) {
+            touch->id = stream->next_id ++;
+            touch->phase = INPUT_TOUCH_BEGAN;
+
+            if (stream->next_id == 0)
+                stream->next_id = 1;
+
+            next_touch->velocity_x = 0;
+            next_touch->velocity_y = 0;
+        }
+        else {
+            previous = &stream->touches[matches[touch_index]];
+
+            touch->id = previous->id;
+            touch->phase = next_touch->x == previous->x
+                        && next_touch->y == previous->y
+                        ? INPUT_TOUCH_STATIONARY : INPUT_TOUCH_MOVED;
+
+            if (delay > 0) {
+                next_touch->velocity_x = (next_touch->x - previous->x)
+                            / delay;
+                next_touch->velocity_y = (next_touch->y - previous->y)
+                            / delay;
+            }
+            else {
+                next_touch->velocity_x = previous->velocity_x;
+                next_touch->velocity_y = previous->velocity_y;
+            }
+        }
+
+        next_touch->id = touch->id;
+    }
+
+    touches = stream->touches;
+    stream->touches = stream->next_touches;
+    stream->next_touches = touches;
+
+    stream->touch_count = event->info.touch_count;
+    stream->timestamp = event->info.timestamp;
+}
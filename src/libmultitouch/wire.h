@@ -0,0 +1,182 @@
+/*
+ *  wire.h
+ *  irtouchd compact encoding private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stdint.h>
+#include <math.h>
+
+/* Compact event layout, all integers are little endian:
+ *
+ *  header
+ *      0   magic 'M' 'T'
+ *      2   version
+ *      3   reserved
+ *      4   flags, u32
+ *      8   frame timestamp in microseconds, u64
+ *      16  touch count, u16
+ *      18  record length, u8
+ *      19  reserved
+ *
+ *  touch record, repeated 'touch count' times
+ *      0   x, y, width & height, u16 fixed-point normalized values
+ *      8   touch timestamp - frame timestamp in 1/10 ms, s16
+ *      10  phase (2 low bits) | tap count (6 high bits)
+ *      11  reserved
+ *      12  id, u32 (since version 2)
+ */
+#define MT_WIRE_VERSION 2
+
+#define MT_WIRE_HEADER_LENGTH 20
+#define MT_WIRE_RECORD_LENGTH 16
+
+/* Records of version 1, without ids */
+#define MT_WIRE_RECORD_MIN_LENGTH 12
+
+#define MT_WIRE_HEADER_MAGIC 0
+#define MT_WIRE_HEADER_VERSION 2
+#define MT_WIRE_HEADER_FLAGS 4
+#define MT_WIRE_HEADER_TIMESTAMP 8
+#define MT_WIRE_HEADER_TOUCH_COUNT 16
+#define MT_WIRE_HEADER_RECORD_LENGTH 18
+
+#define MT_WIRE_RECORD_X 0
+#define MT_WIRE_RECORD_Y 2
+#define MT_WIRE_RECORD_WIDTH 4
+#define MT_WIRE_RECORD_HEIGHT 6
+#define MT_WIRE_RECORD_TIMESTAMP 8
+#define MT_WIRE_RECORD_STATE 10
+#define MT_WIRE_RECORD_ID 12
+
+#define MT_WIRE_TAP_COUNT_MAX 63
+#define MT_WIRE_TIMESTAMP_DELTA_UNIT 1e-4
+
+/* Type of the messages of the shared memory & socket output drivers,
+ * published to readers as MT_SHM_MESSAGE_*.
+ */
+enum
+{
+    /* A mt_event_t */
+    MT_WIRE_MESSAGE_EVENT,
+
+    /* An event encoded by mt_event_encode */
+    MT_WIRE_MESSAGE_ENCODED_EVENT,
+
+    MT_WIRE_MESSAGE_RAW
+};
+
+static inline void
+mt_wire_write_u16
+            (uint8_t * data,
+            uint16_t value)
+{
+    data[0] = value;
+    data[1] = value >> 8;
+}
+
+static inline uint16_t
+mt_wire_read_u16
+            (const uint8_t * data)
+{
+    return data[0] | (uint16_t)data[1] << 8;
+}
+
+static inline void
+mt_wire_write_u32
+            (uint8_t * data,
+            uint32_t value)
+{
+    mt_wire_write_u16(data, value);
+    mt_wire_write_u16(data + 2, value >> 16);
+}
+
+static inline uint32_t
+mt_wire_read_u32
+            (const uint8_t * data)
+{
+    return mt_wire_read_u16(data) | (uint32_t)mt_wire_read_u16(data + 2) << 16;
+}
+
+static inline void
+mt_wire_write_u64
+            (uint8_t * data,
+            uint64_t value)
+{
+    mt_wire_write_u32(data, value);
+    mt_wire_write_u32(data + 4, value >> 32);
+}
+
+static inline uint64_t
+mt_wire_read_u64
+            (const uint8_t * data)
+{
+    return mt_wire_read_u32(data) | (uint64_t)mt_wire_read_u32(data + 4) << 32;
+}
+
+/* Normalized values [0, 1] are stored on 16 bits */
+static inline uint16_t
+mt_wire_quantize
+            (double value)
+{
+    if (!(value > 0.0))
+        return 0;
+
+    if (value >= 1.0)
+        return UINT16_MAX;
+
+    return (uint16_t)(value * UINT16_MAX + 0.5);
+}
+
+static inline double
+mt_wire_dequantize
+            (uint16_t value)
+{
+    return value * (1.0 / UINT16_MAX);
+}
+
+static inline uint64_t
+mt_wire_encode_timestamp
+            (double timestamp)
+{
+    if (!(timestamp > 0.0))
+        return 0;
+
+    return (uint64_t)llround(timestamp * 1e6);
+}
+
+static inline int16_t
+mt_wire_encode_timestamp_delta
+            (double delta)
+{
+    double units;
+
+    units = delta / MT_WIRE_TIMESTAMP_DELTA_UNIT;
+
+    if (units <= INT16_MIN)
+        return INT16_MIN;
+
+    if (units >= INT16_MAX)
+        return INT16_MAX;
+
+    return (int16_t)lround(units);
+}
+
+static inline uint8_t
+mt_wire_encode_state
+            (uint32_t phase,
+            uint32_t tap_count)
+{
+    if (tap_count > MT_WIRE_TAP_COUNT_MAX)
+        tap_count = MT_WIRE_TAP_COUNT_MAX;
+
+    return (phase & 0x3) | tap_count << 2;
+}
+
+#endif
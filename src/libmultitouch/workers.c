@@ -0,0 +1,244 @@
+/*
+ *  workers.c
+ *  irtouchd workers pool function 
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sched.h>
+#include <peach.h>
+
+#include <multitouch.h>
+
+#include "ring.h"
+#include "workers.h"
+
+#define _TASKS_CAPACITY 1024
+
+typedef struct
+{
+    uint16_t index;
+    pthread_t thread;
+    mt_ring_t * tasks;
+}
+_worker_t;
+
+static struct
+{
+    pthread_mutex_t lock;
+
+    _worker_t * workers;
+    uint16_t workers_count;
+
+    volatile int must_stop;
+
+    /* Futex word idle workers sleep on, bumped by submitters when some 
+     * are idle.
+     */
+    volatile int work_sequence;
+    volatile uint32_t idle_workers;
+}
+_pool = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/* Worker running on the current thread, if any */
+static __thread _worker_t * _current_worker = 0;
+
+static void *
+_worker_thread
+            (void * argument);
+
+static mt_workers_task_t *
+_get_task
+            (_worker_t * worker);
+
+
+int
+mt_workers_start
+            (uint16_t workers_count)
+{
+    uint16_t worker_index;
+
+    pthread_mutex_lock(&_pool.lock);
+
+    if (_pool.workers_count != 0)
+        goto exit_with_failure;
+
+    if (workers_count == 0) {
+        long processors_count;
+
+        processors_count = sysconf(_SC_NPROCESSORS_ONLN);
+        workers_count = processors_count > 0 ? processors_count : 1;
+    }
+
+    _pool.workers = calloc(workers_count, sizeof(*_pool.workers));
+    assert(_pool.workers != 0);
+
+    _pool.must_stop = 0;
+
+    for (worker_index = 0; worker_index < workers_count; worker_index ++) {
+        _pool.workers[worker_index].index = worker_index;
+        _pool.workers[worker_index].tasks = mt_ring_init(_TASKS_CAPACITY,
+                    sizeof(mt_workers_task_t *));
+    }
+
+    /* Workers may steal from any queue as soon as they start */
+    _pool.workers_count = workers_count;
+
+    for (worker_index = 0; worker_index < workers_count; worker_index ++)
+        if (pthread_create(&_pool.workers[worker_index].thread, 0, 
+                    _worker_thread, &_pool.workers[worker_index]) != 0) {
+            char error_message_buffer [80];
+
+            peach_log_debug(1, "Workers: could not create worker thread: "
+                        "'%s'\n", strerror_r(errno, error_message_buffer, 
+                        sizeof(error_message_buffer)));
+
+            assert(0);
+        }
+
+    peach_log_debug(1, "Workers: %u workers started.\n", workers_count);
+
+    pthread_mutex_unlock(&_pool.lock);
+
+    return 0;
+
+exit_with_failure:
+    pthread_mutex_unlock(&_pool.lock);
+
+    return -1;
+}
+
+void
+mt_workers_stop(void)
+{
+    uint16_t worker_index;
+
+    pthread_mutex_lock(&_pool.lock);
+
+    if (_pool.workers_count == 0)
+        goto exit;
+
+    _pool.must_stop = 1;
+    __sync_fetch_and_add(&_pool.work_sequence, 1);
+    mt_futex_wake(&_pool.work_sequence, INT_MAX);
+
+    for (worker_index = 0; worker_index < _pool.workers_count; 
+                worker_index ++)
+        pthread_join(_pool.workers[worker_index].thread, 0);
+
+    for (worker_index = 0; worker_index < _pool.workers_count; 
+                worker_index ++) {
+        assert(mt_ring_get_length(_pool.workers[worker_index].tasks) == 0);
+        mt_ring_destroy(_pool.workers[worker_index].tasks);
+    }
+
+    free(_pool.workers);
+    _pool.workers = 0;
+    _pool.workers_count = 0;
+
+exit:
+    pthread_mutex_unlock(&_pool.lock);
+}
+
+uint16_t
+mt_workers_get_count(void)
+{
+    return _pool.workers_count;
+}
+
+void
+mt_workers_submit
+            (mt_workers_task_t * task)
+{
+    uint16_t worker_index;
+
+    assert(_pool.workers_count != 0);
+
+    worker_index = _current_worker != 0 ? _current_worker->index 
+                : task->affinity % _pool.workers_count;
+
+    /* The preferred queue is full, try the others */
+    while (mt_ring_push(_pool.workers[worker_index].tasks, &task) != 0) {
+        worker_index = (worker_index + 1) % _pool.workers_count;
+
+        if (worker_index == 0)
+            sched_yield();
+    }
+
+    __sync_synchronize();
+
+    if (_pool.idle_workers != 0) {
+        __sync_fetch_and_add(&_pool.work_sequence, 1);
+        mt_futex_wake(&_pool.work_sequence, 1);
+    }
+}
+
+static void *
+_worker_thread
+            (void * argument)
+{
+    sigset_t blocked_signal;
+    mt_workers_task_t * task;
+    _worker_t * worker;
+    int work_sequence;
+
+    worker = argument;
+    _current_worker = worker;
+
+    sigemptyset(&blocked_signal);
+    sigaddset(&blocked_signal, SIGTERM);
+    sigaddset(&blocked_signal, SIGKILL);
+    pthread_sigmask(SIG_BLOCK, &blocked_signal, 0);
+
+    while (_pool.must_stop == 0) {
+        if ((task = _get_task(worker)) != 0) {
+            (*task->run)(task->data);
+            continue;
+        }
+
+        /* Announce we are going to sleep, then look again for tasks 
+         * to not miss one submitted in between.
+         */
+        __sync_fetch_and_add(&_pool.idle_workers, 1);
+        work_sequence = _pool.work_sequence;
+
+        if ((task = _get_task(worker)) == 0 && _pool.must_stop == 0)
+            mt_futex_wait(&_pool.work_sequence, work_sequence, 0);
+
+        __sync_fetch_and_sub(&_pool.idle_workers, 1);
+
+        if (task != 0)
+            (*task->run)(task->data);
+    }
+
+    pthread_exit(0);
+}
+
+/* Take a task from the worker's own queue, else steal one */
+static mt_workers_task_t *
+_get_task
+            (_worker_t * worker)
+{
+    mt_workers_task_t * task;
+    uint16_t worker_index;
+    uint16_t step;
+
+    for (step = 0; step < _pool.workers_count; step ++) {
+        worker_index = (worker->index + step) % _pool.workers_count;
+
+        if (mt_ring_pop(_pool.workers[worker_index].tasks, &task) == 0)
+            return task;
+    }
+
+    return 0;
+}
@@ -0,0 +1,39 @@
+/*
+ *  workers.h
+ *  irtouchd workers pool private header
+ *
+ *  Created by David Keller on 09/11/08.
+ *  Copyright 2008 EFREI. All rights reserved.
+ *
+ */
+
+#ifndef _WORKERS_H_
+#define _WORKERS_H_
+
+#include <stdint.h>
+
+typedef struct
+{
+    void
+    (*run)
+                (void * data);
+
+    void * data;
+
+    /* Index of the worker the task is given to when it is submitted
+     * from outside of the pool, modulo the workers count.
+     */
+    uint16_t affinity;
+}
+mt_workers_task_t;
+
+/**
+ * Queue 'task' to be run once by the pool, which must be started. Tasks 
+ * submitted by a worker are queued on its own queue, idle workers steal 
+ * tasks from the others' queues.
+ */
+extern void
+mt_workers_submit
+            (mt_workers_task_t * task);
+
+#endif